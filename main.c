@@ -0,0 +1,424 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "readability.h"
+
+// Sink that writes each rendering to stdout with a single write
+static int write_stdout(const char *data, size_t length, void *userdata)
+{
+    (void)userdata;
+    return fwrite(data, 1, length, stdout) == length ? 0 : -1;
+}
+
+// Vectored sink that writes the pieces of a rendering to stdout with writev,
+// after whatever stdout still buffers
+static int write_stdout_pieces(const struct iovec *pieces, int count, void *userdata)
+{
+    (void)userdata;
+    if (fflush(stdout) != 0)
+        return -1;
+
+    int index = 0;
+    size_t offset = 0; // bytes of pieces[index] already written
+    while (index < count)
+    {
+        ssize_t written = offset > 0 ? write(STDOUT_FILENO, (const char *)pieces[index].iov_base + offset,
+                                             pieces[index].iov_len - offset)
+                                     : writev(STDOUT_FILENO, pieces + index, count - index);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        offset += (size_t)written;
+        while (index < count && offset >= pieces[index].iov_len)
+            offset -= pieces[index++].iov_len;
+    }
+    return 0;
+}
+
+// Sink that writes to the FILE passed as userdata; each record is a single
+// fwrite, so records from several threads do not interleave
+static int write_file(const char *data, size_t length, void *userdata)
+{
+    return fwrite(data, 1, length, (FILE *)userdata) == length ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+    clock_t start_time = clock();
+    const char *url = NULL;
+    const char *patterns_path = NULL;
+    const char *batch_path = NULL;
+    const char *file_path = NULL;
+    const char *base_url = NULL;
+    const char *bench_path = NULL;
+    const char *serve_address = NULL;
+    const char *cache_dir = NULL;
+    const char *templates_path = NULL;
+    const char *metrics_path = NULL;
+    const char *metrics_format = "prometheus";
+    const char *trace_path = NULL;
+    const char *format_name = NULL;
+    const char *engine_name = "dom";
+    long cache_size = 256;
+    long cache_ttl = 0;
+    int templates_max = 1024;
+    readability_limits_t limits = {0, 0, 512, 0};
+    readability_fetch_options_t fetch_options = {10000, 30000, 5, 64};
+    int iterations = 5;
+    int concurrency = 16;
+    int per_host = 2;
+    int threads = 1;
+    long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = cpu_count > 0 ? (int)cpu_count : 4;
+    int queue_size = 256;
+    int json_output = 0;
+    int check_only = 0;
+    int skip_unreaderable = 0;
+    int self_test = 0;
+    int usage_error = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-json") == 0)
+        {
+            json_output = 1;
+        }
+        else if (strcmp(argv[i], "-check") == 0)
+        {
+            check_only = 1;
+        }
+        else if (strcmp(argv[i], "-skip-unreaderable") == 0)
+        {
+            skip_unreaderable = 1;
+        }
+        else if (strcmp(argv[i], "-selftest") == 0)
+        {
+            self_test = 1;
+        }
+        else if (strcmp(argv[i], "-format") == 0 && i + 1 < argc)
+        {
+            format_name = argv[++i];
+        }
+        else if (strcmp(argv[i], "-engine") == 0 && i + 1 < argc)
+        {
+            engine_name = argv[++i];
+        }
+        else if (strcmp(argv[i], "-patterns") == 0 && i + 1 < argc)
+        {
+            patterns_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "-batch") == 0 && i + 1 < argc)
+        {
+            batch_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "-file") == 0 && i + 1 < argc)
+        {
+            file_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "-base-url") == 0 && i + 1 < argc)
+        {
+            base_url = argv[++i];
+        }
+        else if (strcmp(argv[i], "-") == 0 && !file_path)
+        {
+            file_path = "-";
+        }
+        else if (strcmp(argv[i], "-bench") == 0 && i + 1 < argc)
+        {
+            bench_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "-iterations") == 0 && i + 1 < argc)
+        {
+            iterations = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-concurrency") == 0 && i + 1 < argc)
+        {
+            concurrency = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-per-host") == 0 && i + 1 < argc)
+        {
+            per_host = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc)
+        {
+            threads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-serve") == 0 && i + 1 < argc)
+        {
+            serve_address = argv[++i];
+        }
+        else if (strcmp(argv[i], "-workers") == 0 && i + 1 < argc)
+        {
+            workers = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-queue") == 0 && i + 1 < argc)
+        {
+            queue_size = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-cache") == 0 && i + 1 < argc)
+        {
+            cache_dir = argv[++i];
+        }
+        else if (strcmp(argv[i], "-cache-size") == 0 && i + 1 < argc)
+        {
+            cache_size = atol(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-cache-ttl") == 0 && i + 1 < argc)
+        {
+            cache_ttl = atol(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-templates") == 0 && i + 1 < argc)
+        {
+            templates_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "-templates-max") == 0 && i + 1 < argc)
+        {
+            templates_max = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-max-bytes") == 0 && i + 1 < argc)
+        {
+            limits.max_input_bytes = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "-max-nodes") == 0 && i + 1 < argc)
+        {
+            limits.max_nodes = atol(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-max-depth") == 0 && i + 1 < argc)
+        {
+            limits.max_depth = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-max-ms") == 0 && i + 1 < argc)
+        {
+            limits.max_milliseconds = atol(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-connect-timeout") == 0 && i + 1 < argc)
+        {
+            fetch_options.connect_timeout_ms = atol(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-timeout") == 0 && i + 1 < argc)
+        {
+            fetch_options.timeout_ms = atol(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-max-redirects") == 0 && i + 1 < argc)
+        {
+            fetch_options.max_redirects = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-max-body") == 0 && i + 1 < argc)
+        {
+            fetch_options.max_body_bytes = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "-metrics") == 0 && i + 1 < argc)
+        {
+            metrics_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "-metrics-format") == 0 && i + 1 < argc)
+        {
+            metrics_format = argv[++i];
+        }
+        else if (strcmp(argv[i], "-trace") == 0 && i + 1 < argc)
+        {
+            trace_path = argv[++i];
+        }
+        else if (argv[i][0] != '-' && !url)
+        {
+            url = argv[i];
+        }
+        else
+        {
+            usage_error = 1;
+        }
+    }
+
+    // -json is short for -format json; batches default to NDJSON
+    readability_format_t format = batch_path ? READABILITY_NDJSON : READABILITY_TEXT;
+    if (json_output && !format_name)
+        format_name = "json";
+    if (format_name)
+    {
+        if (strcmp(format_name, "text") == 0)
+            format = READABILITY_TEXT;
+        else if (strcmp(format_name, "json") == 0)
+            format = READABILITY_JSON;
+        else if (strcmp(format_name, "ndjson") == 0)
+            format = READABILITY_NDJSON;
+        else if (strcmp(format_name, "cbor") == 0)
+            format = READABILITY_CBOR;
+        else
+            usage_error = 1;
+    }
+
+    if (usage_error || (!!url + !!batch_path + !!file_path + !!bench_path + !!serve_address + self_test) != 1 || (check_only && skip_unreaderable) || workers < 1 || queue_size < 1 || threads < 1 ||
+        cache_size < 1 || cache_ttl < 0 || templates_max < 1 || limits.max_nodes < 0 || limits.max_depth < 0 || limits.max_milliseconds < 0 ||
+        fetch_options.connect_timeout_ms < 0 || fetch_options.timeout_ms < 0 ||
+        (strcmp(engine_name, "dom") != 0 && strcmp(engine_name, "stream") != 0) ||
+        (strcmp(metrics_format, "prometheus") != 0 && strcmp(metrics_format, "json") != 0))
+    {
+        fprintf(stderr, "Usage: %s <url> [-json | -format <format>] [-patterns <file>] [<cache options>]\n", argv[0]);
+        fprintf(stderr, "       %s -file <path|-> [-base-url <url>] [-json | -format <format>] [-engine dom|stream] [-patterns <file>]\n", argv[0]);
+        fprintf(stderr, "       %s -batch <list|-> [-format ndjson|cbor] [-engine dom|stream] [-concurrency <n>] [-per-host <n>] [-patterns <file>] [<cache options>]\n", argv[0]);
+        fprintf(stderr, "       %s -bench <dir> [-iterations <n>] [-json] [-patterns <file>]\n", argv[0]);
+        fprintf(stderr, "       %s -serve <[host:]port|unix:path> [-workers <n>] [-queue <n>] [-patterns <file>] [<cache options>]\n", argv[0]);
+        fprintf(stderr, "       %s -selftest\n", argv[0]);
+        fprintf(stderr, "Formats: text, json, ndjson, cbor\n");
+        fprintf(stderr, "Cache options: -cache <dir> [-cache-size <MB>] [-cache-ttl <seconds>]\n");
+        fprintf(stderr, "Readerable check (URLs, files, batches, server): -check | -skip-unreaderable\n");
+        fprintf(stderr, "Templates (any mode): -templates <file> [-templates-max <n>]\n");
+        fprintf(stderr, "Limits (any mode): -max-bytes <n> -max-nodes <n> -max-depth <n> -max-ms <n>\n");
+        fprintf(stderr, "Scoring threads for pages of 1 MB or more (any mode): -threads <n>\n");
+        fprintf(stderr, "Fetch options: -connect-timeout <ms> -timeout <ms> -max-redirects <n> -max-body <MB>\n");
+        fprintf(stderr, "Observability: -metrics <file> [-metrics-format prometheus|json] -trace <file>\n");
+        return 1;
+    }
+
+    // The kernel tests need neither the libraries nor a context
+    if (self_test)
+        return readability_self_test(write_stdout, NULL);
+
+    if (readability_global_init() < 0)
+    {
+        fprintf(stderr, "Error: unable to initialize libraries\n");
+        return 1;
+    }
+
+    FILE *trace_file = NULL;
+    if (trace_path && !(trace_file = fopen(trace_path, "a")))
+    {
+        fprintf(stderr, "Error: unable to open trace file %s\n", trace_path);
+        readability_global_cleanup();
+        return 1;
+    }
+
+    readability_context_t *ctx = readability_context_new(patterns_path);
+    readability_cache_t *cache = NULL;
+    readability_templates_t *templates = NULL;
+    if (!ctx && patterns_path)
+        fprintf(stderr, "Error: unable to load pattern file %s: %s\n", patterns_path, strerror(errno));
+    else if (!ctx)
+        fprintf(stderr, "Error: unable to create context: %s\n", strerror(errno));
+    if (ctx)
+    {
+        fetch_options.max_body_bytes *= 1024 * 1024;
+        readability_context_set_limits(ctx, &limits);
+        readability_context_set_fetch_options(ctx, &fetch_options);
+        readability_context_set_threads(ctx, threads);
+        if (check_only || skip_unreaderable)
+            readability_context_set_check(ctx, check_only ? READABILITY_CHECK_ONLY : READABILITY_CHECK_SKIP);
+        if (strcmp(engine_name, "stream") == 0)
+            readability_context_set_engine(ctx, READABILITY_ENGINE_STREAM);
+        if (trace_file)
+            readability_context_set_trace(ctx, write_file, trace_file);
+        if (format == READABILITY_CBOR)
+            readability_context_set_sinkv(ctx, write_stdout_pieces);
+    }
+    if (ctx && cache_dir)
+    {
+        cache = readability_cache_open(cache_dir, (size_t)cache_size * 1024 * 1024, cache_ttl);
+        if (!cache)
+            fprintf(stderr, "Error: unable to open cache directory %s: %s\n", cache_dir, strerror(errno));
+        readability_context_set_cache(ctx, cache);
+    }
+    if (ctx && (cache || !cache_dir) && templates_path)
+    {
+        templates = readability_templates_open(templates_path, templates_max);
+        if (!templates)
+            fprintf(stderr, "Error: unable to load template file %s: %s\n", templates_path, strerror(errno));
+        readability_context_set_templates(ctx, templates);
+    }
+    if (!ctx || (cache_dir && !cache) || (templates_path && !templates))
+    {
+        readability_context_free(ctx);
+        readability_cache_close(cache);
+        readability_templates_close(templates);
+        if (trace_file)
+            fclose(trace_file);
+        readability_global_cleanup();
+        return 1;
+    }
+
+    int status = 0;
+    if (bench_path)
+    {
+        status = readability_benchmark(ctx, bench_path, iterations, json_output, write_stdout, NULL);
+        if (status != 0)
+            fprintf(stderr, "Error: %s\n", readability_error(ctx));
+    }
+    else if (serve_address)
+    {
+        fprintf(stderr, "Serving on %s with %d workers\n", serve_address, workers);
+        status = readability_serve(ctx, serve_address, workers, queue_size);
+        if (status != 0)
+            fprintf(stderr, "Error: %s\n", readability_error(ctx));
+        else
+            fprintf(stderr, "Shut down\n");
+    }
+    else if (batch_path)
+    {
+        int failures = readability_run_batch(ctx, batch_path, concurrency, per_host, format, write_stdout, NULL);
+        if (failures < 0)
+            fprintf(stderr, "Error: %s\n", readability_error(ctx));
+        else if (failures > 0)
+            fprintf(stderr, "Error: %d documents failed; see their error records\n", failures);
+        status = failures < 0 ? 1 : 0;
+    }
+    else
+    {
+        const char *source = file_path ? file_path : url;
+        int result = file_path || !readability_is_url(url)
+                         ? readability_extract_file(ctx, source, base_url, format, write_stdout, NULL)
+                         : readability_extract_url(ctx, source, format, write_stdout, NULL);
+        if (result < 0)
+        {
+            fprintf(stderr, "Error: %s: %s\n", readability_error(ctx), source);
+            status = 1;
+        }
+        else if (!check_only)
+        {
+            if (!readability_found_article(ctx))
+                fprintf(stderr, "Error: Failed to extract article content\n");
+            if (format == READABILITY_TEXT)
+                printf("\n\nArticle extracted\n");
+        }
+    }
+
+    readability_context_free(ctx);
+    readability_cache_close(cache);
+    if (readability_templates_close(templates) < 0)
+        fprintf(stderr, "Error: unable to write template file %s: %s\n", templates_path, strerror(errno));
+    if (trace_file)
+        fclose(trace_file);
+
+    // JSON metrics accumulate one line per run; Prometheus text is replaced
+    int metrics_json = strcmp(metrics_format, "json") == 0;
+    FILE *metrics_file = metrics_path ? fopen(metrics_path, metrics_json ? "a" : "w") : NULL;
+    if (metrics_file)
+    {
+        readability_metrics_write(metrics_json ? READABILITY_METRICS_JSON : READABILITY_METRICS_PROMETHEUS,
+                                  write_file, metrics_file);
+        fclose(metrics_file);
+    }
+    else if (metrics_path)
+    {
+        fprintf(stderr, "Error: unable to write metrics to %s\n", metrics_path);
+    }
+    readability_global_cleanup();
+
+    if (status == 0 && format == READABILITY_TEXT && !batch_path && !bench_path && !serve_address)
+    {
+        clock_t end_time = clock();
+        double execution_time = (double)(end_time - start_time) / CLOCKS_PER_SEC;
+        printf("Execution time: %f seconds\n", execution_time);
+
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        printf("Memory usage: %ld MB\n", usage.ru_maxrss / 1024);
+    }
+
+    return status;
+}
@@ -1,696 +1,9205 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
 #include <string.h>
-#include <regex.h>
+#include <ctype.h>
 #include <curl/curl.h>
 #include <time.h>
 #include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <libxml/HTMLparser.h>
-#include <libxml/xpath.h>
 #include <libxml/tree.h>
 #include <libxml/uri.h>
+#include <libxml/xmlmemory.h>
+#include <libxml/xmlerror.h>
+#include "readability.h"
 
 
-#define MAX_CANDIDATES 1000
 #define MAX_BUFFER 8192
 
-// A struct to hold the downloaded HTML content
-struct MemoryStruct
+#define MATCH_POSITIVE 0x01
+#define MATCH_NEGATIVE 0x02
+
+#define ARENA_ALIGN 16
+#define ARENA_CHUNK_SIZE (64 * 1024)    // first chunk, kept across resets
+#define ARENA_CHUNK_MAX (1024 * 1024)   // chunks grow with the arena up to this
+#define ARENA_LARGE (32 * 1024)         // bigger requests go straight to malloc
+#define ARENA_POOL_MAX 64
+
+// A region that an arena hands out by bumping an offset
+typedef struct arena_chunk
+{
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+} arena_chunk_t;
+
+// Per-document allocator: everything libxml2 and the extractor allocate
+// for one document comes from its chunks and is released by one reset
+typedef struct arena
+{
+    arena_chunk_t *chunks; // newest first; allocations come from the head
+    size_t allocated;
+    struct arena *pool_next;
+} arena_t;
+
+// Header in front of every block handed to libxml2, so that free and
+// realloc can tell arena blocks (owner set) from malloc blocks (owner NULL)
+typedef struct
+{
+    size_t size;
+    arena_t *owner;
+} alloc_header_t;
+
+// Input document held either in a read-only file mapping or a heap buffer
+typedef struct
+{
+    char *data;
+    size_t size;
+    int mapped;
+} input_buffer_t;
+
+// Growable in-memory output buffer
+typedef struct
+{
+    char *data;
+    size_t length;
+    size_t capacity;
+} strbuf_t;
+
+// Element names the extractor treats specially
+typedef enum
+{
+    TAG_OTHER,
+    TAG_A,
+    TAG_AD,
+    TAG_ADDRESS,
+    TAG_ARTICLE,
+    TAG_ASIDE,
+    TAG_B,
+    TAG_BASE,
+    TAG_BLOCKQUOTE,
+    TAG_BODY,
+    TAG_BR,
+    TAG_DD,
+    TAG_DIV,
+    TAG_DL,
+    TAG_DT,
+    TAG_EM,
+    TAG_FIGURE,
+    TAG_FORM,
+    TAG_H1,
+    TAG_H2,
+    TAG_H3,
+    TAG_H4,
+    TAG_H5,
+    TAG_H6,
+    TAG_HEAD,
+    TAG_HTML,
+    TAG_I,
+    TAG_IFRAME,
+    TAG_INS,
+    TAG_LI,
+    TAG_LINK,
+    TAG_META,
+    TAG_NOSCRIPT,
+    TAG_OL,
+    TAG_P,
+    TAG_PRE,
+    TAG_SCRIPT,
+    TAG_STRONG,
+    TAG_STYLE,
+    TAG_TD,
+    TAG_TH,
+    TAG_TITLE,
+    TAG_UL,
+    TAG_COUNT
+} tag_t;
+
+// Tag flags
+#define TAG_UNWANTED 0x01  // removed with its subtree before scoring
+#define TAG_PARAGRAPH 0x02 // scored as a block of article text
+
+// How html_to_markdown renders an element
+typedef enum
+{
+    MD_BLOCK, // prefix, children, suffix
+    MD_LINK,  // [children](href) when the element has an href
+    MD_ITEM   // newline, indentation by depth and a bullet
+} markdown_kind_t;
+
+// Per-tag scoring weight and rendering rule
+typedef struct
+{
+    const char *name;
+    int flags;
+    int content_score;
+    markdown_kind_t markdown;
+    const char *prefix;
+    const char *suffix;
+} tag_info_t;
+
+// A struct to hold candidate information
+typedef struct
+{
+    xmlNodePtr node;
+    double content_score;
+} candidate_t;
+
+// Candidates stored contiguously in insertion order, indexed by node through
+// an open-addressing hash table whose slots hold index + 1 (0 marks empty)
+typedef struct
+{
+    candidate_t *items;
+    int count;
+    int capacity;
+    int *slots;
+    int slot_count;
+} candidate_table_t;
+
+// Text statistics of an element, gathered by annotate_tree
+typedef struct
+{
+    int text_length;
+    int link_length;
+    int comma_count;
+    int has_period;
+} node_stats_t;
+
+#define NODE_STATS_BLOCK 1024
+
+// Statistics are allocated in fixed blocks so their addresses stay stable
+typedef struct node_stats_block
+{
+    struct node_stats_block *next;
+    int used;
+    node_stats_t stats[NODE_STATS_BLOCK];
+} node_stats_block_t;
+
+// Side table produced by one annotation pass over the document
+typedef struct
+{
+    node_stats_block_t *blocks;
+    long element_count;
+    xmlNodePtr *paragraphs;
+    int paragraph_count;
+    int paragraph_capacity;
+} annotation_t;
+
+// Elements chosen for the article, referenced in place in the original
+// document and rendered in this order
+typedef struct
+{
+    xmlNodePtr *nodes;
+    int count;
+    int capacity;
+    xmlNodePtr top; // the top candidate, NULL when none was found
+    double score;   // its content score
+} article_nodes_t;
+
+// Limits a document can hit, as bits of work_budget_t.hit
+#define LIMIT_INPUT 0x01
+#define LIMIT_NODES 0x02
+#define LIMIT_DEPTH 0x04
+#define LIMIT_TIME 0x08
+#define LIMIT_MEMORY 0x10 // the streaming engine dropped text the article needed
+
+// Work still done once the time budget is spent, so that a slow page yields
+// its lead rather than nothing
+#define BUDGET_MIN_NODES 4096
+#define BUDGET_MIN_PARAGRAPHS 64
+#define BUDGET_MIN_MARKDOWN 4096
+
+#define LIMIT_COUNT 5
+
+static const char *limit_names[LIMIT_COUNT] = {"input", "nodes", "depth", "time", "memory"};
+
+// Work budget of the document being extracted, set from the context's
+// limits when its extraction starts
+typedef struct
+{
+    long max_nodes;
+    int max_depth;
+    double deadline; // 0 without a time limit
+    unsigned int ticks;
+    unsigned int hit;
+} work_budget_t;
+
+// Pipeline stages timed by the metrics and the trace spans
+typedef enum
+{
+    METRIC_FETCH,    // download, with the parse that streams alongside it
+    METRIC_PARSE,    // parse of a document already in memory
+    METRIC_CHECK,    // readerable check, when asked for
+    METRIC_CLEANUP,  // removal of unwanted elements
+    METRIC_SCORING,  // annotation and paragraph scoring
+    METRIC_ASSEMBLY, // metadata and the siblings of the top candidate
+    METRIC_RENDER,   // Markdown and the requested output format
+    METRIC_STAGE_COUNT
+} metric_stage_t;
+
+static const char *metric_stage_names[METRIC_STAGE_COUNT] = {"fetch",   "parse",    "check", "cleanup",
+                                                             "scoring", "assembly", "render"};
+
+// Why documents fail, as counted by the metrics
+typedef enum
+{
+    FAILURE_FETCH,
+    FAILURE_TIMEOUT,
+    FAILURE_REDIRECTS,
+    FAILURE_TOO_LARGE,
+    FAILURE_PARSE,
+    FAILURE_READ,
+    FAILURE_NOT_MODIFIED,
+    FAILURE_OUTPUT,
+    FAILURE_NOT_READERABLE,
+    FAILURE_OTHER,
+    FAILURE_COUNT
+} failure_reason_t;
+
+static const char *failure_names[FAILURE_COUNT] = {"fetch", "timeout",      "redirects", "too_large",      "parse",
+                                                   "read",  "not_modified", "output",    "not_readerable", "other"};
+
+#define METRIC_BUCKET_COUNT 16
+
+// Upper bounds in seconds of the latency histogram buckets; one more bucket
+// takes everything slower
+static const double metric_buckets[METRIC_BUCKET_COUNT] = {0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005,
+                                                           0.01,   0.025,   0.05,   0.1,   0.25,   0.5,
+                                                           1,      2.5,     5,      10};
+
+typedef struct
+{
+    uint64_t counts[METRIC_BUCKET_COUNT + 1];
+    uint64_t sum_ns;
+} metric_histogram_t;
+
+// Metrics of one context. Only the thread using the context updates them,
+// but exporters read them from any thread, so every access is a relaxed
+// atomic: no locks and no contention on the extraction path.
+typedef struct metrics_shard
+{
+    struct metrics_shard *prev;
+    struct metrics_shard *next;
+    metric_histogram_t stages[METRIC_STAGE_COUNT];
+    metric_histogram_t documents_seconds;
+    uint64_t documents;
+    uint64_t failures[FAILURE_COUNT];
+    uint64_t cache_hits;
+    uint64_t template_hits;
+    uint64_t template_misses;
+    uint64_t not_readerable;
+    uint64_t empty_articles;
+    uint64_t limits_hit[LIMIT_COUNT];
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t nodes;
+    uint64_t paragraphs;
+    uint64_t candidates;
+} metrics_shard_t;
+
+// Stage timings and sizes of the document being extracted, folded into the
+// metrics and sent to the trace sink once it is done
+typedef struct
+{
+    double start;
+    double stage_start[METRIC_STAGE_COUNT];
+    double stage_seconds[METRIC_STAGE_COUNT];
+    unsigned int stages_run; // bit per metric_stage_t
+    size_t bytes_in;
+    long nodes;
+    int paragraphs;
+    int candidates;
+    int cached;
+    int empty;
+    int template_hit;   // the site's template led to the article
+    int template_miss;  // it was tried, and the whole document scored after all
+    int readerable;     // the readerable check passed
+    int not_readerable; // it failed
+} doc_trace_t;
+
+// Article metadata fields, in output order
+typedef enum
+{
+    META_TITLE,
+    META_AUTHOR,
+    META_DESCRIPTION,
+    META_SITE_NAME,
+    META_PUBLISHED_TIME,
+    META_MODIFIED_TIME,
+    META_CANONICAL_URL,
+    META_LANGUAGE,
+    META_LEAD_IMAGE,
+    META_FIELD_COUNT
+} metadata_field_t;
+
+// Metadata gathered in one walk of the document. Every field remembers the
+// priority of the source that set it so a better source can replace it
+// whatever order the page declares them in (lower wins).
+typedef struct
+{
+    xmlChar *fields[META_FIELD_COUNT];
+    int priority[META_FIELD_COUNT];
+    xmlChar *base_url;
+} article_metadata_t;
+
+// A JSON value parsed from a JSON-LD block; members of arrays and objects
+// are chained through next, and object members carry their key
+typedef enum
+{
+    JSON_NULL,
+    JSON_BOOL,
+    JSON_NUMBER,
+    JSON_STRING,
+    JSON_ARRAY,
+    JSON_OBJECT
+} json_type_t;
+
+typedef struct json_value
+{
+    json_type_t type;
+    char *key;
+    char *string;
+    struct json_value *children;
+    struct json_value *next;
+} json_value_t;
+
+// What a transfer returned besides the document: the status, the size and
+// the cache validators of the final response
+typedef struct
+{
+    long status;
+    size_t size;
+    char *etag;
+    char *last_modified;
+    int truncated;            // the body went past the input limit and was cut short
+    double elapsed;           // seconds the transfer took
+    failure_reason_t failure; // what a failed transfer is counted as
+} fetch_response_t;
+
+// A transfer parsed incrementally: every chunk received is fed straight to
+// the HTML push parser, in the arena the document will live in, instead of
+// being buffered. Bytes past max_bytes (0 for no limit) end the transfer.
+typedef struct
+{
+    htmlParserCtxtPtr parser;
+    arena_t *arena;
+    const char *url;
+    size_t max_bytes;
+    fetch_response_t response;
+} fetch_parser_t;
+
+// DNS cache, connection pool and TLS sessions shared by every transfer,
+// with one lock per kind of data
+static CURLSH *fetch_share;
+static pthread_mutex_t fetch_share_locks[CURL_LOCK_DATA_LAST];
+
+// A URL waiting for or undergoing a transfer in the fetch engine: next links
+// the pending jobs of its host, next and prev the jobs in flight
+typedef struct fetch_job
+{
+    struct fetch_job *next;
+    struct fetch_job *prev;
+    struct fetch_host *host;
+    char *url;
+    CURL *handle;
+    fetch_parser_t body;
+    struct curl_slist *request_headers;
+    double started;
+    void *userdata;
+} fetch_job_t;
+
+// Per-host queue of pending jobs. Hosts that have pending jobs and spare
+// capacity sit in a circular ready ring that the scheduler walks round-robin.
+typedef struct fetch_host
+{
+    struct fetch_host *hash_next;
+    struct fetch_host *ring_prev;
+    struct fetch_host *ring_next;
+    char *name;
+    fetch_job_t *head;
+    fetch_job_t *tail;
+    int active;
+    int in_ring;
+} fetch_host_t;
+
+// Called once per job with the parsed document (owned by the callee) and the
+// response, or with an error message. A 304 answer comes without a document
+// and without an error.
+typedef void (*fetch_done_fn)(const char *url, htmlDocPtr doc, fetch_response_t *response, const char *error, void *userdata);
+
+// Concurrent fetcher built on the curl multi interface
+typedef struct
+{
+    CURLM *multi;
+    int max_active;
+    int max_per_host;
+    int active;
+    int pending;
+    fetch_host_t **buckets;
+    int bucket_count;
+    int host_count;
+    fetch_host_t *ring;
+    fetch_job_t *running;
+    size_t max_bytes;
+    const readability_fetch_options_t *options;
+    fetch_done_fn on_done;
+} fetch_engine_t;
+
+#define CACHE_MAGIC "RDC1"
+#define CACHE_ABSENT UINT32_MAX
+
+// Layout of a cache file: this header, then the URL, the validators, every
+// metadata field and the Markdown content, each NUL-terminated and in that
+// order. Absent strings have length CACHE_ABSENT and take no bytes.
+typedef struct
+{
+    char magic[4];
+    uint32_t url_length;
+    uint32_t etag_length;
+    uint32_t last_modified_length;
+    uint32_t field_lengths[META_FIELD_COUNT];
+    uint64_t content_length;
+} cache_header_t;
+
+// An entry known to be on disk. Entries are hashed by the hash of their URL,
+// which also names their file, and kept on a list from most to least
+// recently used.
+typedef struct cache_entry
+{
+    uint64_t key;
+    size_t size;
+    time_t fetched;
+    struct cache_entry *hash_next;
+    struct cache_entry *lru_prev;
+    struct cache_entry *lru_next;
+} cache_entry_t;
+
+// On-disk cache of extraction results keyed by URL. The index lives in
+// memory and is rebuilt from the directory at startup; files are written
+// whole and renamed into place, so readers can map them without locking.
+typedef struct readability_cache
+{
+    char *dir;
+    size_t max_bytes;
+    size_t total_bytes;
+    long ttl;
+    pthread_mutex_t lock;
+    cache_entry_t **buckets;
+    int bucket_count;
+    int count;
+    cache_entry_t *lru_head;
+    cache_entry_t *lru_tail;
+} page_cache_t;
+
+// A cache file mapped for reading; the strings point into the mapping
+typedef struct
+{
+    void *map;
+    size_t size;
+    time_t fetched;
+    const char *etag;
+    const char *last_modified;
+    const char *fields[META_FIELD_COUNT];
+    const char *content;
+    size_t content_length;
+} cache_hit_t;
+
+#define TEMPLATE_MAGIC "RDT1"
+#define TEMPLATE_MAX_PATH 4096 // deeper containers are not remembered
+#define TEMPLATE_MIN_SCORE 20  // a container scoring less is not trusted
+
+// The container of the articles of one site: the path from the root element
+// down to it, one "tag<TAB>index<TAB>class<TAB>id" step per level, joined by
+// tabs. index counts the earlier siblings with the same tag, class and id.
+typedef struct
+{
+    char *host;
+    char *path;
+    uint64_t used; // tick of its last use, for eviction
+} site_template_t;
+
+// Templates of up to max_hosts sites, loaded from path when opened and
+// written back when closed. Templates are stored in insertion order and
+// indexed by host through an open-addressing table whose slots hold index
+// + 1 (0 marks empty); the least recently used one makes room for a new
+// site once the store is full.
+typedef struct readability_templates
+{
+    char *path;
+    int max_hosts;
+    pthread_mutex_t lock;
+    site_template_t *items;
+    int count;
+    int *slots;
+    int slot_count;
+    uint64_t clock;
+    int dirty;
+} template_store_t;
+
+// Shared by the download callbacks of one batch
+typedef struct
+{
+    readability_context_t *ctx;
+    readability_format_t format;
+    readability_sink_fn sink;
+    void *userdata;
+    int failures;
+} batch_t;
+
+#define SERVE_MAX_HEADER (16 * 1024)
+#define SERVE_MAX_BODY (32 * 1024 * 1024)
+#define SERVE_MAX_EVENTS 256
+#define SERVE_MAX_FETCHES_PER_HOST 8
+#define SERVE_FETCH_POLL_MS 1000
+#define SERVE_JSON "application/json"
+#define SERVE_PROMETHEUS "text/plain; version=0.0.4"
+
+// A client connection of the extraction server. Requests on one connection
+// are answered in order: while one is with the worker pool, later pipelined
+// bytes stay buffered in input.
+typedef struct serve_conn
+{
+    struct serve_conn *prev;
+    struct serve_conn *next;
+    int fd;
+    strbuf_t input;
+    strbuf_t output;
+    size_t output_sent;
+    int busy;       // a request is being extracted
+    int keep_alive; // the last request allows further ones
+    int eof;        // the client has finished sending
+    int continued;  // 100 Continue was sent for the buffered request
+    int closed;     // the socket is gone; freed once no job refers to it
+} serve_conn_t;
+
+// One extraction handed to the worker pool: fetch url, or extract body with
+// url (if any) as its base URL. The worker fills response.
+typedef struct serve_job
+{
+    struct serve_job *next;
+    struct serve_pool *pool;
+    serve_conn_t *conn;
+    char *url;
+    char *body;
+    size_t body_size;
+    int keep_alive;
+    cache_hit_t hit;      // the cached copy of url, when cached is set
+    int cached;
+    int fetched;          // the event loop downloaded url into doc and fetch
+    htmlDocPtr doc;
+    fetch_response_t fetch;
+    const char *error;
+    strbuf_t response;
+} serve_job_t;
+
+// A worker thread of the pool with the extraction context it owns
+typedef struct
+{
+    pthread_t thread;
+    struct serve_pool *pool;
+    readability_context_t *ctx;
+} serve_worker_t;
+
+// Bounded worker pool. Finished jobs are queued on done and signalled
+// through an eventfd that the event loop polls.
+typedef struct serve_pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    serve_job_t *head;
+    serve_job_t *tail;
+    serve_job_t *done;
+    int outstanding; // queued, running or awaiting delivery
+    int capacity;
+    int stopping;
+    int event_fd;
+    serve_worker_t *workers;
+    int thread_count;
+} serve_pool_t;
+
+// Extraction server state. Connections are retired to the graveyard when
+// they close and freed after the current batch of events, so an event that
+// is still pending in that batch never sees freed memory. Pages requested
+// by URL are downloaded by fetches, which the event loop drives.
+typedef struct
+{
+    int epoll_fd;
+    int listen_fd;
+    readability_context_t *ctx;
+    serve_pool_t pool;
+    fetch_engine_t fetches;
+    serve_conn_t *connections;
+    serve_conn_t *graveyard;
+} server_t;
+
+// Arena that allocations of the calling thread are served from, if any
+static __thread arena_t *current_arena;
+
+// Reset arenas kept for reuse
+static arena_t *arena_pool;
+static int arena_pool_size;
+static pthread_mutex_t arena_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define ARENA_ROUND(size) (((size) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define ARENA_CHUNK_HEADER ARENA_ROUND(sizeof(arena_chunk_t))
+
+// Function to return the first usable byte of a chunk
+static inline char *arena_chunk_data(arena_chunk_t *chunk)
+{
+    return (char *)chunk + ARENA_CHUNK_HEADER;
+}
+
+// Function to carve size bytes from the head chunk, starting a new chunk
+// when it is full
+static void *arena_bump(arena_t *arena, size_t size)
+{
+    arena_chunk_t *chunk = arena->chunks;
+    if (!chunk || chunk->size - chunk->used < size)
+    {
+        size_t chunk_size = arena->allocated < ARENA_CHUNK_SIZE ? ARENA_CHUNK_SIZE : arena->allocated;
+        if (chunk_size > ARENA_CHUNK_MAX)
+            chunk_size = ARENA_CHUNK_MAX;
+        chunk = malloc(ARENA_CHUNK_HEADER + chunk_size);
+        if (!chunk)
+            return NULL;
+        chunk->next = arena->chunks;
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        arena->chunks = chunk;
+        arena->allocated += chunk_size;
+    }
+
+    void *block = arena_chunk_data(chunk) + chunk->used;
+    chunk->used += size;
+    return block;
+}
+
+// Function to check whether a block is the most recent one of its arena
+static inline int arena_is_last(const alloc_header_t *header)
+{
+    arena_chunk_t *chunk = header->owner->chunks;
+    return (const char *)header + sizeof(alloc_header_t) + ARENA_ROUND(header->size) == arena_chunk_data(chunk) + chunk->used;
+}
+
+// Allocation hook for libxml2: serves the current arena, or malloc when no
+// arena is active or the request is large
+static void *arena_malloc(size_t size)
+{
+    arena_t *arena = current_arena;
+    alloc_header_t *header = NULL;
+    if (arena && size <= ARENA_LARGE)
+        header = arena_bump(arena, sizeof(alloc_header_t) + ARENA_ROUND(size));
+    if (!header)
+    {
+        arena = NULL;
+        header = malloc(sizeof(alloc_header_t) + size);
+        if (!header)
+            return NULL;
+    }
+    header->size = size;
+    header->owner = arena;
+    return header + 1;
+}
+
+// Free hook for libxml2: arena blocks live until the arena is reset, except
+// that the most recent block is handed back to the chunk
+static void arena_free(void *ptr)
+{
+    if (!ptr)
+        return;
+
+    alloc_header_t *header = (alloc_header_t *)ptr - 1;
+    if (!header->owner)
+    {
+        free(header);
+        return;
+    }
+    if (arena_is_last(header))
+        header->owner->chunks->used -= sizeof(alloc_header_t) + ARENA_ROUND(header->size);
+}
+
+// Realloc hook for libxml2: the most recent arena block grows in place
+static void *arena_realloc(void *ptr, size_t size)
+{
+    if (!ptr)
+        return arena_malloc(size);
+
+    alloc_header_t *header = (alloc_header_t *)ptr - 1;
+    if (!header->owner)
+    {
+        alloc_header_t *grown = realloc(header, sizeof(alloc_header_t) + size);
+        if (!grown)
+            return NULL;
+        grown->size = size;
+        return grown + 1;
+    }
+
+    if (size <= header->size)
+        return ptr;
+
+    arena_chunk_t *chunk = header->owner->chunks;
+    size_t extra = ARENA_ROUND(size) - ARENA_ROUND(header->size);
+    if (size <= ARENA_LARGE && arena_is_last(header) && chunk->size - chunk->used >= extra)
+    {
+        chunk->used += extra;
+        header->size = size;
+        return ptr;
+    }
+
+    void *moved = arena_malloc(size);
+    if (!moved)
+        return NULL;
+    memcpy(moved, ptr, header->size);
+    arena_free(ptr);
+    return moved;
+}
+
+// Strdup hook for libxml2
+static char *arena_strdup(const char *str)
+{
+    size_t length = strlen(str) + 1;
+    char *copy = arena_malloc(length);
+    if (copy)
+        memcpy(copy, str, length);
+    return copy;
+}
+
+// Function to route the calling thread's allocations to arena (NULL for
+// malloc); returns the previously active arena for arena_leave
+static arena_t *arena_enter(arena_t *arena)
+{
+    arena_t *previous = current_arena;
+    current_arena = arena;
+    return previous;
+}
+
+// Function to restore the arena that was active before arena_enter
+static void arena_leave(arena_t *previous)
+{
+    current_arena = previous;
+}
+
+// Function to release every block of an arena at once, keeping its first
+// chunk for the next document. No block of it may be referenced afterwards,
+// including libxml2's record of the last error.
+static void arena_reset(arena_t *arena)
+{
+    xmlResetLastError();
+
+    arena_chunk_t *chunk = arena->chunks;
+    if (!chunk)
+        return;
+    while (chunk->next)
+    {
+        arena_chunk_t *next = chunk->next;
+        chunk->next = next->next;
+        free(next);
+    }
+    arena->allocated = chunk->size;
+    chunk->used = 0;
+}
+
+// Function to release an arena and its memory
+static void arena_destroy(arena_t *arena)
+{
+    arena_chunk_t *chunk = arena->chunks;
+    while (chunk)
+    {
+        arena_chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(arena);
+}
+
+// Function to take an empty arena from the pool, or create one
+static arena_t *arena_acquire(void)
+{
+    pthread_mutex_lock(&arena_pool_lock);
+    arena_t *arena = arena_pool;
+    if (arena)
+    {
+        arena_pool = arena->pool_next;
+        arena_pool_size--;
+    }
+    pthread_mutex_unlock(&arena_pool_lock);
+    return arena ? arena : calloc(1, sizeof(arena_t));
+}
+
+// Function to reset an arena and return it to the pool
+static void arena_release(arena_t *arena)
+{
+    if (!arena)
+        return;
+
+    arena_reset(arena);
+    pthread_mutex_lock(&arena_pool_lock);
+    if (arena_pool_size < ARENA_POOL_MAX)
+    {
+        arena->pool_next = arena_pool;
+        arena_pool = arena;
+        arena_pool_size++;
+        arena = NULL;
+    }
+    pthread_mutex_unlock(&arena_pool_lock);
+    if (arena)
+        arena_destroy(arena);
+}
+
+// Function to free the pooled arenas at exit
+static void arena_pool_cleanup(void)
+{
+    pthread_mutex_lock(&arena_pool_lock);
+    while (arena_pool)
+    {
+        arena_t *next = arena_pool->pool_next;
+        arena_destroy(arena_pool);
+        arena_pool = next;
+    }
+    arena_pool_size = 0;
+    pthread_mutex_unlock(&arena_pool_lock);
+}
+
+// Function to parse a document from memory into a fresh arena, which the
+// document then owns (see free_document)
+static htmlDocPtr read_document(const char *html, int size, const char *url)
+{
+    arena_t *arena = arena_acquire();
+    arena_t *previous = arena_enter(arena);
+    htmlDocPtr doc = htmlReadMemory(html, size, url, NULL, HTML_PARSE_RECOVER | HTML_PARSE_NOERROR | HTML_PARSE_NOWARNING);
+    if (doc)
+        doc->_private = arena;
+    arena_leave(previous);
+    if (!doc)
+        arena_release(arena);
+    return doc;
+}
+
+// Function to free a document together with the arena it was parsed into
+static void free_document(htmlDocPtr doc)
+{
+    arena_t *arena = doc->_private;
+    arena_t *previous = arena_enter(arena);
+    xmlFreeDoc(doc);
+    arena_leave(previous);
+    arena_release(arena);
+}
+
+// Function to read a monotonic wall clock in seconds
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Function to prepare an incremental parse; the parser itself is created
+// when the first bytes arrive so it can sniff the encoding from them. The
+// URL becomes the document's base URL.
+static int fetch_parser_init(fetch_parser_t *body, const char *url, size_t max_bytes)
+{
+    body->parser = NULL;
+    body->arena = arena_acquire();
+    body->url = url;
+    body->max_bytes = max_bytes;
+    memset(&body->response, 0, sizeof(body->response));
+    return body->arena ? 0 : -1;
+}
+
+// Function to create a push parser whose first chunk is data, with the
+// parse options of read_document. sax, when given, replaces the default
+// handlers; the callbacks then get the parser context as their userdata.
+static htmlParserCtxtPtr new_push_parser(htmlSAXHandlerPtr sax, const char *data, size_t size, const char *url)
+{
+    // The push parser does not sniff byte order marks and would assume
+    // Latin-1 for undeclared pages; start from UTF-8 like htmlReadMemory
+    // does and let <meta charset> override it
+    const unsigned char *bytes = (const unsigned char *)data;
+    xmlCharEncoding encoding = XML_CHAR_ENCODING_UTF8;
+    size_t skip = 0;
+    if (size >= 3 && bytes[0] == 0xEF && bytes[1] == 0xBB && bytes[2] == 0xBF)
+    {
+        skip = 3;
+    }
+    else if (size >= 2 && bytes[0] == 0xFF && bytes[1] == 0xFE)
+    {
+        encoding = XML_CHAR_ENCODING_UTF16LE;
+        skip = 2;
+    }
+    else if (size >= 2 && bytes[0] == 0xFE && bytes[1] == 0xFF)
+    {
+        encoding = XML_CHAR_ENCODING_UTF16BE;
+        skip = 2;
+    }
+
+    htmlParserCtxtPtr parser = htmlCreatePushParserCtxt(sax, NULL, data + skip, (int)(size - skip), url, encoding);
+    if (parser)
+        htmlCtxtUseOptions(parser, HTML_PARSE_RECOVER | HTML_PARSE_NOERROR | HTML_PARSE_NOWARNING);
+    return parser;
+}
+
+// Function to feed bytes to an incremental parse
+static int fetch_parser_feed(fetch_parser_t *body, const char *data, size_t size)
+{
+    arena_t *previous = arena_enter(body->arena);
+    if (!body->parser)
+    {
+        body->parser = new_push_parser(NULL, data, size, body->url);
+        if (!body->parser)
+        {
+            arena_leave(previous);
+            return -1;
+        }
+    }
+    else
+    {
+        htmlParseChunk(body->parser, data, (int)size, 0);
+    }
+    arena_leave(previous);
+    body->response.size += size;
+    return 0;
+}
+
+// Callback function for libcurl that parses data as it arrives. Past the
+// input limit it parses what fits and stops the transfer.
+static size_t WriteParserCallback(void *contents, size_t size, size_t nmemb, void *userp)
+{
+    size_t realsize = size * nmemb;
+    fetch_parser_t *body = (fetch_parser_t *)userp;
+    size_t accepted = realsize;
+    if (body->max_bytes && body->response.size + realsize > body->max_bytes)
+    {
+        accepted = body->max_bytes - body->response.size;
+        body->response.truncated = 1;
+    }
+
+    // htmlParseChunk takes an int length; curl never hands over more than
+    // CURL_MAX_WRITE_SIZE bytes at once
+    if (accepted > 0 && fetch_parser_feed(body, (const char *)contents, accepted) < 0)
+        return 0;
+    return body->response.truncated ? 0 : realsize;
+}
+
+// Function to tell whether a transfer succeeded, counting one stopped at the
+// input limit as a success. An HTTP error status fails it even when the
+// transfer itself went through; a 304 answer does not.
+static int fetch_succeeded(CURLcode res, long status, const fetch_parser_t *body)
+{
+    return (res == CURLE_OK || (res == CURLE_WRITE_ERROR && body->response.truncated)) && status < 400;
+}
+
+// Function to copy a header value without its surrounding whitespace
+static char *header_value(const char *value, size_t length)
+{
+    while (length > 0 && isspace((unsigned char)*value))
+    {
+        value++;
+        length--;
+    }
+    while (length > 0 && isspace((unsigned char)value[length - 1]))
+        length--;
+    return strndup(value, length);
+}
+
+// Callback function for libcurl that records the validators of the final
+// response; the status line of every response in a redirect chain resets them
+static size_t HeaderCallback(char *buffer, size_t size, size_t nitems, void *userp)
+{
+    size_t length = size * nitems;
+    fetch_response_t *response = &((fetch_parser_t *)userp)->response;
+
+    if (length >= 5 && strncmp(buffer, "HTTP/", 5) == 0)
+    {
+        free(response->etag);
+        free(response->last_modified);
+        response->etag = NULL;
+        response->last_modified = NULL;
+    }
+    else if (length > 5 && strncasecmp(buffer, "ETag:", 5) == 0)
+    {
+        free(response->etag);
+        response->etag = header_value(buffer + 5, length - 5);
+    }
+    else if (length > 14 && strncasecmp(buffer, "Last-Modified:", 14) == 0)
+    {
+        free(response->last_modified);
+        response->last_modified = header_value(buffer + 14, length - 14);
+    }
+    return length;
+}
+
+// Function to release the strings of a response
+static void free_fetch_response(fetch_response_t *response)
+{
+    free(response->etag);
+    free(response->last_modified);
+    response->etag = NULL;
+    response->last_modified = NULL;
+}
+
+// Function to build the headers of a conditional request from the validators
+// of a cached copy; NULL when there are none
+static struct curl_slist *conditional_headers(const char *etag, const char *last_modified)
+{
+    struct curl_slist *headers = NULL;
+    char line[1024];
+    if (etag && strlen(etag) < sizeof(line) - 32)
+    {
+        snprintf(line, sizeof(line), "If-None-Match: %s", etag);
+        headers = curl_slist_append(headers, line);
+    }
+    if (last_modified && strlen(last_modified) < sizeof(line) - 32)
+    {
+        snprintf(line, sizeof(line), "If-Modified-Since: %s", last_modified);
+        struct curl_slist *appended = curl_slist_append(headers, line);
+        if (appended)
+            headers = appended;
+    }
+    return headers;
+}
+
+// Function to finish an incremental parse and take the document, which
+// takes over the parse's arena. The document may be freed on another
+// thread, so this thread's record of the last error, which can live in the
+// arena, is cleared here rather than when the arena is reset.
+static htmlDocPtr fetch_parser_finish(fetch_parser_t *body)
+{
+    htmlDocPtr doc = NULL;
+    arena_t *previous = arena_enter(body->arena);
+    if (body->parser)
+    {
+        htmlParseChunk(body->parser, NULL, 0, 1);
+        doc = body->parser->myDoc;
+        body->parser->myDoc = NULL;
+        htmlFreeParserCtxt(body->parser);
+        body->parser = NULL;
+    }
+    xmlResetLastError();
+
+    if (doc && !xmlDocGetRootElement(doc))
+    {
+        xmlFreeDoc(doc);
+        doc = NULL;
+    }
+    arena_leave(previous);
+
+    if (doc)
+        doc->_private = body->arena;
+    else
+        arena_release(body->arena);
+    body->arena = NULL;
+    return doc;
+}
+
+// Function to throw away an incremental parse
+static void fetch_parser_abort(fetch_parser_t *body)
+{
+    arena_t *previous = arena_enter(body->arena);
+    if (body->parser)
+    {
+        if (body->parser->myDoc)
+            xmlFreeDoc(body->parser->myDoc);
+        body->parser->myDoc = NULL;
+        htmlFreeParserCtxt(body->parser);
+        body->parser = NULL;
+    }
+    arena_leave(previous);
+    arena_release(body->arena);
+    body->arena = NULL;
+}
+
+// Function to record what a failed transfer is counted as; returns error
+static const char *fetch_failure(fetch_response_t *response, failure_reason_t reason, const char *error)
+{
+    response->failure = reason;
+    return error;
+}
+
+// Function to finish a transfer whose status is known. A 304 answer has no
+// document to parse and is not an error; anything else must parse.
+static htmlDocPtr fetch_parser_complete(fetch_parser_t *body, const char **error)
+{
+    if (body->response.status == 304)
+    {
+        fetch_parser_abort(body);
+        return NULL;
+    }
+
+    htmlDocPtr doc = fetch_parser_finish(body);
+    if (!doc)
+        *error = fetch_failure(&body->response, FAILURE_PARSE, "unable to parse HTML");
+    return doc;
+}
+
+// Callback function for libcurl that locks one kind of shared data
+static void ShareLockCallback(CURL *handle, curl_lock_data data, curl_lock_access access, void *userp)
+{
+    (void)handle;
+    (void)access;
+    (void)userp;
+    pthread_mutex_lock(&fetch_share_locks[data]);
+}
+
+// Callback function for libcurl that unlocks one kind of shared data
+static void ShareUnlockCallback(CURL *handle, curl_lock_data data, void *userp)
+{
+    (void)handle;
+    (void)userp;
+    pthread_mutex_unlock(&fetch_share_locks[data]);
+}
+
+// Function to create the share that lets every transfer in the process
+// reuse DNS results, open connections and TLS sessions. Transfers go on
+// without it if it cannot be created.
+static void fetch_share_init(void)
+{
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++)
+        pthread_mutex_init(&fetch_share_locks[i], NULL);
+
+    fetch_share = curl_share_init();
+    if (!fetch_share)
+        return;
+    curl_share_setopt(fetch_share, CURLSHOPT_LOCKFUNC, ShareLockCallback);
+    curl_share_setopt(fetch_share, CURLSHOPT_UNLOCKFUNC, ShareUnlockCallback);
+    curl_share_setopt(fetch_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(fetch_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    curl_share_setopt(fetch_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+}
+
+// Function to release the share once no transfer uses it
+static void fetch_share_cleanup(void)
+{
+    if (fetch_share)
+        curl_share_cleanup(fetch_share);
+    fetch_share = NULL;
+}
+
+// Function to set up an easy handle, a new one when handle is NULL or else
+// a reset one, so that it streams url into an incremental parse, sending
+// headers (if any) with the request. Compressed bodies are asked for and
+// decoded on the fly.
+static CURL *new_fetch_handle(CURL *handle, const char *url, fetch_parser_t *body, struct curl_slist *headers,
+                              const readability_fetch_options_t *options)
+{
+    CURL *curl_handle = handle;
+    if (curl_handle)
+        curl_easy_reset(curl_handle);
+    else if (!(curl_handle = curl_easy_init()))
+        return NULL;
+
+    curl_easy_setopt(curl_handle, CURLOPT_URL, url);
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, WriteParserCallback);
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)body);
+    curl_easy_setopt(curl_handle, CURLOPT_HEADERFUNCTION, HeaderCallback);
+    curl_easy_setopt(curl_handle, CURLOPT_HEADERDATA, (void *)body);
+    curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "libcurl-agent/1.0");
+    curl_easy_setopt(curl_handle, CURLOPT_ACCEPT_ENCODING, "");
+    curl_easy_setopt(curl_handle, CURLOPT_NOSIGNAL, 1L);
+    if (fetch_share)
+        curl_easy_setopt(curl_handle, CURLOPT_SHARE, fetch_share);
+    if (options->connect_timeout_ms > 0)
+        curl_easy_setopt(curl_handle, CURLOPT_CONNECTTIMEOUT_MS, options->connect_timeout_ms);
+    if (options->timeout_ms > 0)
+        curl_easy_setopt(curl_handle, CURLOPT_TIMEOUT_MS, options->timeout_ms);
+    if (options->max_redirects >= 0)
+    {
+        curl_easy_setopt(curl_handle, CURLOPT_FOLLOWLOCATION, 1L);
+        curl_easy_setopt(curl_handle, CURLOPT_MAXREDIRS, (long)options->max_redirects);
+    }
+    if (options->max_body_bytes > 0)
+        curl_easy_setopt(curl_handle, CURLOPT_MAXFILESIZE_LARGE, (curl_off_t)options->max_body_bytes);
+    if (headers)
+        curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, headers);
+    return curl_handle;
+}
+
+// Function to describe why a transfer failed, recording what it is counted
+// as in its response
+static const char *fetch_error(CURLcode res, fetch_response_t *response)
+{
+    if (response->status >= 400)
+        return fetch_failure(response, FAILURE_FETCH, "HTTP error status");
+    switch (res)
+    {
+    case CURLE_COULDNT_RESOLVE_HOST:
+        return fetch_failure(response, FAILURE_FETCH, "unable to resolve host");
+    case CURLE_COULDNT_CONNECT:
+        return fetch_failure(response, FAILURE_FETCH, "unable to connect");
+    case CURLE_OPERATION_TIMEDOUT:
+        return fetch_failure(response, FAILURE_TIMEOUT, "timed out fetching URL");
+    case CURLE_TOO_MANY_REDIRECTS:
+        return fetch_failure(response, FAILURE_REDIRECTS, "too many redirects");
+    case CURLE_FILESIZE_EXCEEDED:
+        return fetch_failure(response, FAILURE_TOO_LARGE, "response too large");
+    default:
+        return fetch_failure(response, FAILURE_FETCH, "unable to fetch URL");
+    }
+}
+
+// Function to fetch and parse a URL, parsing while the download is still in
+// progress. With validators the request is conditional, and a 304 answer
+// returns NULL without setting *error. The response is filled in either way
+// and must be released with free_fetch_response. Bodies longer than max_bytes (0 for no
+// limit) are parsed up to it. *handle is reused from one call to the next
+// and created when NULL; the caller cleans it up. readability_global_init
+// must have been called once by the caller.
+static htmlDocPtr fetch_document(CURL **handle, const readability_fetch_options_t *options, const char *url,
+                                 const char *etag, const char *last_modified, size_t max_bytes,
+                                 fetch_response_t *response, const char **error)
+{
+    fetch_parser_t body;
+    if (fetch_parser_init(&body, url, max_bytes) < 0)
+    {
+        *error = fetch_failure(&body.response, FAILURE_PARSE, "unable to create parser");
+        *response = body.response;
+        return NULL;
+    }
+
+    struct curl_slist *headers = conditional_headers(etag, last_modified);
+    CURL *curl_handle = new_fetch_handle(*handle, url, &body, headers, options);
+    if (!curl_handle)
+    {
+        curl_slist_free_all(headers);
+        fetch_parser_abort(&body);
+        *error = fetch_failure(&body.response, FAILURE_FETCH, "unable to start transfer");
+        *response = body.response;
+        return NULL;
+    }
+    *handle = curl_handle;
+
+    double started = now_seconds();
+    CURLcode res = curl_easy_perform(curl_handle);
+    body.response.elapsed = now_seconds() - started;
+    curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &body.response.status);
+    // The handle keeps its connection for the next call, but not the
+    // headers, which are freed here
+    curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, NULL);
+    curl_slist_free_all(headers);
+
+    htmlDocPtr doc = NULL;
+    if (!fetch_succeeded(res, body.response.status, &body))
+    {
+        fetch_parser_abort(&body);
+        *error = fetch_error(res, &body.response);
+    }
+    else
+    {
+        doc = fetch_parser_complete(&body, error);
+    }
+
+    *response = body.response;
+    return doc;
+}
+
+// Function to read a stream that cannot be mapped (a pipe or terminal)
+static int read_stream(int fd, input_buffer_t *input)
+{
+    size_t capacity = 65536;
+    input->data = malloc(capacity);
+    input->size = 0;
+    input->mapped = 0;
+    if (!input->data)
+        return -1;
+
+    for (;;)
+    {
+        if (input->size == capacity)
+        {
+            char *data = realloc(input->data, capacity * 2);
+            if (!data)
+                return -1;
+            input->data = data;
+            capacity *= 2;
+        }
+        ssize_t n = read(fd, input->data + input->size, capacity - input->size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            return 0;
+        input->size += (size_t)n;
+    }
+}
+
+// Function to release a loaded input
+static void free_input(input_buffer_t *input)
+{
+    if (input->mapped)
+        munmap(input->data, input->size);
+    else
+        free(input->data);
+    memset(input, 0, sizeof(*input));
+}
+
+// Function to load a local HTML file ("-" for stdin). Regular files are
+// memory-mapped read-only so the parser reads them in place without a copy.
+static int load_input(const char *path, input_buffer_t *input)
+{
+    memset(input, 0, sizeof(*input));
+    int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    int status = 0;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+    {
+        input->size = (size_t)st.st_size;
+        if (input->size > 0)
+        {
+            void *data = mmap(NULL, input->size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED)
+            {
+                status = -1;
+            }
+            else
+            {
+                madvise(data, input->size, MADV_SEQUENTIAL);
+                input->data = data;
+                input->mapped = 1;
+            }
+        }
+    }
+    else
+    {
+        status = read_stream(fd, input);
+    }
+
+    if (fd != STDIN_FILENO)
+        close(fd);
+    if (status < 0)
+        free_input(input);
+    return status;
+}
+
+// Function to tell URLs apart from local file paths
+int readability_is_url(const char *source)
+{
+    return strncmp(source, "http://", 7) == 0 || strncmp(source, "https://", 8) == 0;
+}
+
+// Function to hash a string with FNV-1a
+static uint64_t hash_string(const char *str)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const unsigned char *c = (const unsigned char *)str; *c; c++)
+    {
+        hash ^= *c;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Function to set up a fetch engine with a global and a per-host limit on
+// transfers in flight
+static int fetch_engine_init(fetch_engine_t *engine, int max_active, int max_per_host, fetch_done_fn on_done)
+{
+    memset(engine, 0, sizeof(*engine));
+    engine->multi = curl_multi_init();
+    engine->bucket_count = 256;
+    engine->buckets = calloc((size_t)engine->bucket_count, sizeof(fetch_host_t *));
+    if (!engine->multi || !engine->buckets)
+    {
+        if (engine->multi)
+            curl_multi_cleanup(engine->multi);
+        free(engine->buckets);
+        memset(engine, 0, sizeof(*engine));
+        return -1;
+    }
+    engine->max_active = max_active > 0 ? max_active : 1;
+    engine->max_per_host = max_per_host > 0 ? max_per_host : 1;
+    engine->on_done = on_done;
+    return 0;
+}
+
+// Function to find or create the queue for a URL's host
+static fetch_host_t *fetch_engine_host(fetch_engine_t *engine, const char *url)
+{
+    xmlURIPtr uri = xmlParseURI(url);
+    const char *name = (uri && uri->server) ? uri->server : "";
+
+    // Grow the host table once it averages two hosts per bucket
+    if (engine->host_count >= engine->bucket_count * 2)
+    {
+        int bucket_count = engine->bucket_count * 2;
+        fetch_host_t **buckets = calloc((size_t)bucket_count, sizeof(fetch_host_t *));
+        if (buckets)
+        {
+            for (int i = 0; i < engine->bucket_count; i++)
+            {
+                fetch_host_t *host = engine->buckets[i];
+                while (host)
+                {
+                    fetch_host_t *next = host->hash_next;
+                    unsigned int slot = (unsigned int)(hash_string(host->name) & (uint64_t)(bucket_count - 1));
+                    host->hash_next = buckets[slot];
+                    buckets[slot] = host;
+                    host = next;
+                }
+            }
+            free(engine->buckets);
+            engine->buckets = buckets;
+            engine->bucket_count = bucket_count;
+        }
+    }
+
+    unsigned int bucket = (unsigned int)(hash_string(name) & (uint64_t)(engine->bucket_count - 1));
+    fetch_host_t *host = engine->buckets[bucket];
+    while (host && strcmp(host->name, name) != 0)
+        host = host->hash_next;
+
+    if (!host)
+    {
+        host = calloc(1, sizeof(fetch_host_t));
+        if (host)
+            host->name = strdup(name);
+        if (host && !host->name)
+        {
+            free(host);
+            host = NULL;
+        }
+        if (host)
+        {
+            host->hash_next = engine->buckets[bucket];
+            engine->buckets[bucket] = host;
+            engine->host_count++;
+        }
+    }
+
+    if (uri)
+        xmlFreeURI(uri);
+    return host;
+}
+
+// Function to put a host with pending work and spare capacity in the ready
+// ring, just behind the scheduler's current position
+static void fetch_engine_mark_ready(fetch_engine_t *engine, fetch_host_t *host)
+{
+    if (host->in_ring || !host->head || host->active >= engine->max_per_host)
+        return;
+
+    host->in_ring = 1;
+    if (!engine->ring)
+    {
+        host->ring_prev = host->ring_next = host;
+        engine->ring = host;
+    }
+    else
+    {
+        host->ring_next = engine->ring;
+        host->ring_prev = engine->ring->ring_prev;
+        host->ring_prev->ring_next = host;
+        engine->ring->ring_prev = host;
+    }
+}
+
+// Function to take a host out of the ready ring
+static void fetch_engine_unmark_ready(fetch_engine_t *engine, fetch_host_t *host)
+{
+    if (!host->in_ring)
+        return;
+
+    host->in_ring = 0;
+    if (host->ring_next == host)
+    {
+        engine->ring = NULL;
+    }
+    else
+    {
+        host->ring_prev->ring_next = host->ring_next;
+        host->ring_next->ring_prev = host->ring_prev;
+        if (engine->ring == host)
+            engine->ring = host->ring_next;
+    }
+}
+
+// Function to queue a URL for download; with validators (either may be
+// NULL) the request is conditional
+static int fetch_engine_add(fetch_engine_t *engine, const char *url, const char *etag, const char *last_modified,
+                            void *userdata)
+{
+    fetch_job_t *job = calloc(1, sizeof(fetch_job_t));
+    if (!job)
+        return -1;
+    job->url = strdup(url);
+    job->host = fetch_engine_host(engine, url);
+    job->request_headers = conditional_headers(etag, last_modified);
+    job->userdata = userdata;
+    if (!job->url || !job->host)
+    {
+        curl_slist_free_all(job->request_headers);
+        free(job->url);
+        free(job);
+        return -1;
+    }
+
+    if (job->host->tail)
+        job->host->tail->next = job;
+    else
+        job->host->head = job;
+    job->host->tail = job;
+    engine->pending++;
+
+    fetch_engine_mark_ready(engine, job->host);
+    return 0;
+}
+
+// Function to hand a finished job to the callback and release it
+static void fetch_engine_finish(fetch_engine_t *engine, fetch_job_t *job, const char *error)
+{
+    htmlDocPtr doc = NULL;
+    if (error)
+    {
+        fetch_parser_abort(&job->body);
+    }
+    else
+    {
+        doc = fetch_parser_complete(&job->body, &error);
+    }
+    engine->on_done(job->url, doc, &job->body.response, error, job->userdata);
+    free_fetch_response(&job->body.response);
+    curl_slist_free_all(job->request_headers);
+    free(job->url);
+    free(job);
+}
+
+// Function to start queued jobs round-robin across hosts until the global
+// limit is reached or no host has spare capacity
+static void fetch_engine_start_jobs(fetch_engine_t *engine)
+{
+    while (engine->active < engine->max_active && engine->ring)
+    {
+        fetch_host_t *host = engine->ring;
+        fetch_job_t *job = host->head;
+
+        host->head = job->next;
+        if (!host->head)
+            host->tail = NULL;
+        job->next = NULL;
+        engine->pending--;
+
+        // Move on to the next host before deciding whether this one stays
+        engine->ring = host->ring_next;
+
+        job->handle = fetch_parser_init(&job->body, job->url, engine->max_bytes) == 0
+                          ? new_fetch_handle(NULL, job->url, &job->body, job->request_headers, engine->options)
+                          : NULL;
+        if (!job->handle)
+        {
+            if (!host->head)
+                fetch_engine_unmark_ready(engine, host);
+            fetch_engine_finish(engine, job,
+                                fetch_failure(&job->body.response, FAILURE_FETCH, "unable to start transfer"));
+            continue;
+        }
+        curl_easy_setopt(job->handle, CURLOPT_PRIVATE, (void *)job);
+        job->started = now_seconds();
+        curl_multi_add_handle(engine->multi, job->handle);
+        job->next = engine->running;
+        if (engine->running)
+            engine->running->prev = job;
+        engine->running = job;
+        host->active++;
+        engine->active++;
+
+        if (!host->head || host->active >= engine->max_per_host)
+            fetch_engine_unmark_ready(engine, host);
+    }
+}
+
+// Function to take a job in flight off the engine and release its transfer
+static void fetch_engine_stop(fetch_engine_t *engine, fetch_job_t *job)
+{
+    if (job->prev)
+        job->prev->next = job->next;
+    else
+        engine->running = job->next;
+    if (job->next)
+        job->next->prev = job->prev;
+    job->next = job->prev = NULL;
+    curl_multi_remove_handle(engine->multi, job->handle);
+    curl_easy_cleanup(job->handle);
+    job->handle = NULL;
+
+    engine->active--;
+    job->host->active--;
+    fetch_engine_mark_ready(engine, job->host);
+}
+
+// Function to drive transfers for up to timeout_ms and deliver every job that
+// completes. The wait also ends as soon as wake_fd, unless it is -1, becomes
+// readable. Returns the number of jobs still pending or in flight.
+static int fetch_engine_poll(fetch_engine_t *engine, int timeout_ms, int wake_fd)
+{
+    fetch_engine_start_jobs(engine);
+
+    int running = 0;
+    curl_multi_perform(engine->multi, &running);
+    if (running > 0)
+    {
+        struct curl_waitfd wake = {wake_fd, CURL_WAIT_POLLIN, 0};
+        curl_multi_poll(engine->multi, &wake, wake_fd >= 0 ? 1 : 0, timeout_ms, NULL);
+        curl_multi_perform(engine->multi, &running);
+    }
+
+    CURLMsg *msg;
+    int queued;
+    while ((msg = curl_multi_info_read(engine->multi, &queued)))
+    {
+        if (msg->msg != CURLMSG_DONE)
+            continue;
+
+        fetch_job_t *job = NULL;
+        CURLcode res = msg->data.result;
+        CURL *handle = msg->easy_handle;
+        curl_easy_getinfo(handle, CURLINFO_PRIVATE, (char **)&job);
+        curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &job->body.response.status);
+        job->body.response.elapsed = now_seconds() - job->started;
+        fetch_engine_stop(engine, job);
+
+        int succeeded = fetch_succeeded(res, job->body.response.status, &job->body);
+        fetch_engine_finish(engine, job, succeeded ? NULL : fetch_error(res, &job->body.response));
+    }
+
+    fetch_engine_start_jobs(engine);
+    return engine->active + engine->pending;
+}
+
+// Function to release a fetch engine; jobs still in flight or waiting to
+// start are handed to the callback as cancelled
+static void fetch_engine_cleanup(fetch_engine_t *engine)
+{
+    while (engine->running)
+    {
+        fetch_job_t *job = engine->running;
+        fetch_engine_stop(engine, job);
+        fetch_engine_finish(engine, job, fetch_failure(&job->body.response, FAILURE_OTHER, "fetch cancelled"));
+    }
+
+    for (int i = 0; i < engine->bucket_count; i++)
+    {
+        fetch_host_t *host = engine->buckets[i];
+        while (host)
+        {
+            fetch_host_t *next = host->hash_next;
+            fetch_job_t *job = host->head;
+            host->head = host->tail = NULL;
+            while (job)
+            {
+                fetch_job_t *next_job = job->next;
+                engine->pending--;
+                fetch_engine_finish(engine, job, fetch_failure(&job->body.response, FAILURE_OTHER, "fetch cancelled"));
+                job = next_job;
+            }
+            free(host->name);
+            free(host);
+            host = next;
+        }
+    }
+    free(engine->buckets);
+    if (engine->multi)
+        curl_multi_cleanup(engine->multi);
+    memset(engine, 0, sizeof(*engine));
+}
+
+// Scoring weights and markdown rules, indexed by tag_t
+static const tag_info_t tag_table[TAG_COUNT] = {
+    [TAG_OTHER] = {NULL, 0, 0, MD_BLOCK, NULL, NULL},
+    [TAG_A] = {"a", 0, 0, MD_LINK, NULL, NULL},
+    [TAG_AD] = {"ad", TAG_UNWANTED, 0, MD_BLOCK, NULL, NULL},
+    [TAG_ADDRESS] = {"address", 0, -3, MD_BLOCK, NULL, NULL},
+    [TAG_ARTICLE] = {"article", 0, 0, MD_BLOCK, NULL, NULL},
+    [TAG_ASIDE] = {"aside", TAG_UNWANTED, 0, MD_BLOCK, NULL, NULL},
+    [TAG_B] = {"b", 0, 0, MD_BLOCK, "**", "**"},
+    [TAG_BASE] = {"base", 0, 0, MD_BLOCK, NULL, NULL},
+    [TAG_BLOCKQUOTE] = {"blockquote", 0, 3, MD_BLOCK, NULL, NULL},
+    [TAG_BODY] = {"body", 0, 0, MD_BLOCK, NULL, NULL},
+    [TAG_BR] = {"br", 0, 0, MD_BLOCK, "\n", NULL},
+    [TAG_DD] = {"dd", 0, -3, MD_BLOCK, NULL, NULL},
+    [TAG_DIV] = {"div", 0, 5, MD_BLOCK, NULL, NULL},
+    [TAG_DL] = {"dl", 0, -3, MD_BLOCK, NULL, NULL},
+    [TAG_DT] = {"dt", 0, -3, MD_BLOCK, NULL, NULL},
+    [TAG_EM] = {"em", 0, 0, MD_BLOCK, "*", "*"},
+    [TAG_FIGURE] = {"figure", TAG_UNWANTED, 0, MD_BLOCK, NULL, NULL},
+    [TAG_FORM] = {"form", 0, -3, MD_BLOCK, NULL, NULL},
+    [TAG_H1] = {"h1", 0, -5, MD_BLOCK, "\n# ", NULL},
+    [TAG_H2] = {"h2", 0, -5, MD_BLOCK, "\n## ", NULL},
+    [TAG_H3] = {"h3", 0, -5, MD_BLOCK, "\n### ", NULL},
+    [TAG_H4] = {"h4", 0, -5, MD_BLOCK, "\n#### ", NULL},
+    [TAG_H5] = {"h5", 0, -5, MD_BLOCK, "\n##### ", NULL},
+    [TAG_H6] = {"h6", 0, -5, MD_BLOCK, "\n###### ", NULL},
+    [TAG_HEAD] = {"head", 0, 0, MD_BLOCK, NULL, NULL},
+    [TAG_HTML] = {"html", 0, 0, MD_BLOCK, NULL, NULL},
+    [TAG_I] = {"i", 0, 0, MD_BLOCK, "*", "*"},
+    [TAG_IFRAME] = {"iframe", TAG_UNWANTED, 0, MD_BLOCK, NULL, NULL},
+    [TAG_INS] = {"ins", TAG_UNWANTED, 0, MD_BLOCK, NULL, NULL},
+    [TAG_LI] = {"li", 0, -3, MD_ITEM, NULL, NULL},
+    [TAG_LINK] = {"link", 0, 0, MD_BLOCK, NULL, NULL},
+    [TAG_META] = {"meta", 0, 0, MD_BLOCK, NULL, NULL},
+    [TAG_NOSCRIPT] = {"noscript", TAG_UNWANTED, 0, MD_BLOCK, NULL, NULL},
+    [TAG_OL] = {"ol", 0, -3, MD_BLOCK, NULL, "\n"},
+    [TAG_P] = {"p", TAG_PARAGRAPH, 0, MD_BLOCK, "\n", "\n"},
+    [TAG_PRE] = {"pre", TAG_PARAGRAPH, 3, MD_BLOCK, NULL, NULL},
+    [TAG_SCRIPT] = {"script", TAG_UNWANTED, 0, MD_BLOCK, NULL, NULL},
+    [TAG_STRONG] = {"strong", 0, 0, MD_BLOCK, "**", "**"},
+    [TAG_STYLE] = {"style", TAG_UNWANTED, 0, MD_BLOCK, NULL, NULL},
+    [TAG_TD] = {"td", TAG_PARAGRAPH, 3, MD_BLOCK, NULL, NULL},
+    [TAG_TH] = {"th", 0, -5, MD_BLOCK, NULL, NULL},
+    [TAG_TITLE] = {"title", 0, 0, MD_BLOCK, NULL, NULL},
+    [TAG_UL] = {"ul", 0, -3, MD_BLOCK, NULL, "\n"},
+};
+
+#define TAG_HASH_SIZE 128
+
+// Open-addressing table from a hash of the lowercased name to tag_t
+static unsigned char tag_hash_table[TAG_HASH_SIZE];
+static pthread_once_t tag_hash_once = PTHREAD_ONCE_INIT;
+
+// Function to hash an element name case-insensitively (FNV-1a)
+static inline unsigned int hash_tag_name(const xmlChar *name, size_t *length)
+{
+    unsigned int hash = 2166136261u;
+    const xmlChar *c = name;
+    for (; *c; c++)
+    {
+        hash ^= (unsigned int)(*c >= 'A' && *c <= 'Z' ? *c + 32 : *c);
+        hash *= 16777619u;
+    }
+    *length = (size_t)(c - name);
+    return hash;
+}
+
+// Function to fill the tag hash table once per process
+static void build_tag_hash(void)
+{
+    for (int tag = TAG_OTHER + 1; tag < TAG_COUNT; tag++)
+    {
+        size_t length;
+        unsigned int slot = hash_tag_name((const xmlChar *)tag_table[tag].name, &length) & (TAG_HASH_SIZE - 1);
+        while (tag_hash_table[slot])
+            slot = (slot + 1) & (TAG_HASH_SIZE - 1);
+        tag_hash_table[slot] = (unsigned char)tag;
+    }
+}
+
+// Function to map an element name to its tag id with one hash and at most
+// a couple of comparisons, however many tags are known
+static tag_t tag_lookup(const xmlChar *name)
+{
+    pthread_once(&tag_hash_once, build_tag_hash);
+    if (!name)
+        return TAG_OTHER;
+
+    size_t length;
+    unsigned int slot = hash_tag_name(name, &length) & (TAG_HASH_SIZE - 1);
+    while (tag_hash_table[slot])
+    {
+        const char *candidate = tag_table[tag_hash_table[slot]].name;
+        if (strlen(candidate) == length && xmlStrcasecmp(name, (const xmlChar *)candidate) == 0)
+            return (tag_t)tag_hash_table[slot];
+        slot = (slot + 1) & (TAG_HASH_SIZE - 1);
+    }
+    return TAG_OTHER;
+}
+
+// Function to classify an element node
+static inline tag_t node_tag(const xmlNode *node)
+{
+    return node->type == XML_ELEMENT_NODE ? tag_lookup(node->name) : TAG_OTHER;
+}
+
+// Function to make room for at least extra more bytes plus a terminator
+static int strbuf_reserve(strbuf_t *buf, size_t extra)
+{
+    if (buf->length + extra + 1 <= buf->capacity)
+        return 0;
+
+    size_t capacity = buf->capacity ? buf->capacity : 4096;
+    while (capacity < buf->length + extra + 1)
+        capacity *= 2;
+
+    char *data = realloc(buf->data, capacity);
+    if (!data)
+        return -1;
+    buf->data = data;
+    buf->capacity = capacity;
+    return 0;
+}
+
+// Function to append bytes to a buffer
+static void strbuf_append(strbuf_t *buf, const char *data, size_t length)
+{
+    if (length == 0 || strbuf_reserve(buf, length) < 0)
+        return;
+    memcpy(buf->data + buf->length, data, length);
+    buf->length += length;
+    buf->data[buf->length] = '\0';
+}
+
+// Function to append a NUL-terminated string to a buffer
+static void strbuf_puts(strbuf_t *buf, const char *str)
+{
+    if (str)
+        strbuf_append(buf, str, strlen(str));
+}
+
+// Function to append a single byte repeated count times
+static void strbuf_fill(strbuf_t *buf, char c, size_t count)
+{
+    if (count == 0 || strbuf_reserve(buf, count) < 0)
+        return;
+    memset(buf->data + buf->length, c, count);
+    buf->length += count;
+    buf->data[buf->length] = '\0';
+}
+
+// Function to release a buffer
+static void strbuf_free(strbuf_t *buf)
+{
+    free(buf->data);
+    memset(buf, 0, sizeof(*buf));
+}
+
+// Bytes that cannot appear unescaped inside a JSON string: 0 means copy
+// as-is, 'u' means \u00XX, anything else is the letter after the backslash
+static const char json_escape_table[256] = {
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    0, 0, '"', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '\\', 0, 0, 0};
+
+// HTML whitespace: space, tab, line feed, form feed and carriage return
+static const unsigned char html_space_table[256] = {['\t'] = 1, ['\n'] = 1, ['\f'] = 1, ['\r'] = 1, [' '] = 1};
+
+// Text kernels, in a scalar version and, on x86-64, SSE2 and AVX2 versions
+// picked at startup. collapse_whitespace copies length bytes of src to dst
+// with every run of whitespace turned into one space and returns the bytes
+// written; json_clean_span returns how many leading bytes of data can be
+// copied into a JSON string without escaping.
+typedef struct
+{
+    const char *name;
+    int (*supported)(void);
+    size_t (*collapse_whitespace)(char *dst, const unsigned char *src, size_t length);
+    size_t (*json_clean_span)(const unsigned char *data, size_t length);
+} text_kernels_t;
+
+// Function to collapse whitespace byte by byte. space tells whether the
+// byte before src was whitespace, and is updated for the next call.
+static char *collapse_whitespace_run(char *write, const unsigned char *src, size_t length, unsigned int *space)
+{
+    unsigned int previous = *space;
+    for (size_t i = 0; i < length; i++)
+    {
+        if (html_space_table[src[i]])
+        {
+            if (!previous)
+                *write++ = ' ';
+            previous = 1;
+        }
+        else
+        {
+            *write++ = (char)src[i];
+            previous = 0;
+        }
+    }
+    *space = previous;
+    return write;
+}
+
+// Function to always select a kernel
+static int kernel_always(void)
+{
+    return 1;
+}
+
+// Function to collapse whitespace without vector instructions
+static size_t collapse_whitespace_scalar(char *dst, const unsigned char *src, size_t length)
+{
+    unsigned int space = 0;
+    return (size_t)(collapse_whitespace_run(dst, src, length, &space) - dst);
+}
+
+// Function to find the first byte that needs JSON escaping, without vector
+// instructions
+static size_t json_clean_span_scalar(const unsigned char *data, size_t length)
+{
+    size_t i = 0;
+    while (i < length && !json_escape_table[data[i]])
+        i++;
+    return i;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+
+// The vector kernels work through the input a register at a time. A block
+// whose only whitespace is single spaces, not following whitespace, comes
+// out unchanged and is stored in one go; any other block is collapsed byte
+// by byte.
+
+// Function to check for SSE2, which every x86-64 processor has
+static int kernel_sse2_supported(void)
+{
+    return 1;
+}
+
+// Function to collapse the whitespace of one 16-byte block
+static inline char *collapse_block_sse2(char *write, const unsigned char *src, unsigned int *space)
+{
+    __m128i block = _mm_loadu_si128((const __m128i *)src);
+    __m128i others = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('\t')),
+                                               _mm_cmpeq_epi8(block, _mm_set1_epi8('\n'))),
+                                  _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('\f')),
+                                               _mm_cmpeq_epi8(block, _mm_set1_epi8('\r'))));
+    unsigned int spaces = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8(' ')));
+    if (_mm_movemask_epi8(others) != 0 || (spaces & (spaces << 1 | *space)) != 0)
+        return collapse_whitespace_run(write, src, 16, space);
+    _mm_storeu_si128((__m128i *)write, block);
+    *space = spaces >> 15;
+    return write + 16;
+}
+
+// Function to collapse whitespace 16 bytes at a time
+static size_t collapse_whitespace_sse2(char *dst, const unsigned char *src, size_t length)
+{
+    char *write = dst;
+    unsigned int space = 0;
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16)
+        write = collapse_block_sse2(write, src + i, &space);
+    write = collapse_whitespace_run(write, src + i, length - i, &space);
+    return (size_t)(write - dst);
+}
+
+// Function to find the first byte that needs JSON escaping 16 bytes at a
+// time: control characters, quotes and backslashes
+static size_t json_clean_span_sse2(const unsigned char *data, size_t length)
+{
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i control = _mm_cmpeq_epi8(_mm_min_epu8(block, _mm_set1_epi8(0x1f)), block);
+        __m128i special = _mm_or_si128(control, _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('"')),
+                                                             _mm_cmpeq_epi8(block, _mm_set1_epi8('\\'))));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(special);
+        if (mask)
+            return i + (size_t)__builtin_ctz(mask);
+    }
+    return i + json_clean_span_scalar(data + i, length - i);
+}
+
+// Function to check whether the processor has AVX2
+static int kernel_avx2_supported(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+// Function to collapse whitespace 32 bytes at a time; a block that cannot be
+// stored as it is gets a second chance as two 16-byte halves
+__attribute__((target("avx2")))
+static size_t collapse_whitespace_avx2(char *dst, const unsigned char *src, size_t length)
+{
+    char *write = dst;
+    unsigned int space = 0;
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32)
+    {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i others = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(block, _mm256_set1_epi8('\t')),
+                                                         _mm256_cmpeq_epi8(block, _mm256_set1_epi8('\n'))),
+                                          _mm256_or_si256(_mm256_cmpeq_epi8(block, _mm256_set1_epi8('\f')),
+                                                          _mm256_cmpeq_epi8(block, _mm256_set1_epi8('\r'))));
+        uint32_t spaces = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, _mm256_set1_epi8(' ')));
+        if (_mm256_movemask_epi8(others) == 0 && (spaces & (spaces << 1 | space)) == 0)
+        {
+            _mm256_storeu_si256((__m256i *)write, block);
+            write += 32;
+            space = spaces >> 31;
+            continue;
+        }
+        write = collapse_block_sse2(write, src + i, &space);
+        write = collapse_block_sse2(write, src + i + 16, &space);
+    }
+    write = collapse_whitespace_run(write, src + i, length - i, &space);
+    return (size_t)(write - dst);
+}
+
+// Function to find the first byte that needs JSON escaping 32 bytes at a
+// time
+__attribute__((target("avx2")))
+static size_t json_clean_span_avx2(const unsigned char *data, size_t length)
+{
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32)
+    {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i control = _mm256_cmpeq_epi8(_mm256_min_epu8(block, _mm256_set1_epi8(0x1f)), block);
+        __m256i special = _mm256_or_si256(control, _mm256_or_si256(_mm256_cmpeq_epi8(block, _mm256_set1_epi8('"')),
+                                                                   _mm256_cmpeq_epi8(block, _mm256_set1_epi8('\\'))));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(special);
+        if (mask)
+            return i + (size_t)__builtin_ctz(mask);
+    }
+    return i + json_clean_span_sse2(data + i, length - i);
+}
+#endif
+
+// Every kernel set, the scalar reference first and the preferred last
+static const text_kernels_t text_kernel_table[] = {
+    {"scalar", kernel_always, collapse_whitespace_scalar, json_clean_span_scalar},
+#if defined(__x86_64__) && defined(__GNUC__)
+    {"sse2", kernel_sse2_supported, collapse_whitespace_sse2, json_clean_span_sse2},
+    {"avx2", kernel_avx2_supported, collapse_whitespace_avx2, json_clean_span_avx2},
+#endif
+};
+
+#define TEXT_KERNEL_COUNT (sizeof(text_kernel_table) / sizeof(text_kernel_table[0]))
+
+// Kernels in use, upgraded by select_text_kernels during global setup
+static const text_kernels_t *text_kernels = &text_kernel_table[0];
+
+// Function to pick the last kernel set the processor supports
+static void select_text_kernels(void)
+{
+    for (size_t i = 0; i < TEXT_KERNEL_COUNT; i++)
+    {
+        if (text_kernel_table[i].supported())
+            text_kernels = &text_kernel_table[i];
+    }
+}
+
+// Function to append text with runs of whitespace collapsed to one space
+static void append_clean_whitespace(strbuf_t *buf, const xmlChar *content)
+{
+    size_t length = strlen((const char *)content);
+    if (strbuf_reserve(buf, length) < 0)
+        return;
+    buf->length += text_kernels->collapse_whitespace(buf->data + buf->length, content, length);
+    buf->data[buf->length] = '\0';
+}
+
+// Function to append bytes escaped for the inside of a JSON string. Runs of
+// bytes that need no escaping are found by the given kernels and copied in
+// one go.
+static void strbuf_append_json_using(strbuf_t *buf, const char *data, size_t length, const text_kernels_t *kernels)
+{
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *bytes = (const unsigned char *)data;
+    size_t start = 0;
+
+    while (start < length)
+    {
+        size_t clean = kernels->json_clean_span(bytes + start, length - start);
+        strbuf_append(buf, data + start, clean);
+        start += clean;
+        if (start == length)
+            break;
+
+        char escape = json_escape_table[bytes[start]];
+        if (escape == 'u')
+        {
+            char sequence[6] = {'\\', 'u', '0', '0', hex[bytes[start] >> 4], hex[bytes[start] & 0xf]};
+            strbuf_append(buf, sequence, sizeof(sequence));
+        }
+        else
+        {
+            char sequence[2] = {'\\', escape};
+            strbuf_append(buf, sequence, sizeof(sequence));
+        }
+        start++;
+    }
+}
+
+// Function to append bytes escaped for the inside of a JSON string
+static void strbuf_append_json(strbuf_t *buf, const char *data, size_t length)
+{
+    strbuf_append_json_using(buf, data, length, text_kernels);
+}
+
+// Function to append a string as a quoted JSON string literal
+static void strbuf_append_json_string(strbuf_t *buf, const char *str)
+{
+    strbuf_append(buf, "\"", 1);
+    if (str)
+        strbuf_append_json(buf, str, strlen(str));
+    strbuf_append(buf, "\"", 1);
+}
+
+// CBOR major types used by the binary record format
+#define CBOR_UNSIGNED 0
+#define CBOR_TEXT 3
+#define CBOR_ARRAY 4
+#define CBOR_MAP 5
+
+// Function to append the head of a CBOR data item: its major type and the
+// argument in the shortest encoding
+static void strbuf_append_cbor_head(strbuf_t *buf, int major, uint64_t value)
+{
+    unsigned char head[9];
+    size_t length;
+    if (value < 24)
+    {
+        head[0] = (unsigned char)(major << 5 | value);
+        length = 1;
+    }
+    else
+    {
+        int size = value <= 0xff ? 1 : value <= 0xffff ? 2 : value <= 0xffffffff ? 4 : 8;
+        head[0] = (unsigned char)(major << 5 | (size == 1 ? 24 : size == 2 ? 25 : size == 4 ? 26 : 27));
+        for (int i = 0; i < size; i++)
+            head[1 + i] = (unsigned char)(value >> (8 * (size - 1 - i)));
+        length = 1 + (size_t)size;
+    }
+    strbuf_append(buf, (const char *)head, length);
+}
+
+// Function to append a string as a CBOR text string, or null when absent
+static void strbuf_append_cbor_string(strbuf_t *buf, const char *str)
+{
+    if (!str)
+    {
+        strbuf_append(buf, "\xf6", 1);
+        return;
+    }
+    size_t length = strlen(str);
+    strbuf_append_cbor_head(buf, CBOR_TEXT, length);
+    strbuf_append(buf, str, length);
+}
+
+// Function to count the text of a text node into its parent's statistics
+static void add_text_stats(node_stats_t *stats, const xmlChar *text)
+{
+    if (!text)
+        return;
+    for (const xmlChar *c = text; *c; c++)
+    {
+        if (*c == ',')
+            stats->comma_count++;
+        else if (*c == '.')
+            stats->has_period = 1;
+        stats->text_length++;
+    }
+}
+
+// Function to allocate zeroed statistics for one element
+static node_stats_t *new_node_stats(annotation_t *annotation)
+{
+    node_stats_block_t *block = annotation->blocks;
+    if (!block || block->used == NODE_STATS_BLOCK)
+    {
+        block = xmlMalloc(sizeof(node_stats_block_t));
+        if (!block)
+            return NULL;
+        block->next = annotation->blocks;
+        block->used = 0;
+        annotation->blocks = block;
+    }
+    node_stats_t *stats = &block->stats[block->used++];
+    memset(stats, 0, sizeof(*stats));
+    annotation->element_count++;
+    return stats;
+}
+
+// Function to remember an element that takes part in content scoring
+static int add_paragraph(annotation_t *annotation, xmlNode *node)
+{
+    if (annotation->paragraph_count == annotation->paragraph_capacity)
+    {
+        int capacity = annotation->paragraph_capacity ? annotation->paragraph_capacity * 2 : 256;
+        xmlNodePtr *paragraphs = xmlRealloc(annotation->paragraphs, (size_t)capacity * sizeof(xmlNodePtr));
+        if (!paragraphs)
+            return -1;
+        annotation->paragraphs = paragraphs;
+        annotation->paragraph_capacity = capacity;
+    }
+    annotation->paragraphs[annotation->paragraph_count++] = node;
+    return 0;
+}
+
+// Function to check the time budget. The clock is only read every 256
+// calls, which keeps the check cheap enough for per-node loops.
+static int budget_expired(work_budget_t *budget)
+{
+    if (budget->hit & LIMIT_TIME)
+        return 1;
+    if (budget->deadline == 0 || (++budget->ticks & 255) != 0)
+        return 0;
+    if (now_seconds() < budget->deadline)
+        return 0;
+    budget->hit |= LIMIT_TIME;
+    return 1;
+}
+
+// Function to check whether a walk that has visited count elements may
+// visit one more; the first BUDGET_MIN_NODES always may, time permitting or not
+static int budget_allows(work_budget_t *budget, long count)
+{
+    if (count >= budget->max_nodes)
+    {
+        budget->hit |= LIMIT_NODES;
+        return 0;
+    }
+    return count < BUDGET_MIN_NODES || !budget_expired(budget);
+}
+
+// Function to start the trace of a new document
+static void trace_begin(doc_trace_t *trace)
+{
+    memset(trace, 0, sizeof(*trace));
+    trace->start = now_seconds();
+}
+
+// Function to record a stage that ran from started until now, returning now
+// so that the next stage can start from it. A stage that runs in several
+// pieces adds them up.
+static double trace_stage(doc_trace_t *trace, metric_stage_t stage, double started)
+{
+    double now = now_seconds();
+    if (!(trace->stages_run & (1u << stage)))
+        trace->stage_start[stage] = started;
+    trace->stage_seconds[stage] += now - started;
+    trace->stages_run |= 1u << stage;
+    if (started < trace->start)
+        trace->start = started;
+    return now;
+}
+
+// Function to fold the statistics of a finished element into its parent's;
+// the text of a link also counts as link text
+static void fold_stats(node_stats_t *parent, const xmlNode *child)
+{
+    const node_stats_t *done = child->_private;
+    parent->text_length += done->text_length;
+    parent->comma_count += done->comma_count;
+    parent->has_period |= done->has_period;
+    parent->link_length += done->link_length;
+    if (node_tag(child) == TAG_A)
+        parent->link_length += done->text_length;
+}
+
+// Function to annotate every element below root with its text length,
+// link text length and comma count, adding to annotation. The statistics
+// hang off node->_private, and the p/td/pre elements inside <body> are
+// collected in document order; in_body says root already lies within it.
+// The walk is iterative so deeply nested pages cannot exhaust the stack.
+// Past the node or time budget no further elements are visited; those left
+// out keep a NULL _private and count as text-free.
+static int annotate_subtree(xmlNode *root, int in_body, annotation_t *annotation, work_budget_t *budget)
+{
+    if (!root || root->type != XML_ELEMENT_NODE)
+        return 0;
+
+    int body_depth = in_body;
+    long visited = 1;
+    xmlNode *node = root;
+    root->_private = new_node_stats(annotation);
+    if (!root->_private)
+        return -1;
+
+    while (node)
+    {
+        node_stats_t *stats = node->_private;
+
+        // Descend into the first child, if any
+        xmlNode *child = node->children;
+        tag_t tag = node_tag(node);
+        if (tag == TAG_BODY)
+            body_depth++;
+        else if (body_depth > 0 && (tag_table[tag].flags & TAG_PARAGRAPH))
+        {
+            if (add_paragraph(annotation, node) < 0)
+                return -1;
+        }
+
+        // Text children are folded in directly; the first element child is
+        // the next node to visit
+        while (child && child->type != XML_ELEMENT_NODE)
+        {
+            if (child->type == XML_TEXT_NODE || child->type == XML_CDATA_SECTION_NODE)
+                add_text_stats(stats, child->content);
+            child = child->next;
+        }
+        if (child && budget_allows(budget, visited++))
+        {
+            child->_private = new_node_stats(annotation);
+            if (!child->_private)
+                return -1;
+            node = child;
+            continue;
+        }
+
+        // No element children left: fold finished nodes into their parents
+        // and move on to the next element sibling
+        while (node)
+        {
+            tag_t done_tag = node_tag(node);
+            if (done_tag == TAG_BODY)
+                body_depth--;
+            if (node == root)
+                return 0;
+
+            node_stats_t *parent = node->parent->_private;
+            fold_stats(parent, node);
+
+            xmlNode *next = node->next;
+            while (next && next->type != XML_ELEMENT_NODE)
+            {
+                if (next->type == XML_TEXT_NODE || next->type == XML_CDATA_SECTION_NODE)
+                    add_text_stats(parent, next->content);
+                next = next->next;
+            }
+            if (next && budget_allows(budget, visited++))
+            {
+                next->_private = new_node_stats(annotation);
+                if (!next->_private)
+                    return -1;
+                node = next;
+                break;
+            }
+            node = node->parent;
+        }
+    }
+    return 0;
+}
+
+// Function to annotate the subtree of root into a fresh annotation
+static int annotate_tree(xmlNode *root, int in_body, annotation_t *annotation, work_budget_t *budget)
+{
+    memset(annotation, 0, sizeof(*annotation));
+    return annotate_subtree(root, in_body, annotation, budget);
+}
+
+// Function to step to the next element in document order without leaving
+// the subtree of root; children are skipped when descend is 0
+static xmlNode *next_element(xmlNode *node, xmlNode *root, int descend)
+{
+    if (descend)
+    {
+        for (xmlNode *child = node->children; child; child = child->next)
+        {
+            if (child->type == XML_ELEMENT_NODE)
+                return child;
+        }
+    }
+    while (node && node != root)
+    {
+        for (xmlNode *sibling = node->next; sibling; sibling = sibling->next)
+        {
+            if (sibling->type == XML_ELEMENT_NODE)
+                return sibling;
+        }
+        node = node->parent;
+    }
+    return NULL;
+}
+
+// Function to remove scripts, styles, and other unwanted tags below root,
+// without recursion. Past the node or time budget the rest of the tree is
+// left as it is; rendering skips unwanted elements anyway.
+static void remove_unwanted_tags(xmlNode *root, work_budget_t *budget)
+{
+    long visited = 0;
+    xmlNode *node = next_element(root, root, 1);
+    while (node && budget_allows(budget, visited++))
+    {
+        if (tag_table[node_tag(node)].flags & TAG_UNWANTED)
+        {
+            xmlNode *next = next_element(node, root, 0);
+            xmlUnlinkNode(node);
+            xmlFreeNode(node);
+            node = next;
+        }
+        else
+        {
+            node = next_element(node, root, 1);
+        }
+    }
+}
+
+// Function to detach the statistics from the tree and release them
+static void free_annotation(xmlNode *root, annotation_t *annotation)
+{
+    for (xmlNode *node = root; node; node = next_element(node, root, 1))
+        node->_private = NULL;
+
+    node_stats_block_t *block = annotation->blocks;
+    while (block)
+    {
+        node_stats_block_t *next = block->next;
+        xmlFree(block);
+        block = next;
+    }
+    xmlFree(annotation->paragraphs);
+    memset(annotation, 0, sizeof(*annotation));
+}
+
+// Function to get the link density of finished statistics
+static double stats_link_density(const node_stats_t *stats)
+{
+    return stats->text_length == 0 ? 0.0 : (double)stats->link_length / stats->text_length;
+}
+
+// Function to get link density of an annotated node
+static double get_link_density(xmlNode *node)
+{
+    node_stats_t *stats = node->_private;
+    return stats ? stats_link_density(stats) : 0.0;
+}
+
+// The paragraph rules below are shared by the tree and the streaming engine,
+// so that both find the same article
+
+// Function to tell whether a paragraph holds enough text to be scored
+static int paragraph_scores(const node_stats_t *stats)
+{
+    return stats->text_length >= 25;
+}
+
+// Function to add the score of a paragraph with the tag tag to its parent
+// and grandparent: a point, one per 100 characters and three per comma,
+// half of it for the grandparent, and a bonus when it is a <p>
+static void add_paragraph_score(const node_stats_t *stats, tag_t tag, double *parent_score,
+                                double *grand_parent_score)
+{
+    int content_score = 1;
+    content_score += stats->text_length / 100;
+    content_score += stats->comma_count * 3;
+
+    *parent_score += content_score;
+    *grand_parent_score += content_score / 2.0;
+    if (tag == TAG_P)
+    {
+        *parent_score += 5;
+        *grand_parent_score += 3;
+    }
+}
+
+// Function to tell whether a <p> next to the top candidate belongs to the
+// article whatever its score: a long one with few links, or a short
+// sentence with none
+static int paragraph_joins_article(const node_stats_t *stats, double link_density)
+{
+    return (stats->text_length > 80 && link_density < 0.25) ||
+           (stats->text_length < 80 && link_density == 0 && stats->has_period);
+}
+
+// Default class/id patterns, matched case-insensitively as substrings.
+// A leading '^' or trailing '$' anchors the literal to a whitespace-separated
+// word boundary, so "^hid$" only matches a standalone "hid" class token.
+static const char *default_positive_patterns[] = {
+    "article", "body", "content", "entry", "hentry", "h-entry", "main", "page",
+    "pagination", "post", "text", "blog", "story", NULL};
+
+static const char *default_negative_patterns[] = {
+    "hidden", "^hid$", "banner", "combx", "comment", "com-", "contact", "foot",
+    "footer", "footnote", "masthead", "media", "meta", "outbrain", "promo",
+    "related", "scroll", "share", "shoutbox", "sidebar", "skyscraper", "sponsor",
+    "shopping", "tags", "tool", "widget", "ad", "advert", "promoted",
+    "recommended", "paid", "partnership", NULL};
+
+// A single literal in the pattern matcher
+typedef struct
+{
+    int group;
+    int length;
+    int anchor_start;
+    int anchor_end;
+    int next;
+} pattern_t;
+
+// Aho-Corasick automaton compiled into a dense DFA over the pattern alphabet
+typedef struct
+{
+    unsigned char char_class[256];
+    int class_count;
+    int state_count;
+    int state_capacity;
+    int *transitions;
+    int *fail;
+    int *mask;
+    int *anchored;
+    int *anchored_link;
+    pattern_t *patterns;
+    int pattern_count;
+    int pattern_capacity;
+    int all_groups;
+} pattern_matcher_t;
+
+typedef struct scoring_pool scoring_pool_t;
+
+// Per-thread extraction state. The scratch buffers keep their capacity from
+// one document to the next; the matcher and the cache may be borrowed from
+// another context.
+struct readability_context
+{
+    pattern_matcher_t *matcher;
+    int owns_matcher;
+    page_cache_t *cache;
+    template_store_t *templates;
+    strbuf_t template_path; // path of the current document's template
+    readability_limits_t limits;
+    readability_fetch_options_t fetch_options;
+    CURL *fetch_handle;     // kept between fetches, created on first use
+    work_budget_t budget;   // budget of the current document
+    doc_trace_t trace;      // its timings and counts
+    metrics_shard_t metrics;
+    readability_sink_fn trace_sink;
+    void *trace_userdata;
+    strbuf_t trace_output;
+    article_nodes_t nodes;  // article nodes of the current document
+    strbuf_t content;       // its Markdown
+    strbuf_t output;        // its rendering in the requested format
+    strbuf_t output_tail;   // for binary records, the part after the content
+    strbuf_t output_scratch;
+    int output_split;       // whether the rendering is output, content and tail
+    readability_sinkv_fn sinkv;
+    readability_engine_t engine;
+    int threads;            // scoring threads for documents of PARALLEL_MIN_BYTES or more
+    scoring_pool_t *pool;   // those beyond the context's own, created on first use
+    readability_check_t check;
+    const char *error;
+    failure_reason_t failure; // what the metrics count the error as
+    char error_text[256];   // why a batch, server or benchmark could not run
+};
+
+// Function to make a formatted message the error of a context
+static void set_error(readability_context_t *ctx, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vsnprintf(ctx->error_text, sizeof(ctx->error_text), format, args);
+    va_end(args);
+    ctx->error = ctx->error_text;
+    ctx->failure = FAILURE_OTHER;
+}
+
+// Function to record why the current document failed
+static void set_failure(readability_context_t *ctx, failure_reason_t reason, const char *error)
+{
+    ctx->error = error;
+    ctx->failure = reason;
+}
+
+// Function to start the work budget of a new document from the context's
+// limits
+static void budget_start(readability_context_t *ctx)
+{
+    work_budget_t *budget = &ctx->budget;
+    budget->max_nodes = ctx->limits.max_nodes > 0 ? ctx->limits.max_nodes : LONG_MAX;
+    budget->max_depth = ctx->limits.max_depth > 0 ? ctx->limits.max_depth : INT_MAX;
+    budget->deadline = ctx->limits.max_milliseconds > 0 ? now_seconds() + ctx->limits.max_milliseconds / 1000.0 : 0;
+    budget->ticks = 0;
+    budget->hit = 0;
+}
+
+// Function to cut an input down to the context's input limit, recording the
+// cut in the current budget
+static size_t budget_input(readability_context_t *ctx, size_t size)
+{
+    if (ctx->limits.max_input_bytes == 0 || size <= ctx->limits.max_input_bytes)
+        return size;
+    ctx->budget.hit |= LIMIT_INPUT;
+    return ctx->limits.max_input_bytes;
+}
+
+// Function to add a state to the matcher trie
+static int matcher_new_state(pattern_matcher_t *matcher)
+{
+    if (matcher->state_count == matcher->state_capacity)
+    {
+        int capacity = matcher->state_capacity ? matcher->state_capacity * 2 : 64;
+        int *transitions = realloc(matcher->transitions, (size_t)capacity * 256 * sizeof(int));
+        int *anchored = realloc(matcher->anchored, (size_t)capacity * sizeof(int));
+        int *mask = realloc(matcher->mask, (size_t)capacity * sizeof(int));
+        if (transitions) matcher->transitions = transitions;
+        if (anchored) matcher->anchored = anchored;
+        if (mask) matcher->mask = mask;
+        if (!transitions || !anchored || !mask)
+            return -1;
+        matcher->state_capacity = capacity;
+    }
+
+    int state = matcher->state_count++;
+    for (int c = 0; c < 256; c++)
+        matcher->transitions[state * 256 + c] = -1;
+    matcher->anchored[state] = -1;
+    matcher->mask[state] = 0;
+    return state;
+}
+
+// Function to add a literal pattern to a group of the matcher
+static int matcher_add_pattern(pattern_matcher_t *matcher, const char *pattern, size_t length, int group)
+{
+    int anchor_start = 0, anchor_end = 0;
+    if (length > 0 && pattern[0] == '^')
+    {
+        anchor_start = 1;
+        pattern++;
+        length--;
+    }
+    if (length > 0 && pattern[length - 1] == '$')
+    {
+        anchor_end = 1;
+        length--;
+    }
+    if (length == 0)
+        return 0;
+
+    if (matcher->state_count == 0 && matcher_new_state(matcher) < 0)
+        return -1;
+
+    int state = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        unsigned char c = (unsigned char)tolower((unsigned char)pattern[i]);
+        int next = matcher->transitions[state * 256 + c];
+        if (next < 0)
+        {
+            next = matcher_new_state(matcher);
+            if (next < 0)
+                return -1;
+            matcher->transitions[state * 256 + c] = next;
+        }
+        state = next;
+    }
+
+    if (anchor_start || anchor_end)
+    {
+        if (matcher->pattern_count == matcher->pattern_capacity)
+        {
+            int capacity = matcher->pattern_capacity ? matcher->pattern_capacity * 2 : 16;
+            pattern_t *patterns = realloc(matcher->patterns, (size_t)capacity * sizeof(pattern_t));
+            if (!patterns)
+                return -1;
+            matcher->patterns = patterns;
+            matcher->pattern_capacity = capacity;
+        }
+        pattern_t *p = &matcher->patterns[matcher->pattern_count];
+        p->group = group;
+        p->length = (int)length;
+        p->anchor_start = anchor_start;
+        p->anchor_end = anchor_end;
+        p->next = matcher->anchored[state];
+        matcher->anchored[state] = matcher->pattern_count++;
+    }
+    else
+    {
+        matcher->mask[state] |= group;
+    }
+
+    matcher->all_groups |= group;
+    return 0;
+}
+
+// Function to turn the pattern trie into a DFA with a compact alphabet
+static int matcher_compile(pattern_matcher_t *matcher)
+{
+    if (matcher->state_count == 0 && matcher_new_state(matcher) < 0)
+        return -1;
+
+    // Bytes that never occur in a pattern all share class 0
+    int used[256] = {0};
+    for (int s = 0; s < matcher->state_count; s++)
+        for (int c = 0; c < 256; c++)
+            if (matcher->transitions[s * 256 + c] >= 0)
+                used[c] = 1;
+
+    matcher->class_count = 1;
+    memset(matcher->char_class, 0, sizeof(matcher->char_class));
+    for (int c = 0; c < 256; c++)
+    {
+        if (used[c])
+            matcher->char_class[c] = (unsigned char)matcher->class_count++;
+    }
+    for (int c = 'A'; c <= 'Z'; c++)
+        matcher->char_class[c] = matcher->char_class[tolower(c)];
+
+    int classes = matcher->class_count;
+    int *dense = malloc((size_t)matcher->state_count * classes * sizeof(int));
+    int *fail = malloc((size_t)matcher->state_count * sizeof(int));
+    int *anchored_link = malloc((size_t)matcher->state_count * sizeof(int));
+    int *queue = malloc((size_t)matcher->state_count * sizeof(int));
+    if (!dense || !fail || !anchored_link || !queue)
+    {
+        free(dense);
+        free(fail);
+        free(anchored_link);
+        free(queue);
+        return -1;
+    }
+
+    for (int s = 0; s < matcher->state_count; s++)
+    {
+        for (int k = 0; k < classes; k++)
+            dense[s * classes + k] = -1;
+        for (int c = 0; c < 256; c++)
+        {
+            int next = matcher->transitions[s * 256 + c];
+            if (next >= 0)
+                dense[s * classes + matcher->char_class[c]] = next;
+        }
+    }
+
+    // Breadth-first construction of failure links, folding the outputs of
+    // each suffix state into its own so matching never follows fail links
+    int head = 0, tail = 0;
+    fail[0] = 0;
+    anchored_link[0] = -1;
+    for (int k = 0; k < classes; k++)
+    {
+        int next = dense[k];
+        if (next < 0)
+        {
+            dense[k] = 0;
+        }
+        else
+        {
+            fail[next] = 0;
+            anchored_link[next] = -1;
+            queue[tail++] = next;
+        }
+    }
+
+    while (head < tail)
+    {
+        int s = queue[head++];
+        for (int k = 0; k < classes; k++)
+        {
+            int next = dense[s * classes + k];
+            int fallback = dense[fail[s] * classes + k];
+            if (next < 0)
+            {
+                dense[s * classes + k] = fallback;
+                continue;
+            }
+            fail[next] = fallback;
+            matcher->mask[next] |= matcher->mask[fallback];
+            anchored_link[next] = matcher->anchored[fallback] >= 0 ? fallback : anchored_link[fallback];
+            queue[tail++] = next;
+        }
+    }
+
+    free(queue);
+    free(matcher->transitions);
+    matcher->transitions = dense;
+    matcher->fail = fail;
+    matcher->anchored_link = anchored_link;
+    return 0;
+}
+
+// Function to release a compiled matcher
+static void free_pattern_matcher(pattern_matcher_t *matcher)
+{
+    if (!matcher)
+        return;
+    free(matcher->transitions);
+    free(matcher->fail);
+    free(matcher->mask);
+    free(matcher->anchored);
+    free(matcher->anchored_link);
+    free(matcher->patterns);
+    free(matcher);
+}
+
+// Function to check the word boundaries of an anchored pattern match
+static int anchored_match(const pattern_t *p, const unsigned char *text, size_t end, size_t length)
+{
+    size_t start = end + 1 - (size_t)p->length;
+    if (p->anchor_start && start > 0 && !isspace(text[start - 1]))
+        return 0;
+    if (p->anchor_end && end + 1 < length && !isspace(text[end + 1]))
+        return 0;
+    return 1;
+}
+
+// Function to scan a string once and return the mask of groups that matched
+static int match_patterns(const pattern_matcher_t *matcher, const xmlChar *text)
+{
+    if (!text)
+        return 0;
+
+    const unsigned char *bytes = (const unsigned char *)text;
+    size_t length = strlen((const char *)bytes);
+    int classes = matcher->class_count;
+    int state = 0, found = 0;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        state = matcher->transitions[state * classes + matcher->char_class[bytes[i]]];
+        found |= matcher->mask[state];
+
+        int s = matcher->anchored[state] >= 0 ? state : matcher->anchored_link[state];
+        while (s >= 0)
+        {
+            for (int p = matcher->anchored[s]; p >= 0; p = matcher->patterns[p].next)
+            {
+                if (anchored_match(&matcher->patterns[p], bytes, i, length))
+                    found |= matcher->patterns[p].group;
+            }
+            s = matcher->anchored_link[s];
+        }
+
+        if (found == matcher->all_groups)
+            break;
+    }
+    return found;
+}
+
+// Function to add a '|' or newline separated list of patterns to a group
+static int matcher_add_pattern_list(pattern_matcher_t *matcher, const char *list, int group)
+{
+    const char *start = list;
+    while (*start)
+    {
+        size_t length = strcspn(start, "|\r\n");
+        if (matcher_add_pattern(matcher, start, length, group) < 0)
+            return -1;
+        start += length;
+        if (*start)
+            start++;
+    }
+    return 0;
+}
+
+// Function to build the class/id matcher from the built-in pattern lists
+static pattern_matcher_t *new_default_class_matcher(void)
+{
+    pattern_matcher_t *matcher = calloc(1, sizeof(pattern_matcher_t));
+    if (!matcher)
+        return NULL;
+
+    for (int i = 0; default_positive_patterns[i]; i++)
+    {
+        if (matcher_add_pattern_list(matcher, default_positive_patterns[i], MATCH_POSITIVE) < 0)
+            goto fail;
+    }
+    for (int i = 0; default_negative_patterns[i]; i++)
+    {
+        if (matcher_add_pattern_list(matcher, default_negative_patterns[i], MATCH_NEGATIVE) < 0)
+            goto fail;
+    }
+    if (matcher_compile(matcher) < 0)
+        goto fail;
+    return matcher;
+
+fail:
+    free_pattern_matcher(matcher);
+    return NULL;
+}
+
+// Function to load class/id patterns from a config file.
+// The file has "[positive]" and "[negative]" sections with one pattern (or a
+// '|' separated list) per line; blank lines and lines starting with '#' are
+// ignored. Returns NULL with errno set on failure, to EINVAL when a line is
+// neither a pattern of a section nor a [positive] or [negative] header.
+static pattern_matcher_t *load_class_patterns(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return NULL;
+
+    pattern_matcher_t *matcher = calloc(1, sizeof(pattern_matcher_t));
+    if (!matcher)
+    {
+        fclose(file);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    char line[MAX_BUFFER];
+    int group = 0, error = 0;
+    while (!error && fgets(line, sizeof(line), file))
+    {
+        char *start = line;
+        while (isspace((unsigned char)*start))
+            start++;
+        size_t length = strlen(start);
+        while (length > 0 && isspace((unsigned char)start[length - 1]))
+            start[--length] = '\0';
+
+        if (length == 0 || start[0] == '#')
+            continue;
+
+        if (strcmp(start, "[positive]") == 0)
+        {
+            group = MATCH_POSITIVE;
+        }
+        else if (strcmp(start, "[negative]") == 0)
+        {
+            group = MATCH_NEGATIVE;
+        }
+        else if (start[0] == '[' || group == 0)
+        {
+            error = EINVAL;
+        }
+        else if (matcher_add_pattern_list(matcher, start, group) < 0)
+        {
+            error = ENOMEM;
+        }
+    }
+    fclose(file);
+
+    if (!error && matcher_compile(matcher) < 0)
+        error = ENOMEM;
+    if (error)
+    {
+        free_pattern_matcher(matcher);
+        errno = error;
+        return NULL;
+    }
+    return matcher;
+}
+
+// Function to get class weight of a node
+static int get_class_weight(const pattern_matcher_t *matcher, xmlNode *node)
+{
+    int weight = 0;
+    xmlChar *class = xmlGetProp(node, (xmlChar *)"class");
+    xmlChar *id = xmlGetProp(node, (xmlChar *)"id");
+
+    int class_match = match_patterns(matcher, class);
+    int id_match = match_patterns(matcher, id);
+
+    if (class_match & MATCH_NEGATIVE)
+        weight -= 25;
+    if (class_match & MATCH_POSITIVE)
+        weight += 25;
+    if (id_match & MATCH_NEGATIVE)
+        weight -= 25;
+    if (id_match & MATCH_POSITIVE)
+        weight += 25;
+
+    xmlFree(class);
+    xmlFree(id);
+    return weight;
+}
+
+// Readerable check, after Readability.js's isProbablyReaderable: a page is
+// probably an article when its visible <p>, <pre> and <article> elements,
+// and the <div>s holding a <br>, that have at least READERABLE_MIN_LENGTH
+// characters of text score more than READERABLE_MIN_SCORE between them, each
+// counting the square root of its length beyond that minimum. Elements
+// nested deeper than READERABLE_MAX_DEPTH among those are not counted.
+#define READERABLE_MIN_LENGTH 140
+#define READERABLE_MIN_SCORE 20
+#define READERABLE_MAX_DEPTH 256
+
+// An open element the check may count: its text runs from the first
+// non-space character after it opened to the last one before it closed
+typedef struct
+{
+    xmlNodePtr node;
+    long first; // -1 until its first non-space character
+    int has_br;
+} readerable_frame_t;
+
+// Text seen so far by the check, in characters, and its open elements
+typedef struct
+{
+    readerable_frame_t frames[READERABLE_MAX_DEPTH];
+    int depth;   // open elements, counted or not
+    int pending; // frames still waiting for their first character
+    int li_depth;
+    long length;
+    long last_end; // just past the last non-space character
+    double score;
+} readerable_walk_t;
+
+// Function to take the square root of a non-negative number by Newton's
+// method, so that the check needs no libm
+static double square_root(double value)
+{
+    if (value <= 0)
+        return 0;
+    double root = value > 1 ? value : 1;
+    for (;;)
+    {
+        double next = (root + value / root) / 2;
+        if (next >= root)
+            return root;
+        root = next;
+    }
+}
+
+// Function to count the characters of a text node for the check, UTF-8
+// sequences as one, noting where its first and last non-space ones fall
+static void readerable_text(readerable_walk_t *walk, const xmlChar *text)
+{
+    if (!text)
+        return;
+    int stored = walk->depth < READERABLE_MAX_DEPTH ? walk->depth : READERABLE_MAX_DEPTH;
+    for (const xmlChar *c = text; *c; c++)
+    {
+        if ((*c & 0xc0) == 0x80)
+            continue;
+        walk->length++;
+        if (*c == ' ' || *c == '\t' || *c == '\n' || *c == '\r' || *c == '\f' || *c == '\v')
+            continue;
+        while (walk->pending < stored)
+            walk->frames[walk->pending++].first = walk->length - 1;
+        walk->last_end = walk->length;
+    }
+}
+
+// Function to tell whether the inline style of a node sets property to
+// value, both compared case-insensitively
+static int style_sets(const xmlChar *style, const char *property, const char *value)
+{
+    size_t property_length = strlen(property);
+    size_t value_length = strlen(value);
+    for (const char *declaration = (const char *)style; declaration && *declaration;)
+    {
+        const char *end = strchr(declaration, ';');
+        if (!end)
+            end = declaration + strlen(declaration);
+        while (declaration < end && isspace((unsigned char)*declaration))
+            declaration++;
+        const char *colon = memchr(declaration, ':', (size_t)(end - declaration));
+        if (colon)
+        {
+            const char *name_end = colon;
+            while (name_end > declaration && isspace((unsigned char)name_end[-1]))
+                name_end--;
+            const char *start = colon + 1;
+            while (start < end && isspace((unsigned char)*start))
+                start++;
+            const char *stop = end;
+            while (stop > start && isspace((unsigned char)stop[-1]))
+                stop--;
+            if ((size_t)(name_end - declaration) == property_length &&
+                strncasecmp(declaration, property, property_length) == 0 &&
+                (size_t)(stop - start) == value_length && strncasecmp(start, value, value_length) == 0)
+                return 1;
+        }
+        declaration = *end ? end + 1 : end;
+    }
+    return 0;
+}
+
+// Function to tell whether an element would be shown, as far as its own
+// attributes go: not display:none or visibility:hidden inline, not hidden,
+// and not aria-hidden unless it is a fallback image (Wikipedia's maths)
+static int readerable_visible(xmlNode *node)
+{
+    if (xmlHasProp(node, (const xmlChar *)"hidden"))
+        return 0;
+    xmlChar *style = xmlGetProp(node, (const xmlChar *)"style");
+    int visible = !style_sets(style, "display", "none") && !style_sets(style, "visibility", "hidden");
+    xmlFree(style);
+
+    xmlChar *aria_hidden = visible ? xmlGetProp(node, (const xmlChar *)"aria-hidden") : NULL;
+    if (aria_hidden && xmlStrcmp(aria_hidden, (const xmlChar *)"true") == 0)
+    {
+        xmlChar *class = xmlGetProp(node, (const xmlChar *)"class");
+        visible = class && xmlStrstr(class, (const xmlChar *)"fallback-image");
+        xmlFree(class);
+    }
+    xmlFree(aria_hidden);
+    return visible;
+}
+
+// Function to close the innermost open element of the check, adding its
+// score when it counts. Returns 1 once the page is found readerable.
+static int readerable_close(readerable_walk_t *walk, xmlNode *node, tag_t tag, const pattern_matcher_t *matcher)
+{
+    walk->depth--;
+    if (walk->depth >= READERABLE_MAX_DEPTH)
+        return 0;
+    if (walk->pending > walk->depth)
+        walk->pending = walk->depth;
+
+    const readerable_frame_t *frame = &walk->frames[walk->depth];
+    long length = frame->first < 0 ? 0 : walk->last_end - frame->first;
+    if (length < READERABLE_MIN_LENGTH || (tag == TAG_DIV && !frame->has_br) || (tag == TAG_P && walk->li_depth > 0))
+        return 0;
+
+    xmlChar *class = xmlGetProp(node, (const xmlChar *)"class");
+    xmlChar *id = xmlGetProp(node, (const xmlChar *)"id");
+    int match = match_patterns(matcher, class) | match_patterns(matcher, id);
+    xmlFree(class);
+    xmlFree(id);
+    if ((match & MATCH_NEGATIVE) && !(match & MATCH_POSITIVE))
+        return 0;
+    if (!readerable_visible(node))
+        return 0;
+
+    walk->score += square_root((double)(length - READERABLE_MIN_LENGTH));
+    return walk->score > READERABLE_MIN_SCORE;
+}
+
+// Function to tell, in one walk over the tree below root that stops as soon
+// as the answer is known, whether the page is probably an article. The
+// class/id patterns of matcher play the part of Readability.js's unlikely
+// and maybe-a-candidate lists.
+static int is_probably_readerable(xmlNode *root, const pattern_matcher_t *matcher)
+{
+    if (!root || root->type != XML_ELEMENT_NODE)
+        return 0;
+
+    readerable_walk_t walk = {0};
+    int readerable = 0;
+    xmlNode *node = root;
+    while (node && !readerable)
+    {
+        tag_t tag = node_tag(node);
+        if (tag == TAG_P || tag == TAG_PRE || tag == TAG_ARTICLE || tag == TAG_DIV)
+        {
+            if (walk.depth < READERABLE_MAX_DEPTH)
+                walk.frames[walk.depth] = (readerable_frame_t){node, -1, 0};
+            walk.depth++;
+        }
+        else if (tag == TAG_BR && walk.depth > 0 && walk.depth <= READERABLE_MAX_DEPTH &&
+                 walk.frames[walk.depth - 1].node == node->parent)
+        {
+            walk.frames[walk.depth - 1].has_br = 1;
+        }
+        else if (tag == TAG_LI)
+        {
+            walk.li_depth++;
+        }
+
+        // Text children are counted directly; the first element child is
+        // the next node to visit
+        xmlNode *child = node->children;
+        while (child && child->type != XML_ELEMENT_NODE)
+        {
+            if (child->type == XML_TEXT_NODE || child->type == XML_CDATA_SECTION_NODE)
+                readerable_text(&walk, child->content);
+            child = child->next;
+        }
+        if (child)
+        {
+            node = child;
+            continue;
+        }
+
+        // No element children left: close finished elements and move on to
+        // the next element sibling
+        while (node && !readerable)
+        {
+            tag_t done_tag = node_tag(node);
+            if (done_tag == TAG_P || done_tag == TAG_PRE || done_tag == TAG_ARTICLE || done_tag == TAG_DIV)
+                readerable = readerable_close(&walk, node, done_tag, matcher);
+            else if (done_tag == TAG_LI)
+                walk.li_depth--;
+            if (node == root)
+            {
+                node = NULL;
+                break;
+            }
+
+            xmlNode *next = node->next;
+            while (next && next->type != XML_ELEMENT_NODE)
+            {
+                if (next->type == XML_TEXT_NODE || next->type == XML_CDATA_SECTION_NODE)
+                    readerable_text(&walk, next->content);
+                next = next->next;
+            }
+            if (next)
+            {
+                node = next;
+                break;
+            }
+            node = node->parent;
+        }
+    }
+    return readerable;
+}
+
+// Function to initialize a node with content score
+static void initialize_node(candidate_t *candidate, xmlNode *node)
+{
+    candidate->node = node;
+    candidate->content_score = tag_table[node_tag(node)].content_score;
+}
+
+// Function to hash a node pointer into a power-of-two slot table
+static inline unsigned int hash_node(const xmlNode *node, int slot_count)
+{
+    uint64_t key = (uint64_t)(uintptr_t)node;
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return (unsigned int)key & (unsigned int)(slot_count - 1);
+}
+
+// Function to rebuild the slot table at a new size
+static int candidate_table_rehash(candidate_table_t *table, int slot_count)
+{
+    int *slots = xmlMalloc((size_t)slot_count * sizeof(int));
+    if (!slots)
+        return -1;
+    memset(slots, 0, (size_t)slot_count * sizeof(int));
+
+    for (int i = 0; i < table->count; i++)
+    {
+        unsigned int slot = hash_node(table->items[i].node, slot_count);
+        while (slots[slot])
+            slot = (slot + 1) & (unsigned int)(slot_count - 1);
+        slots[slot] = i + 1;
+    }
+
+    xmlFree(table->slots);
+    table->slots = slots;
+    table->slot_count = slot_count;
+    return 0;
+}
+
+// Function to find a node's candidate, or NULL if it has none
+static candidate_t *candidate_table_find(const candidate_table_t *table, const xmlNode *node)
+{
+    if (table->slot_count == 0)
+        return NULL;
+
+    unsigned int slot = hash_node(node, table->slot_count);
+    while (table->slots[slot])
+    {
+        candidate_t *candidate = &table->items[table->slots[slot] - 1];
+        if (candidate->node == node)
+            return candidate;
+        slot = (slot + 1) & (unsigned int)(table->slot_count - 1);
+    }
+    return NULL;
+}
+
+// Function to find a node's candidate, initializing a new one if needed.
+// Returns the candidate's index, which stays valid as the table grows.
+static int candidate_table_get(candidate_table_t *table, xmlNode *node)
+{
+    // Keep the load factor at or below one half
+    if ((table->count + 1) * 2 > table->slot_count &&
+        candidate_table_rehash(table, table->slot_count ? table->slot_count * 2 : 64) < 0)
+        return -1;
+
+    unsigned int slot = hash_node(node, table->slot_count);
+    while (table->slots[slot])
+    {
+        int index = table->slots[slot] - 1;
+        if (table->items[index].node == node)
+            return index;
+        slot = (slot + 1) & (unsigned int)(table->slot_count - 1);
+    }
+
+    if (table->count == table->capacity)
+    {
+        int capacity = table->capacity ? table->capacity * 2 : 32;
+        candidate_t *items = xmlRealloc(table->items, (size_t)capacity * sizeof(candidate_t));
+        if (!items)
+            return -1;
+        table->items = items;
+        table->capacity = capacity;
+    }
+
+    int index = table->count++;
+    initialize_node(&table->items[index], node);
+    table->slots[slot] = index + 1;
+    return index;
+}
+
+// Function to release a candidate table
+static void free_candidate_table(candidate_table_t *table)
+{
+    xmlFree(table->items);
+    xmlFree(table->slots);
+    memset(table, 0, sizeof(*table));
+}
+
+// Where each <meta> key feeds the metadata, matched case-insensitively
+// against both the property and the name attribute
+typedef struct
+{
+    const char *key;
+    metadata_field_t field;
+    int priority;
+} metadata_source_t;
+
+static const metadata_source_t meta_sources[] = {
+    {"og:title", META_TITLE, 2},
+    {"twitter:title", META_TITLE, 3},
+    {"og:author", META_AUTHOR, 1},
+    {"author", META_AUTHOR, 2},
+    {"dc.creator", META_AUTHOR, 3},
+    {"article:author", META_AUTHOR, 5},
+    {"og:description", META_DESCRIPTION, 1},
+    {"description", META_DESCRIPTION, 2},
+    {"twitter:description", META_DESCRIPTION, 3},
+    {"dc.description", META_DESCRIPTION, 3},
+    {"og:site_name", META_SITE_NAME, 1},
+    {"application-name", META_SITE_NAME, 3},
+    {"article:published_time", META_PUBLISHED_TIME, 1},
+    {"dc.date", META_PUBLISHED_TIME, 3},
+    {"dcterms.created", META_PUBLISHED_TIME, 3},
+    {"article:modified_time", META_MODIFIED_TIME, 1},
+    {"og:updated_time", META_MODIFIED_TIME, 2},
+    {"dcterms.modified", META_MODIFIED_TIME, 3},
+    {"og:url", META_CANONICAL_URL, 2},
+    {"og:image", META_LEAD_IMAGE, 1},
+    {"og:image:url", META_LEAD_IMAGE, 1},
+    {"og:image:secure_url", META_LEAD_IMAGE, 1},
+    {"twitter:image", META_LEAD_IMAGE, 2},
+    {"twitter:image:src", META_LEAD_IMAGE, 2},
+};
+
+// Priorities of the sources that are not <meta> keys
+#define META_PRIORITY_DOCUMENT 1 // <title>, <html lang>, <link rel=canonical>
+#define META_PRIORITY_HTTP_EQUIV 2
+#define META_PRIORITY_JSONLD_DATE 2
+#define META_PRIORITY_JSONLD 4
+
+// JSON-LD types that describe an article
+static const char *const jsonld_article_types[] = {
+    "Article", "AdvertiserContentArticle", "NewsArticle", "AnalysisNewsArticle",
+    "AskPublicNewsArticle", "BackgroundNewsArticle", "OpinionNewsArticle",
+    "ReportageNewsArticle", "ReviewNewsArticle", "Report", "SatiricalArticle",
+    "ScholarlyArticle", "MedicalScholarlyArticle", "SocialMediaPosting",
+    "BlogPosting", "LiveBlogPosting", "DiscussionForumPosting", "TechArticle",
+    "APIReference",
+};
+
+#define JSON_MAX_DEPTH 64
+
+// Cursor over a JSON text
+typedef struct
+{
+    const char *cur;
+    const char *end;
+    int depth;
+} json_parser_t;
+
+// Function to release a parsed JSON value and everything under it
+static void free_json(json_value_t *value)
+{
+    while (value)
+    {
+        json_value_t *next = value->next;
+        free_json(value->children);
+        xmlFree(value->key);
+        xmlFree(value->string);
+        xmlFree(value);
+        value = next;
+    }
+}
+
+// Function to skip JSON whitespace
+static void json_skip_space(json_parser_t *p)
+{
+    while (p->cur < p->end && (*p->cur == ' ' || *p->cur == '\t' || *p->cur == '\n' || *p->cur == '\r'))
+        p->cur++;
+}
+
+// Function to read the four hex digits of a \u escape
+static int json_parse_hex4(json_parser_t *p, unsigned int *code)
+{
+    if (p->end - p->cur < 4)
+        return -1;
+
+    *code = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        char c = p->cur[i];
+        unsigned int digit;
+        if (c >= '0' && c <= '9')
+            digit = (unsigned int)(c - '0');
+        else if (c >= 'a' && c <= 'f')
+            digit = (unsigned int)(c - 'a' + 10);
+        else if (c >= 'A' && c <= 'F')
+            digit = (unsigned int)(c - 'A' + 10);
+        else
+            return -1;
+        *code = (*code << 4) | digit;
+    }
+    p->cur += 4;
+    return 0;
+}
+
+// Function to encode a code point as UTF-8, returning the bytes written
+static size_t json_put_utf8(char *out, unsigned int code)
+{
+    if (code < 0x80)
+    {
+        out[0] = (char)code;
+        return 1;
+    }
+    if (code < 0x800)
+    {
+        out[0] = (char)(0xC0 | (code >> 6));
+        out[1] = (char)(0x80 | (code & 0x3F));
+        return 2;
+    }
+    if (code < 0x10000)
+    {
+        out[0] = (char)(0xE0 | (code >> 12));
+        out[1] = (char)(0x80 | ((code >> 6) & 0x3F));
+        out[2] = (char)(0x80 | (code & 0x3F));
+        return 3;
+    }
+    out[0] = (char)(0xF0 | (code >> 18));
+    out[1] = (char)(0x80 | ((code >> 12) & 0x3F));
+    out[2] = (char)(0x80 | ((code >> 6) & 0x3F));
+    out[3] = (char)(0x80 | (code & 0x3F));
+    return 4;
+}
+
+// Function to decode a JSON string literal at the cursor. Escapes never
+// expand, so the source span bounds the decoded size.
+static char *json_parse_string(json_parser_t *p)
+{
+    if (p->cur >= p->end || *p->cur != '"')
+        return NULL;
+    p->cur++;
+
+    const char *close = p->cur;
+    while (close < p->end && *close != '"')
+        close += (*close == '\\') ? 2 : 1;
+    if (close >= p->end)
+        return NULL;
+
+    char *result = xmlMalloc((size_t)(close - p->cur) + 1);
+    if (!result)
+        return NULL;
+
+    char *write = result;
+    while (p->cur < close)
+    {
+        char c = *p->cur++;
+        if (c != '\\')
+        {
+            *write++ = c;
+            continue;
+        }
+
+        c = *p->cur++;
+        switch (c)
+        {
+        case 'b': *write++ = '\b'; break;
+        case 'f': *write++ = '\f'; break;
+        case 'n': *write++ = '\n'; break;
+        case 'r': *write++ = '\r'; break;
+        case 't': *write++ = '\t'; break;
+        case 'u':
+        {
+            unsigned int code;
+            if (json_parse_hex4(p, &code) < 0)
+            {
+                xmlFree(result);
+                return NULL;
+            }
+            if (code >= 0xD800 && code < 0xDC00 && close - p->cur >= 6 && p->cur[0] == '\\' && p->cur[1] == 'u')
+            {
+                unsigned int low;
+                p->cur += 2;
+                if (json_parse_hex4(p, &low) < 0 || low < 0xDC00 || low > 0xDFFF)
+                {
+                    xmlFree(result);
+                    return NULL;
+                }
+                code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+            }
+            else if (code >= 0xD800 && code <= 0xDFFF)
+            {
+                code = 0xFFFD;
+            }
+            write += json_put_utf8(write, code);
+            break;
+        }
+        default:
+            *write++ = c;
+            break;
+        }
+    }
+    *write = '\0';
+    p->cur = close + 1;
+    return result;
+}
+
+static json_value_t *json_parse_value(json_parser_t *p);
+
+// Function to parse the members of an array or object after its opening bracket
+static int json_parse_members(json_parser_t *p, json_value_t *container, char close)
+{
+    json_value_t **tail = &container->children;
+    json_skip_space(p);
+    if (p->cur < p->end && *p->cur == close)
+    {
+        p->cur++;
+        return 0;
+    }
+
+    while (p->cur < p->end)
+    {
+        char *key = NULL;
+        if (container->type == JSON_OBJECT)
+        {
+            key = json_parse_string(p);
+            json_skip_space(p);
+            if (!key || p->cur >= p->end || *p->cur != ':')
+            {
+                xmlFree(key);
+                return -1;
+            }
+            p->cur++;
+        }
+
+        json_value_t *member = json_parse_value(p);
+        if (!member)
+        {
+            xmlFree(key);
+            return -1;
+        }
+        member->key = key;
+        *tail = member;
+        tail = &member->next;
+
+        json_skip_space(p);
+        if (p->cur < p->end && *p->cur == ',')
+        {
+            p->cur++;
+            json_skip_space(p);
+            continue;
+        }
+        if (p->cur < p->end && *p->cur == close)
+        {
+            p->cur++;
+            return 0;
+        }
+        break;
+    }
+    return -1;
+}
+
+// Function to parse one JSON value; numbers and literals keep their source text
+static json_value_t *json_parse_value(json_parser_t *p)
+{
+    json_skip_space(p);
+    if (p->cur >= p->end || p->depth >= JSON_MAX_DEPTH)
+        return NULL;
+
+    json_value_t *value = xmlMalloc(sizeof(json_value_t));
+    if (!value)
+        return NULL;
+    memset(value, 0, sizeof(json_value_t));
+
+    char c = *p->cur;
+    if (c == '{' || c == '[')
+    {
+        value->type = c == '{' ? JSON_OBJECT : JSON_ARRAY;
+        p->cur++;
+        p->depth++;
+        int result = json_parse_members(p, value, c == '{' ? '}' : ']');
+        p->depth--;
+        if (result < 0)
+        {
+            free_json(value);
+            return NULL;
+        }
+    }
+    else if (c == '"')
+    {
+        value->type = JSON_STRING;
+        value->string = json_parse_string(p);
+    }
+    else
+    {
+        const char *start = p->cur;
+        while (p->cur < p->end && (isalnum((unsigned char)*p->cur) || *p->cur == '-' || *p->cur == '+' || *p->cur == '.'))
+            p->cur++;
+        size_t length = (size_t)(p->cur - start);
+        if (length == 4 && memcmp(start, "null", 4) == 0)
+            value->type = JSON_NULL;
+        else if ((length == 4 && memcmp(start, "true", 4) == 0) || (length == 5 && memcmp(start, "false", 5) == 0))
+            value->type = JSON_BOOL;
+        else if (length > 0 && (c == '-' || isdigit((unsigned char)c)))
+            value->type = JSON_NUMBER;
+        else
+        {
+            xmlFree(value);
+            return NULL;
+        }
+        value->string = (char *)xmlStrndup((const xmlChar *)start, (int)length);
+    }
+
+    if (value->type != JSON_ARRAY && value->type != JSON_OBJECT && !value->string)
+    {
+        free_json(value);
+        return NULL;
+    }
+    return value;
+}
+
+// Function to parse a complete JSON text; NULL if it is malformed
+static json_value_t *parse_json(const char *text, size_t length)
+{
+    json_parser_t parser = {text, text + length, 0};
+    json_value_t *value = json_parse_value(&parser);
+    json_skip_space(&parser);
+    if (value && parser.cur != parser.end)
+    {
+        free_json(value);
+        return NULL;
+    }
+    return value;
+}
+
+// Function to find an object member by key
+static json_value_t *json_member(const json_value_t *object, const char *key)
+{
+    if (!object || object->type != JSON_OBJECT)
+        return NULL;
+    for (json_value_t *member = object->children; member; member = member->next)
+    {
+        if (strcmp(member->key, key) == 0)
+            return member;
+    }
+    return NULL;
+}
+
+// Function to reduce a JSON-LD value to text: a string itself, the given
+// member of an object, or the first usable entry of an array
+static const char *json_text(const json_value_t *value, const char *member)
+{
+    if (!value)
+        return NULL;
+    switch (value->type)
+    {
+    case JSON_STRING:
+        return value->string;
+    case JSON_OBJECT:
+        return member ? json_text(json_member(value, member), NULL) : NULL;
+    case JSON_ARRAY:
+        for (json_value_t *item = value->children; item; item = item->next)
+        {
+            const char *text = json_text(item, member);
+            if (text && *text)
+                return text;
+        }
+        return NULL;
+    default:
+        return NULL;
+    }
+}
+
+// Function to store a metadata value unless a better source already set it.
+// Surrounding whitespace is trimmed and empty values are ignored.
+static void metadata_set(article_metadata_t *metadata, metadata_field_t field, int priority, const char *value, size_t length)
+{
+    if (!value || (metadata->fields[field] && metadata->priority[field] <= priority))
+        return;
+
+    while (length > 0 && isspace((unsigned char)*value))
+    {
+        value++;
+        length--;
+    }
+    while (length > 0 && isspace((unsigned char)value[length - 1]))
+        length--;
+    if (length == 0 || length > INT_MAX)
+        return;
+
+    xmlChar *copy = xmlStrndup((const xmlChar *)value, (int)length);
+    if (!copy)
+        return;
+    xmlFree(metadata->fields[field]);
+    metadata->fields[field] = copy;
+    metadata->priority[field] = priority;
+}
+
+// Function to apply one <meta> element given its attributes
+static void metadata_consider_meta(article_metadata_t *metadata, const xmlChar *property, const xmlChar *name,
+                                   const xmlChar *http_equiv, const xmlChar *content)
+{
+    if (!content)
+        return;
+    size_t length = strlen((const char *)content);
+
+    if (http_equiv && xmlStrcasecmp(http_equiv, (const xmlChar *)"content-language") == 0)
+    {
+        metadata_set(metadata, META_LANGUAGE, META_PRIORITY_HTTP_EQUIV, (const char *)content, length);
+        return;
+    }
+
+    for (size_t i = 0; i < sizeof(meta_sources) / sizeof(meta_sources[0]); i++)
+    {
+        const xmlChar *key = (const xmlChar *)meta_sources[i].key;
+        if ((property && xmlStrcasecmp(property, key) == 0) || (name && xmlStrcasecmp(name, key) == 0))
+            metadata_set(metadata, meta_sources[i].field, meta_sources[i].priority, (const char *)content, length);
+    }
+}
+
+// Function to check whether a JSON-LD object's @type names an article
+static int jsonld_is_article(const json_value_t *object)
+{
+    const json_value_t *type = json_member(object, "@type");
+    const json_value_t *single = type && type->type == JSON_STRING ? type : NULL;
+    const json_value_t *item = type && type->type == JSON_ARRAY ? type->children : single;
+    for (; item; item = single ? NULL : item->next)
+    {
+        if (item->type != JSON_STRING)
+            continue;
+        for (size_t i = 0; i < sizeof(jsonld_article_types) / sizeof(jsonld_article_types[0]); i++)
+        {
+            if (strcmp(item->string, jsonld_article_types[i]) == 0)
+                return 1;
+        }
+    }
+    return 0;
+}
+
+// Function to find the article object of a JSON-LD document: the root
+// itself, or an entry of a top-level array or @graph
+static const json_value_t *jsonld_find_article(const json_value_t *root)
+{
+    if (!root)
+        return NULL;
+    if (root->type == JSON_OBJECT)
+    {
+        if (jsonld_is_article(root))
+            return root;
+        const json_value_t *graph = json_member(root, "@graph");
+        return graph && graph->type == JSON_ARRAY ? jsonld_find_article(graph) : NULL;
+    }
+    if (root->type == JSON_ARRAY)
+    {
+        for (const json_value_t *item = root->children; item; item = item->next)
+        {
+            const json_value_t *article = jsonld_find_article(item);
+            if (article)
+                return article;
+        }
+    }
+    return NULL;
+}
+
+// Function to set a metadata field from a JSON-LD value reduced to text
+static void metadata_set_json(article_metadata_t *metadata, metadata_field_t field, int priority,
+                              const json_value_t *value, const char *member)
+{
+    const char *text = json_text(value, member);
+    if (text)
+        metadata_set(metadata, field, priority, text, strlen(text));
+}
+
+// Function to apply the article described by a JSON-LD script block
+static void metadata_consider_jsonld(article_metadata_t *metadata, const char *text, size_t length)
+{
+    json_value_t *root = parse_json(text, length);
+    const json_value_t *article = jsonld_find_article(root);
+    if (article)
+    {
+        const json_value_t *headline = json_member(article, "headline");
+        metadata_set_json(metadata, META_TITLE, META_PRIORITY_JSONLD, headline ? headline : json_member(article, "name"), NULL);
+        metadata_set_json(metadata, META_DESCRIPTION, META_PRIORITY_JSONLD, json_member(article, "description"), NULL);
+        metadata_set_json(metadata, META_SITE_NAME, META_PRIORITY_JSONLD, json_member(article, "publisher"), "name");
+        metadata_set_json(metadata, META_PUBLISHED_TIME, META_PRIORITY_JSONLD_DATE, json_member(article, "datePublished"), NULL);
+        metadata_set_json(metadata, META_MODIFIED_TIME, META_PRIORITY_JSONLD_DATE, json_member(article, "dateModified"), NULL);
+        metadata_set_json(metadata, META_CANONICAL_URL, META_PRIORITY_JSONLD, json_member(article, "url"), NULL);
+        metadata_set_json(metadata, META_LANGUAGE, META_PRIORITY_JSONLD, json_member(article, "inLanguage"), NULL);
+        metadata_set_json(metadata, META_LEAD_IMAGE, META_PRIORITY_JSONLD, json_member(article, "image"), "url");
+
+        // Several authors are joined into one value
+        const json_value_t *author = json_member(article, "author");
+        if (author && author->type == JSON_ARRAY)
+        {
+            strbuf_t names = {0};
+            for (const json_value_t *item = author->children; item; item = item->next)
+            {
+                const char *name = json_text(item, "name");
+                if (!name || !*name)
+                    continue;
+                if (names.length > 0)
+                    strbuf_puts(&names, ", ");
+                strbuf_puts(&names, name);
+            }
+            metadata_set(metadata, META_AUTHOR, META_PRIORITY_JSONLD, names.data, names.length);
+            strbuf_free(&names);
+        }
+        else
+        {
+            metadata_set_json(metadata, META_AUTHOR, META_PRIORITY_JSONLD, author, "name");
+        }
+    }
+    free_json(root);
+}
+
+// Function to resolve a URL-valued metadata field against the base URL
+static void metadata_resolve_url(article_metadata_t *metadata, metadata_field_t field)
+{
+    if (!metadata->fields[field] || !metadata->base_url)
+        return;
+    xmlChar *absolute = xmlBuildURI(metadata->fields[field], metadata->base_url);
+    if (absolute)
+    {
+        xmlFree(metadata->fields[field]);
+        metadata->fields[field] = absolute;
+    }
+}
+
+// What an element holds for the metadata in its text, which is only known
+// once the element is complete
+#define META_CONTENT_TITLE 1
+#define META_CONTENT_JSONLD 2
+
+// Function to apply one element of the document walk to the metadata. The
+// walk tracks whether it is inside <body> and the first <base href>. Returns
+// the META_CONTENT_* kind when the element's text content is wanted too,
+// for metadata_take_content, or 0.
+static int metadata_visit(article_metadata_t *metadata, xmlNode *node, tag_t tag, int *in_body, xmlChar **base_href)
+{
+    switch (tag)
+    {
+    case TAG_HTML:
+    {
+        xmlChar *lang = xmlGetProp(node, (const xmlChar *)"lang");
+        if (lang)
+            metadata_set(metadata, META_LANGUAGE, META_PRIORITY_DOCUMENT, (const char *)lang, strlen((const char *)lang));
+        xmlFree(lang);
+        break;
+    }
+    case TAG_BODY:
+        *in_body = 1;
+        break;
+    case TAG_TITLE:
+        if (!*in_body)
+            return META_CONTENT_TITLE;
+        break;
+    case TAG_BASE:
+        if (!*in_body && !*base_href)
+            *base_href = xmlGetProp(node, (const xmlChar *)"href");
+        break;
+    case TAG_META:
+    {
+        xmlChar *content = xmlGetProp(node, (const xmlChar *)"content");
+        if (content)
+        {
+            xmlChar *property = xmlGetProp(node, (const xmlChar *)"property");
+            xmlChar *name = xmlGetProp(node, (const xmlChar *)"name");
+            xmlChar *http_equiv = xmlGetProp(node, (const xmlChar *)"http-equiv");
+            metadata_consider_meta(metadata, property, name, http_equiv, content);
+            xmlFree(property);
+            xmlFree(name);
+            xmlFree(http_equiv);
+            xmlFree(content);
+        }
+        break;
+    }
+    case TAG_LINK:
+    {
+        xmlChar *rel = xmlGetProp(node, (const xmlChar *)"rel");
+        if (rel && xmlStrcasecmp(rel, (const xmlChar *)"canonical") == 0)
+        {
+            xmlChar *href = xmlGetProp(node, (const xmlChar *)"href");
+            if (href)
+                metadata_set(metadata, META_CANONICAL_URL, META_PRIORITY_DOCUMENT, (const char *)href, strlen((const char *)href));
+            xmlFree(href);
+        }
+        xmlFree(rel);
+        break;
+    }
+    case TAG_SCRIPT:
+    {
+        xmlChar *type = xmlGetProp(node, (const xmlChar *)"type");
+        int wanted = type && xmlStrcasecmp(type, (const xmlChar *)"application/ld+json") == 0;
+        xmlFree(type);
+        if (wanted)
+            return META_CONTENT_JSONLD;
+        break;
+    }
+    default:
+        break;
+    }
+    return 0;
+}
+
+// Function to apply the text content of an element metadata_visit asked for
+static void metadata_take_content(article_metadata_t *metadata, int kind, const char *text, size_t length)
+{
+    if (kind == META_CONTENT_TITLE)
+        metadata_set(metadata, META_TITLE, META_PRIORITY_DOCUMENT, text, length);
+    else if (kind == META_CONTENT_JSONLD)
+        metadata_consider_jsonld(metadata, text, length);
+}
+
+// Function to work out the base URL of a document: its URL, overridden by
+// a <base href> in the head, which it takes over
+static xmlChar *document_base_url(xmlChar *base_href, const xmlChar *url)
+{
+    xmlChar *base_url = NULL;
+    if (base_href)
+    {
+        base_url = url ? xmlBuildURI(base_href, url) : NULL;
+        if (!base_url && xmlStrstr(base_href, (const xmlChar *)"://"))
+        {
+            base_url = base_href;
+            base_href = NULL;
+        }
+        xmlFree(base_href);
+    }
+    if (!base_url && url)
+        base_url = xmlStrdup(url);
+    return base_url;
+}
+
+// Function to gather the article metadata and base URL in one walk of the
+// document. It must run before remove_unwanted_tags, which deletes the
+// JSON-LD scripts.
+static void collect_metadata(xmlDocPtr doc, article_metadata_t *metadata)
+{
+    memset(metadata, 0, sizeof(*metadata));
+
+    xmlChar *base_href = NULL;
+    int in_body = 0;
+    xmlNode *root = xmlDocGetRootElement(doc);
+    for (xmlNode *node = root; node; node = next_element(node, root, 1))
+    {
+        int kind = metadata_visit(metadata, node, node_tag(node), &in_body, &base_href);
+        if (kind)
+        {
+            xmlChar *text = xmlNodeGetContent(node);
+            if (text)
+                metadata_take_content(metadata, kind, (const char *)text, strlen((const char *)text));
+            xmlFree(text);
+        }
+    }
+    metadata->base_url = document_base_url(base_href, doc->URL);
+    metadata_resolve_url(metadata, META_CANONICAL_URL);
+    metadata_resolve_url(metadata, META_LEAD_IMAGE);
+}
+
+// Function to release collected metadata
+static void free_metadata(article_metadata_t *metadata)
+{
+    for (int i = 0; i < META_FIELD_COUNT; i++)
+        xmlFree(metadata->fields[i]);
+    xmlFree(metadata->base_url);
+    memset(metadata, 0, sizeof(*metadata));
+}
+
+// Function to add a node reference to the article
+static int article_nodes_add(article_nodes_t *article, xmlNodePtr node)
+{
+    if (article->count == article->capacity)
+    {
+        int capacity = article->capacity ? article->capacity * 2 : 16;
+        xmlNodePtr *nodes = realloc(article->nodes, (size_t)capacity * sizeof(xmlNodePtr));
+        if (!nodes)
+            return -1;
+        article->nodes = nodes;
+        article->capacity = capacity;
+    }
+    article->nodes[article->count++] = node;
+    return 0;
+}
+
+// Function to release an article node list
+static void free_article_nodes(article_nodes_t *article)
+{
+    free(article->nodes);
+    memset(article, 0, sizeof(*article));
+}
+
+// Function to score one paragraph into its parent and grandparent, once it
+// holds enough text
+static void score_paragraph(candidate_table_t *candidates, xmlNode *elem)
+{
+    node_stats_t *stats = elem->_private;
+    if (!paragraph_scores(stats))
+        return;
+
+    xmlNode *parent_node = elem->parent;
+    xmlNode *grand_parent_node = parent_node ? parent_node->parent : NULL;
+    if (!parent_node || !grand_parent_node)
+        return;
+
+    int parent_index = candidate_table_get(candidates, parent_node);
+    int grand_parent_index = candidate_table_get(candidates, grand_parent_node);
+    if (parent_index < 0 || grand_parent_index < 0)
+        return;
+
+    add_paragraph_score(stats, node_tag(elem), &candidates->items[parent_index].content_score,
+                        &candidates->items[grand_parent_index].content_score);
+}
+
+// Function to weigh a candidate's score down by its link density and by its
+// class and id
+static void finalize_candidate(candidate_t *candidate, const pattern_matcher_t *matcher)
+{
+    candidate->content_score *= (1 - get_link_density(candidate->node));
+    candidate->content_score += get_class_weight(matcher, candidate->node);
+}
+
+// Function to annotate the subtree of body and score its candidates on the
+// calling thread. Once the time budget is spent only the paragraphs scored
+// so far count, or the first BUDGET_MIN_PARAGRAPHS.
+static int score_in_sequence(xmlNode *body, int in_body, const pattern_matcher_t *matcher, work_budget_t *budget,
+                             annotation_t *annotation, candidate_table_t *candidates)
+{
+    if (annotate_tree(body, in_body, annotation, budget) < 0)
+        return -1;
+    for (int i = 0; i < annotation->paragraph_count && (i < BUDGET_MIN_PARAGRAPHS || !budget_expired(budget)); i++)
+        score_paragraph(candidates, annotation->paragraphs[i]);
+    for (int i = 0; i < candidates->count; i++)
+        finalize_candidate(&candidates->items[i], matcher);
+    return 0;
+}
+
+// Parallel scoring: documents of at least PARALLEL_MIN_BYTES are split into
+// about PARALLEL_TASKS_PER_THREAD subtrees per thread, descending at most
+// PARALLEL_SPLIT_DEPTH levels below the root
+#define PARALLEL_MIN_BYTES (1024 * 1024)
+#define PARALLEL_MAX_THREADS 64
+#define PARALLEL_TASKS_PER_THREAD 8
+#define PARALLEL_SPLIT_DEPTH 16
+#define PARALLEL_MIN_CHUNK 256 // paragraphs or candidates per task, at least
+
+// Tasks of one parallel step: fn runs once for every index below count.
+// Threads claim the next index with an atomic add, so one that finishes its
+// task early takes on the next and none sits idle while tasks remain.
+typedef struct
+{
+    void (*fn)(void *job, int index);
+    void *job;
+    int count;
+    int next;
+} parallel_run_t;
+
+// A subtree annotated by one task: its paragraphs are those from first to
+// last of the annotation of its group
+typedef struct
+{
+    xmlNodePtr node;
+    int first;
+    int last;
+} score_subtree_t;
+
+// What the subtrees of a group, with the text that follows each of them,
+// add to the statistics of the spine element they hang from
+typedef struct
+{
+    xmlNodePtr parent;
+    node_stats_t stats;
+} score_partial_t;
+
+// Consecutive subtrees annotated by one task
+typedef struct
+{
+    annotation_t annotation;
+    score_partial_t *partials;
+    int partial_count;
+    int partial_capacity;
+} score_group_t;
+
+// State shared by the threads of one parallel scoring. Subtrees are
+// annotated in groups, paragraphs scored in chunks into a candidate table
+// each, and candidates finalized in chunks, each step writing only to what
+// its own task owns.
+typedef struct
+{
+    xmlNodePtr root;
+    int in_body;
+    const pattern_matcher_t *matcher;
+    score_subtree_t *subtrees;
+    int subtree_count;
+    score_group_t *groups;
+    int group_count;
+    const annotation_t *annotation;
+    candidate_table_t *tables;
+    int table_count;
+    candidate_table_t *candidates;
+    int chunk_count;
+    int failed;
+} parallel_scoring_t;
+
+// Scoring threads of a context, started as its documents first need them
+// and kept until the context is freed. Between steps they wait on wakeup;
+// a step is announced by bumping generation and opening seats for as many
+// threads as it wants, and the caller waits on done until every thread that
+// took a seat has left it.
+struct scoring_pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    pthread_cond_t done;
+    pthread_t threads[PARALLEL_MAX_THREADS - 1];
+    int thread_count;
+    parallel_run_t *run;      // the current step
+    unsigned long generation; // steps announced so far
+    int seats;                // threads the current step still takes
+    int busy;                 // threads working on it
+    int stopping;
+};
+
+// Function to work through the tasks of a parallel step
+static void parallel_work(parallel_run_t *run)
+{
+    int index;
+    while ((index = __atomic_fetch_add(&run->next, 1, __ATOMIC_RELAXED)) < run->count)
+        run->fn(run->job, index);
+}
+
+// Function to run the steps of a pool as they are announced, until it stops
+static void *scoring_pool_thread(void *arg)
+{
+    scoring_pool_t *pool = arg;
+    unsigned long seen = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (;;)
+    {
+        while (!pool->stopping && pool->generation == seen)
+            pthread_cond_wait(&pool->wakeup, &pool->lock);
+        if (pool->stopping)
+            break;
+        seen = pool->generation;
+        if (pool->seats == 0)
+            continue;
+
+        pool->seats--;
+        pool->busy++;
+        parallel_run_t *run = pool->run;
+        pthread_mutex_unlock(&pool->lock);
+        parallel_work(run);
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0)
+            pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Function to create a pool with no threads yet
+static scoring_pool_t *scoring_pool_new(void)
+{
+    scoring_pool_t *pool = calloc(1, sizeof(scoring_pool_t));
+    if (!pool)
+        return NULL;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wakeup, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    return pool;
+}
+
+// Function to stop and join the threads of a pool and free it
+static void scoring_pool_free(scoring_pool_t *pool)
+{
+    if (!pool)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->wakeup);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->thread_count; i++)
+        pthread_join(pool->threads[i], NULL);
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->wakeup);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+// Function to run fn for every index below count on up to threads threads,
+// the caller's and those of pool, returning once all are done. The pool
+// starts the threads it is short of; those that cannot be started leave
+// their share to the others. Threads other than the caller's allocate
+// outside the document's arena, which is not theirs.
+static void parallel_for(scoring_pool_t *pool, void (*fn)(void *, int), void *job, int count, int threads)
+{
+    parallel_run_t run = {fn, job, count, 0};
+    if (threads > count)
+        threads = count;
+    if (threads > PARALLEL_MAX_THREADS)
+        threads = PARALLEL_MAX_THREADS;
+    if (!pool || threads < 2)
+    {
+        parallel_work(&run);
+        return;
+    }
+
+    // thread_count belongs to the thread using the context, not to the pool's
+    while (pool->thread_count < threads - 1 &&
+           pthread_create(&pool->threads[pool->thread_count], NULL, scoring_pool_thread, pool) == 0)
+        pool->thread_count++;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->run = &run;
+    pool->seats = threads - 1 < pool->thread_count ? threads - 1 : pool->thread_count;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->wakeup);
+    pthread_mutex_unlock(&pool->lock);
+
+    parallel_work(&run);
+
+    // Every task is claimed by now; threads that have yet to wake up find
+    // no seat left and go back to waiting
+    pthread_mutex_lock(&pool->lock);
+    pool->seats = 0;
+    while (pool->busy > 0)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pool->run = NULL;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Function to get the scoring pool of a context for a document scored on
+// threads threads, creating it for the first such document. NULL means one
+// thread.
+static scoring_pool_t *context_pool(readability_context_t *ctx, int threads)
+{
+    if (threads > 1 && !ctx->pool)
+        ctx->pool = scoring_pool_new();
+    return threads > 1 ? ctx->pool : NULL;
+}
+
+// Function to tell whether node lies within <body>, looking no higher than
+// root, which does when in_body is set
+static int within_body(const xmlNode *node, const xmlNode *root, int in_body)
+{
+    while (node != root)
+    {
+        node = node->parent;
+        if (node_tag(node) == TAG_BODY)
+            return 1;
+    }
+    return in_body;
+}
+
+// Function to append node to a growing list of subtrees. Returns 0, or -1
+// with the list freed.
+static int append_subtree(score_subtree_t **list, int *count, int *capacity, xmlNode *node)
+{
+    if (*count == *capacity)
+    {
+        *capacity = *capacity ? *capacity * 2 : 16;
+        score_subtree_t *grown = realloc(*list, (size_t)*capacity * sizeof(score_subtree_t));
+        if (!grown)
+        {
+            free(*list);
+            *list = NULL;
+            return -1;
+        }
+        *list = grown;
+    }
+    (*list)[(*count)++] = (score_subtree_t){node, 0, 0};
+    return 0;
+}
+
+// Function to split the tree below root into subtrees, expanding every
+// subtree into its element children level by level until there are at
+// least target of them. The elements expanded form the spine above the
+// subtrees, which come out in document order. Returns their number, or -1.
+static int split_subtrees(xmlNode *root, int target, score_subtree_t **subtrees)
+{
+    int count = 0;
+    int capacity = 0;
+    score_subtree_t *list = NULL;
+    if (append_subtree(&list, &count, &capacity, root) < 0)
+        return -1;
+
+    // Each level is gathered in a single pass over the children, since on
+    // wide pages walking long sibling lists is what the split costs
+    for (int level = 0; level < PARALLEL_SPLIT_DEPTH && count < target; level++)
+    {
+        score_subtree_t *next = NULL;
+        int next_count = 0;
+        int next_capacity = 0;
+        int expanded = 0;
+        for (int i = 0; i < count; i++)
+        {
+            int before = next_count;
+            int status = 0;
+            for (xmlNode *child = list[i].node->children; child && status == 0; child = child->next)
+            {
+                if (child->type == XML_ELEMENT_NODE)
+                    status = append_subtree(&next, &next_count, &next_capacity, child);
+            }
+            if (status == 0 && next_count > before)
+                expanded = 1;
+            else if (status < 0 || append_subtree(&next, &next_count, &next_capacity, list[i].node) < 0)
+            {
+                free(list);
+                return -1;
+            }
+        }
+        free(list);
+        list = next;
+        count = next_count;
+        if (!expanded)
+            break;
+    }
+    *subtrees = list;
+    return count;
+}
+
+// Function to add the text that follows node, up to the next element, to
+// stats
+static void add_following_text(node_stats_t *stats, const xmlNode *node)
+{
+    for (const xmlNode *next = node->next; next && next->type != XML_ELEMENT_NODE; next = next->next)
+    {
+        if (next->type == XML_TEXT_NODE || next->type == XML_CDATA_SECTION_NODE)
+            add_text_stats(stats, next->content);
+    }
+}
+
+// Task: annotate one group of consecutive subtrees, and fold each into what
+// the group adds to its parent
+static void annotate_group(void *arg, int group_index)
+{
+    parallel_scoring_t *job = arg;
+    score_group_t *group = &job->groups[group_index];
+    annotation_t *annotation = &group->annotation;
+    work_budget_t budget = {LONG_MAX, INT_MAX, 0, 0, 0};
+    int first = (int)((long)job->subtree_count * group_index / job->group_count);
+    int last = (int)((long)job->subtree_count * (group_index + 1) / job->group_count);
+    for (int i = first; i < last; i++)
+    {
+        score_subtree_t *subtree = &job->subtrees[i];
+        xmlNode *node = subtree->node;
+        subtree->first = annotation->paragraph_count;
+        if (annotate_subtree(node, within_body(node, job->root, job->in_body), annotation, &budget) < 0)
+        {
+            __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        subtree->last = annotation->paragraph_count;
+        if (node == job->root)
+            continue;
+
+        score_partial_t *partial = group->partial_count ? &group->partials[group->partial_count - 1] : NULL;
+        if (!partial || partial->parent != node->parent)
+        {
+            if (group->partial_count == group->partial_capacity)
+            {
+                int capacity = group->partial_capacity ? group->partial_capacity * 2 : 16;
+                score_partial_t *partials = realloc(group->partials, (size_t)capacity * sizeof(score_partial_t));
+                if (!partials)
+                {
+                    __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+                    return;
+                }
+                group->partials = partials;
+                group->partial_capacity = capacity;
+            }
+            partial = &group->partials[group->partial_count++];
+            memset(partial, 0, sizeof(*partial));
+            partial->parent = node->parent;
+        }
+        fold_stats(&partial->stats, node);
+        add_following_text(&partial->stats, node);
+    }
+}
+
+// Function to add one node's statistics to another's
+static void add_stats(node_stats_t *stats, const node_stats_t *more)
+{
+    stats->text_length += more->text_length;
+    stats->comma_count += more->comma_count;
+    stats->has_period |= more->has_period;
+    stats->link_length += more->link_length;
+}
+
+// Function to gather the annotations of the groups into annotation, as if
+// the tree had been annotated in one walk: the paragraphs in document
+// order, the spine's own included, and the statistics of the spine made up
+// of its leading text, what the groups folded into it and its spine
+// children, folded innermost first
+static int merge_annotations(parallel_scoring_t *job, annotation_t *annotation)
+{
+    int paragraph_count = 0;
+    for (int g = 0; g < job->group_count; g++)
+    {
+        annotation_t *group = &job->groups[g].annotation;
+        node_stats_block_t *block = group->blocks;
+        while (block)
+        {
+            node_stats_block_t *next = block->next;
+            block->next = annotation->blocks;
+            annotation->blocks = block;
+            block = next;
+        }
+        group->blocks = NULL;
+        annotation->element_count += group->element_count;
+        paragraph_count += group->paragraph_count;
+    }
+    if (job->failed)
+        return -1;
+
+    // Room for every paragraph, spine elements included, so that adding
+    // them never reallocates
+    annotation->paragraph_capacity = paragraph_count + PARALLEL_SPLIT_DEPTH * job->subtree_count + 1;
+    annotation->paragraphs = xmlMalloc((size_t)annotation->paragraph_capacity * sizeof(xmlNodePtr));
+    xmlNodePtr *spine = malloc((size_t)(PARALLEL_SPLIT_DEPTH * job->subtree_count + 1) * sizeof(xmlNodePtr));
+    int spine_count = 0;
+    int status = annotation->paragraphs && spine ? 0 : -1;
+
+    // Spine elements are met from the outermost in, just before the first
+    // subtree below them, which is where a single walk would meet them
+    for (int i = 0, g = 0; i < job->subtree_count && status == 0; i++)
+    {
+        while ((long)job->subtree_count * (g + 1) / job->group_count <= i)
+            g++;
+        score_subtree_t *subtree = &job->subtrees[i];
+        xmlNode *path[PARALLEL_SPLIT_DEPTH + 1];
+        int depth = 0;
+        for (xmlNode *node = subtree->node; node != job->root && !node->parent->_private;)
+        {
+            node = node->parent;
+            path[depth++] = node;
+        }
+        while (depth-- > 0 && status == 0)
+        {
+            xmlNode *node = path[depth];
+            node_stats_t *stats = new_node_stats(annotation);
+            node->_private = stats;
+            spine[spine_count++] = node;
+            if (!stats)
+            {
+                status = -1;
+                break;
+            }
+            for (xmlNode *child = node->children; child && child->type != XML_ELEMENT_NODE; child = child->next)
+            {
+                if (child->type == XML_TEXT_NODE || child->type == XML_CDATA_SECTION_NODE)
+                    add_text_stats(stats, child->content);
+            }
+            if ((tag_table[node_tag(node)].flags & TAG_PARAGRAPH) && within_body(node, job->root, job->in_body))
+                annotation->paragraphs[annotation->paragraph_count++] = node;
+        }
+
+        const annotation_t *group = &job->groups[g].annotation;
+        int count = subtree->last - subtree->first;
+        if (count > 0)
+            memcpy(annotation->paragraphs + annotation->paragraph_count, group->paragraphs + subtree->first,
+                   (size_t)count * sizeof(xmlNodePtr));
+        annotation->paragraph_count += count;
+    }
+
+    for (int g = 0; g < job->group_count && status == 0; g++)
+    {
+        for (int i = 0; i < job->groups[g].partial_count; i++)
+        {
+            score_partial_t *partial = &job->groups[g].partials[i];
+            add_stats(partial->parent->_private, &partial->stats);
+        }
+    }
+
+    // Later spine elements are never ancestors of earlier ones
+    for (int i = spine_count - 1; i >= 0 && status == 0; i--)
+    {
+        xmlNode *node = spine[i];
+        if (node == job->root)
+            continue;
+        fold_stats(node->parent->_private, node);
+        add_following_text(node->parent->_private, node);
+    }
+    free(spine);
+    return status;
+}
+
+// Task: score one chunk of the paragraphs into its own candidate table
+static void score_chunk(void *arg, int chunk)
+{
+    parallel_scoring_t *job = arg;
+    int count = job->annotation->paragraph_count;
+    int first = (int)((long)count * chunk / job->table_count);
+    int last = (int)((long)count * (chunk + 1) / job->table_count);
+    for (int i = first; i < last; i++)
+        score_paragraph(&job->tables[chunk], job->annotation->paragraphs[i]);
+}
+
+// Task: finalize one chunk of the merged candidates
+static void finalize_chunk(void *arg, int chunk)
+{
+    parallel_scoring_t *job = arg;
+    int count = job->candidates->count;
+    int first = (int)((long)count * chunk / job->chunk_count);
+    int last = (int)((long)count * (chunk + 1) / job->chunk_count);
+    for (int i = first; i < last; i++)
+        finalize_candidate(&job->candidates->items[i], job->matcher);
+}
+
+// Function to count the tasks of a parallel step over count items
+static int parallel_chunks(int count, int threads)
+{
+    int chunks = (count + PARALLEL_MIN_CHUNK - 1) / PARALLEL_MIN_CHUNK;
+    if (chunks > threads * PARALLEL_TASKS_PER_THREAD)
+        chunks = threads * PARALLEL_TASKS_PER_THREAD;
+    return chunks > 0 ? chunks : 1;
+}
+
+// Function to annotate the subtree of body and score its candidates like
+// score_in_sequence without a budget, on up to threads threads. Scores are
+// sums of halves and whole numbers, which adding up in any order leaves
+// exact, and the chunk tables are merged in document order, so candidates
+// come out with the same scores in the same order as on one thread.
+static int score_in_parallel(xmlNode *body, int in_body, const pattern_matcher_t *matcher, scoring_pool_t *pool,
+                             int threads, annotation_t *annotation, candidate_table_t *candidates)
+{
+    memset(annotation, 0, sizeof(*annotation));
+    parallel_scoring_t job = {0};
+    job.root = body;
+    job.in_body = in_body;
+    job.matcher = matcher;
+    job.subtree_count = split_subtrees(body, threads * PARALLEL_TASKS_PER_THREAD, &job.subtrees);
+    if (job.subtree_count < 0)
+        return -1;
+
+    job.group_count = job.subtree_count < threads * PARALLEL_TASKS_PER_THREAD ? job.subtree_count
+                                                                              : threads * PARALLEL_TASKS_PER_THREAD;
+    job.groups = calloc((size_t)job.group_count, sizeof(score_group_t));
+    int status = job.groups ? 0 : -1;
+    if (status == 0)
+    {
+        parallel_for(pool, annotate_group, &job, job.group_count, threads);
+        status = merge_annotations(&job, annotation);
+        for (int g = 0; g < job.group_count; g++)
+        {
+            xmlFree(job.groups[g].annotation.paragraphs);
+            free(job.groups[g].partials);
+        }
+    }
+    free(job.groups);
+    free(job.subtrees);
+
+    job.annotation = annotation;
+    job.table_count = parallel_chunks(annotation->paragraph_count, threads);
+    job.tables = status == 0 ? calloc((size_t)job.table_count, sizeof(candidate_table_t)) : NULL;
+    if (!job.tables)
+        return -1;
+    parallel_for(pool, score_chunk, &job, job.table_count, threads);
+
+    // Each chunk started its candidates from the score of their tag, which
+    // the merged table adds only once
+    for (int t = 0; t < job.table_count; t++)
+    {
+        const candidate_table_t *table = &job.tables[t];
+        for (int i = 0; i < table->count; i++)
+        {
+            xmlNode *node = table->items[i].node;
+            int index = candidate_table_get(candidates, node);
+            if (index >= 0)
+                candidates->items[index].content_score +=
+                    table->items[i].content_score - tag_table[node_tag(node)].content_score;
+        }
+        free_candidate_table(&job.tables[t]);
+    }
+    free(job.tables);
+
+    job.candidates = candidates;
+    job.chunk_count = parallel_chunks(candidates->count, threads);
+    parallel_for(pool, finalize_chunk, &job, job.chunk_count, threads);
+    return 0;
+}
+
+// extract_article_content function: selects the top candidate and its
+// qualifying siblings into article, which is reset first, weighting class
+// and id attributes with matcher. Only the paragraphs below body are scored,
+// so it may be any subtree, with in_body set when it lies within <body>.
+// The nodes stay owned by the document, so it must outlive the list. With
+// a pool, more than one thread and no node or time limit, scoring is spread
+// over threads threads. trace, if given, gets the scoring and assembly times
+// and counts.
+static void extract_article_content(xmlNode *body, int in_body, article_nodes_t *article,
+                                    const pattern_matcher_t *matcher, work_budget_t *budget, scoring_pool_t *pool,
+                                    int threads, doc_trace_t *trace)
+{
+    article->count = 0;
+    article->top = NULL;
+    double started = trace ? now_seconds() : 0;
+
+    annotation_t annotation;
+    candidate_table_t candidates = {0};
+    int parallel = pool && threads > 1 && budget->max_nodes == LONG_MAX && budget->deadline == 0;
+    if ((parallel ? score_in_parallel(body, in_body, matcher, pool, threads, &annotation, &candidates)
+                  : score_in_sequence(body, in_body, matcher, budget, &annotation, &candidates)) < 0)
+    {
+        free_annotation(body, &annotation);
+        free_candidate_table(&candidates);
+        return;
+    }
+
+    int size = annotation.paragraph_count;
+    candidate_t *top_candidate = NULL;
+    for (int i = 0; i < candidates.count; i++)
+    {
+        candidate_t *candidate = &candidates.items[i];
+        if (!top_candidate || candidate->content_score > top_candidate->content_score)
+        {
+            top_candidate = candidate;
+        }
+    }
+
+    if (trace)
+    {
+        trace->nodes = annotation.element_count;
+        trace->paragraphs = size;
+        trace->candidates = candidates.count;
+        started = trace_stage(trace, METRIC_SCORING, started);
+    }
+
+    if (!top_candidate)
+    {
+        free_annotation(body, &annotation);
+        free_candidate_table(&candidates);
+        return;
+    }
+
+    article->top = top_candidate->node;
+    article->score = top_candidate->content_score;
+    xmlNode *sibling = top_candidate->node->parent->children;
+    while (sibling)
+    {
+        if (sibling->type == XML_ELEMENT_NODE)
+        {
+            int append = 0;
+            candidate_t *sibling_candidate = candidate_table_find(&candidates, sibling);
+
+            if (sibling == top_candidate->node)
+            {
+                append = 1;
+            }
+            else if (sibling_candidate && sibling_candidate->content_score >= top_candidate->content_score * 0.2)
+            {
+                append = 1;
+            }
+            else if (node_tag(sibling) == TAG_P && sibling->_private)
+            {
+                append = paragraph_joins_article(sibling->_private, get_link_density(sibling));
+            }
+
+            if (append && article_nodes_add(article, sibling) < 0)
+            {
+                article->count = 0;
+                break;
+            }
+        }
+        sibling = sibling->next;
+    }
+
+    free_annotation(body, &annotation);
+    free_candidate_table(&candidates);
+    if (trace)
+        trace_stage(trace, METRIC_ASSEMBLY, started);
+}
+
+// Function to append the text below root without any Markdown, walking the
+// subtree without recursion. Used for subtrees nested beyond the depth limit.
+static void append_subtree_text(xmlNode *root, strbuf_t *output)
+{
+    xmlNode *node = root->children;
+    while (node)
+    {
+        int descend = 0;
+        if (node->type == XML_TEXT_NODE && node->content)
+            append_clean_whitespace(output, node->content);
+        else if (node->type == XML_ELEMENT_NODE)
+            descend = !(tag_table[node_tag(node)].flags & TAG_UNWANTED);
+
+        if (descend && node->children)
+        {
+            node = node->children;
+            continue;
+        }
+        while (node != root && !node->next)
+            node = node->parent;
+        node = node == root ? NULL : node->next;
+    }
+}
+
+static void html_to_markdown(xmlNode *node, strbuf_t *output, const xmlChar *base, int depth, work_budget_t *budget);
+
+// Function to convert one HTML node to Markdown-like text. Relative links
+// are resolved against base when one is known. Subtrees deeper than the
+// budget allows are flattened to plain text, and once the time budget is
+// spent rendering stops at BUDGET_MIN_MARKDOWN bytes.
+static void node_to_markdown(xmlNode *node, strbuf_t *output, const xmlChar *base, int depth, work_budget_t *budget)
+{
+    if (node->type == XML_ELEMENT_NODE)
+    {
+        const tag_info_t *info = &tag_table[node_tag(node)];
+        if ((info->flags & TAG_UNWANTED) || (output->length >= BUDGET_MIN_MARKDOWN && budget_expired(budget)))
+            return;
+        if (depth > budget->max_depth)
+        {
+            budget->hit |= LIMIT_DEPTH;
+            append_subtree_text(node, output);
+            return;
+        }
+
+        switch (info->markdown)
+        {
+        case MD_LINK:
+        {
+            xmlChar *href = xmlGetProp(node, (const xmlChar *)"href");
+            if (href)
+            {
+                xmlChar *resolved = base ? xmlBuildURI(href, base) : NULL;
+                strbuf_puts(output, "[");
+                html_to_markdown(node->children, output, base, depth + 1, budget);
+                strbuf_puts(output, "](");
+                strbuf_puts(output, (const char *)(resolved ? resolved : href));
+                strbuf_puts(output, ")");
+                xmlFree(resolved);
+                xmlFree(href);
+                return;
+            }
+            break;
+        }
+        case MD_ITEM:
+            strbuf_puts(output, "\n");
+            strbuf_fill(output, ' ', (size_t)depth * 2);
+            strbuf_puts(output, "- ");
+            break;
+        default:
+            strbuf_puts(output, info->prefix);
+            break;
+        }
+
+        html_to_markdown(node->children, output, base, depth + 1, budget);
+        strbuf_puts(output, info->suffix);
+    }
+    else if (node->type == XML_TEXT_NODE)
+    {
+        if (node->content)
+        {
+            append_clean_whitespace(output, node->content);
+        }
+    }
+}
+
+// Function to convert a node and its following siblings to Markdown-like text
+static void html_to_markdown(xmlNode *node, strbuf_t *output, const xmlChar *base, int depth, work_budget_t *budget)
+{
+    for (xmlNode *current_node = node; current_node; current_node = current_node->next)
+        node_to_markdown(current_node, output, base, depth, budget);
+}
+
+// Function to render the selected article nodes straight from the document.
+// They are rendered one level deep, as children of the article container.
+static void render_article(const article_nodes_t *article, strbuf_t *output, const xmlChar *base,
+                           work_budget_t *budget)
+{
+    for (int i = 0; i < article->count; i++)
+        node_to_markdown(article->nodes[i], output, base, 1, budget);
+}
+
+// Output names of the metadata fields: JSON key and text-mode label
+static const struct
+{
+    const char *key;
+    const char *label;
+} metadata_names[META_FIELD_COUNT] = {
+    [META_TITLE] = {"title", "Title"},
+    [META_AUTHOR] = {"author", "Author"},
+    [META_DESCRIPTION] = {"description", "Description"},
+    [META_SITE_NAME] = {"siteName", "Site Name"},
+    [META_PUBLISHED_TIME] = {"publishedTime", "Published Time"},
+    [META_MODIFIED_TIME] = {"modifiedTime", "Modified Time"},
+    [META_CANONICAL_URL] = {"canonicalUrl", "Canonical URL"},
+    [META_LANGUAGE] = {"lang", "Language"},
+    [META_LEAD_IMAGE] = {"leadImage", "Lead Image"},
+};
+
+// Function to append one JSON member; pretty output puts it on its own line
+static void append_json_member(strbuf_t *output, const char *key, const char *value, int pretty)
+{
+    strbuf_puts(output, pretty ? ",\n  \"" : ",\"");
+    strbuf_puts(output, key);
+    strbuf_puts(output, pretty ? "\": " : "\":");
+    strbuf_append_json_string(output, value);
+}
+
+// Function to append one "Label: value" paragraph of the text header
+static void append_text_field(strbuf_t *output, const char *label, const char *value)
+{
+    if (!value)
+        return;
+    strbuf_puts(output, label);
+    strbuf_puts(output, ": ");
+    strbuf_puts(output, value);
+    strbuf_puts(output, "\n\n");
+}
+
+// Function to append the names of the limits a document hit, as a JSON
+// array or as a text header paragraph; nothing when it hit none
+static void append_limits_hit(strbuf_t *output, unsigned int limits, int json, int pretty)
+{
+    if (!limits)
+        return;
+    if (json)
+        strbuf_puts(output, pretty ? ",\n  \"limitsHit\": [" : ",\"limitsHit\":[");
+    else
+        strbuf_puts(output, "Limits Hit: ");
+
+    const char *separator = "";
+    for (size_t i = 0; i < sizeof(limit_names) / sizeof(limit_names[0]); i++)
+    {
+        if (!(limits & (1u << i)))
+            continue;
+        strbuf_puts(output, separator);
+        if (json)
+            strbuf_append_json_string(output, limit_names[i]);
+        else
+            strbuf_puts(output, limit_names[i]);
+        separator = json && !pretty ? "," : ", ";
+    }
+    strbuf_puts(output, json ? "]" : "\n\n");
+}
+
+// Function to return the value of an attribute without copying it, or NULL
+// when the element has no such attribute or it is not plain text
+static const xmlChar *node_attribute(const xmlNode *node, const char *name)
+{
+    for (const xmlAttr *attr = node->properties; attr; attr = attr->next)
+    {
+        if (xmlStrcmp(attr->name, (const xmlChar *)name) != 0)
+            continue;
+        const xmlNode *value = attr->children;
+        return value && value->type == XML_TEXT_NODE && !value->next ? value->content : NULL;
+    }
+    return NULL;
+}
+
+// Function to return the lower-cased host of a URL, to be released with
+// free, or NULL when it has none
+static char *url_host(const xmlChar *url)
+{
+    xmlURIPtr uri = url ? xmlParseURI((const char *)url) : NULL;
+    char *host = uri && uri->server && *uri->server ? strdup(uri->server) : NULL;
+    xmlFreeURI(uri);
+    for (char *c = host; c && *c; c++)
+        *c = (char)tolower((unsigned char)*c);
+    return host;
+}
+
+// Function to check an attribute value against a template field; an absent
+// value matches the empty field
+static int template_field_equals(const xmlChar *value, const char *field, size_t length)
+{
+    if (!value)
+        return length == 0;
+    return strlen((const char *)value) == length && memcmp(value, field, length) == 0;
+}
+
+// Function to check whether an element has the tag, class and id of a
+// template step, whose fields are tag, index, class and id
+static int template_step_matches(const xmlNode *node, const char *const *fields, const size_t *lengths)
+{
+    return node->type == XML_ELEMENT_NODE && template_field_equals(node->name, fields[0], lengths[0]) &&
+           template_field_equals(node_attribute(node, "class"), fields[2], lengths[2]) &&
+           template_field_equals(node_attribute(node, "id"), fields[3], lengths[3]);
+}
+
+// Function to append the template step of one element to path. Returns -1
+// when its tag, class or id holds a tab or a line break.
+static int template_append_step(strbuf_t *path, const xmlNode *node)
+{
+    const char *class = (const char *)node_attribute(node, "class");
+    const char *id = (const char *)node_attribute(node, "id");
+    const char *fields[4] = {(const char *)node->name, NULL, class ? class : "", id ? id : ""};
+    size_t lengths[4];
+    for (int i = 0; i < 4; i++)
+    {
+        if (fields[i] && strpbrk(fields[i], "\t\r\n"))
+            return -1;
+        lengths[i] = fields[i] ? strlen(fields[i]) : 0;
+    }
+
+    int index = 0;
+    for (const xmlNode *sibling = node->prev; sibling; sibling = sibling->prev)
+    {
+        if (template_step_matches(sibling, fields, lengths))
+            index++;
+    }
+
+    char number[16];
+    snprintf(number, sizeof(number), "%d", index);
+    if (path->length > 0)
+        strbuf_puts(path, "\t");
+    strbuf_puts(path, fields[0]);
+    strbuf_puts(path, "\t");
+    strbuf_puts(path, number);
+    strbuf_puts(path, "\t");
+    strbuf_puts(path, fields[2]);
+    strbuf_puts(path, "\t");
+    strbuf_puts(path, fields[3]);
+    return 0;
+}
+
+// Function to write the template path from root down to node into path,
+// replacing what it held. Returns -1 when node is root or lies outside it,
+// when a step cannot be stored, or when the path is too long to remember.
+static int template_build_path(xmlNode *root, xmlNode *node, strbuf_t *path)
+{
+    path->length = 0;
+    int depth = 0;
+    xmlNode *ancestor = node;
+    for (; ancestor && ancestor != root; ancestor = ancestor->parent)
+        depth++;
+    if (!ancestor || depth == 0)
+        return -1;
+
+    xmlNode **chain = malloc((size_t)depth * sizeof(xmlNode *));
+    if (!chain)
+        return -1;
+    for (int i = depth - 1; i >= 0; i--, node = node->parent)
+        chain[i] = node;
+
+    int status = 0;
+    for (int i = 0; i < depth && status == 0; i++)
+        status = template_append_step(path, chain[i]);
+    free(chain);
+    return status == 0 && path->data && path->length <= TEMPLATE_MAX_PATH ? 0 : -1;
+}
+
+// Function to follow a template path down from root. Returns the element it
+// leads to, or NULL when the page has no such element or it is unwanted.
+static xmlNode *template_follow(xmlNode *root, const char *path)
+{
+    xmlNode *node = root;
+    const char *cursor = path;
+    while (node && *cursor)
+    {
+        const char *fields[4];
+        size_t lengths[4];
+        for (int i = 0; i < 4; i++)
+        {
+            fields[i] = cursor;
+            lengths[i] = strcspn(cursor, "\t");
+            cursor += lengths[i];
+            if (*cursor)
+                cursor++;
+        }
+
+        long index = strtol(fields[1], NULL, 10);
+        xmlNode *child = node->children;
+        while (child && !(template_step_matches(child, fields, lengths) && index-- == 0))
+            child = child->next;
+        if (child && (tag_table[node_tag(child)].flags & TAG_UNWANTED))
+            child = NULL;
+        node = child;
+    }
+    return node == root ? NULL : node;
+}
+
+// Function to find the slot that holds, or would hold, the template of a
+// host. The caller holds the lock.
+static int *template_slot(template_store_t *store, const char *host)
+{
+    unsigned int mask = (unsigned int)store->slot_count - 1;
+    unsigned int slot = (unsigned int)hash_string(host) & mask;
+    while (store->slots[slot] && strcmp(store->items[store->slots[slot] - 1].host, host) != 0)
+        slot = (slot + 1) & mask;
+    return &store->slots[slot];
+}
+
+// Function to copy the template path of a host into path. Returns 0, or -1
+// when the store has none.
+static int template_lookup(template_store_t *store, const char *host, strbuf_t *path)
+{
+    path->length = 0;
+    pthread_mutex_lock(&store->lock);
+    int index = *template_slot(store, host) - 1;
+    if (index >= 0)
+    {
+        store->items[index].used = ++store->clock;
+        strbuf_puts(path, store->items[index].path);
+    }
+    pthread_mutex_unlock(&store->lock);
+    return index >= 0 && path->data ? 0 : -1;
+}
+
+// Function to make path the template of a host, replacing the least
+// recently used template when the store is full
+static void template_remember(template_store_t *store, const char *host, const char *path)
+{
+    pthread_mutex_lock(&store->lock);
+    int *slot = template_slot(store, host);
+    site_template_t *item = *slot ? &store->items[*slot - 1] : NULL;
+    char *copy = item && strcmp(item->path, path) == 0 ? NULL : strdup(path);
+    if (item && copy)
+    {
+        free(item->path);
+        item->path = copy;
+        store->dirty = 1;
+    }
+    else if (!item && copy)
+    {
+        char *host_copy = strdup(host);
+        if (host_copy && store->count < store->max_hosts)
+        {
+            item = &store->items[store->count++];
+            *slot = store->count;
+        }
+        else if (host_copy)
+        {
+            // Evict the least recently used template and index the rest
+            // again, since open addressing cannot delete in place
+            item = &store->items[0];
+            for (int i = 1; i < store->count; i++)
+            {
+                if (store->items[i].used < item->used)
+                    item = &store->items[i];
+            }
+            free(item->host);
+            free(item->path);
+            item->host = host_copy;
+            memset(store->slots, 0, (size_t)store->slot_count * sizeof(int));
+            for (int i = 0; i < store->count; i++)
+                *template_slot(store, store->items[i].host) = i + 1;
+        }
+        if (item)
+        {
+            item->host = host_copy;
+            item->path = copy;
+            store->dirty = 1;
+        }
+        else
+        {
+            free(copy);
+        }
+    }
+    if (item)
+        item->used = ++store->clock;
+    pthread_mutex_unlock(&store->lock);
+}
+
+// Function to extract the metadata of a document and render its article as
+// Markdown into ctx->content. Runs inside the document's arena, if it has
+// one; release the metadata with free_metadata.
+static void extract_article_parts(readability_context_t *ctx, xmlDocPtr doc, article_metadata_t *metadata)
+{
+    doc_trace_t *trace = &ctx->trace;
+    double started = now_seconds();
+    collect_metadata(doc, metadata);
+    ctx->content.length = 0;
+    started = trace_stage(trace, METRIC_ASSEMBLY, started);
+
+    xmlNode *body = xmlDocGetRootElement(doc);
+    if (!body)
+        return;
+
+    // The template of the site names the container of its articles: clean
+    // up and score only around it, and fall back to the whole document when
+    // the container is missing or no longer wins there
+    char *host = ctx->templates ? url_host(doc->URL) : NULL;
+    xmlNode *hint = host && template_lookup(ctx->templates, host, &ctx->template_path) == 0
+                        ? template_follow(body, ctx->template_path.data)
+                        : NULL;
+    if (hint)
+    {
+        remove_unwanted_tags(hint->parent, &ctx->budget);
+        trace_stage(trace, METRIC_CLEANUP, started);
+        extract_article_content(hint->parent, 1, &ctx->nodes, ctx->matcher, &ctx->budget, NULL, 1, trace);
+        started = now_seconds();
+    }
+    trace->template_hit = hint && ctx->nodes.top == hint && ctx->nodes.score >= TEMPLATE_MIN_SCORE;
+    trace->template_miss = host && !trace->template_hit;
+
+    if (!trace->template_hit)
+    {
+        remove_unwanted_tags(body, &ctx->budget);
+        trace_stage(trace, METRIC_CLEANUP, started);
+        int threads = trace->bytes_in >= PARALLEL_MIN_BYTES ? ctx->threads : 1;
+        extract_article_content(body, 0, &ctx->nodes, ctx->matcher, &ctx->budget, context_pool(ctx, threads), threads,
+                                trace);
+
+        // Only containers found without cutting corners are remembered
+        if (host && ctx->nodes.top && ctx->nodes.score >= TEMPLATE_MIN_SCORE && !ctx->budget.hit &&
+            template_build_path(body, ctx->nodes.top, &ctx->template_path) == 0)
+            template_remember(ctx->templates, host, ctx->template_path.data);
+    }
+    free(host);
+
+    started = now_seconds();
+    if (ctx->nodes.count > 0)
+        render_article(&ctx->nodes, &ctx->content, metadata->base_url, &ctx->budget);
+    else
+        trace->empty = 1;
+    trace_stage(trace, METRIC_RENDER, started);
+}
+
+// Function to render metadata fields and Markdown content as text or JSON,
+// appending to output
+static void format_article(const char *url, const char *const *fields, const char *content, size_t content_length,
+                           unsigned int limits, readability_format_t format, strbuf_t *output)
+{
+    if (format == READABILITY_JSON || format == READABILITY_NDJSON)
+    {
+        int pretty = format == READABILITY_JSON;
+        strbuf_puts(output, pretty ? "{\n  \"title\": " : "{\"title\":");
+        strbuf_append_json_string(output, fields[META_TITLE]);
+        append_json_member(output, "url", url, pretty);
+        for (int i = META_TITLE + 1; i < META_FIELD_COUNT; i++)
+            append_json_member(output, metadata_names[i].key, fields[i], pretty);
+        append_limits_hit(output, limits, 1, pretty);
+        strbuf_puts(output, pretty ? ",\n  \"content\": \"" : ",\"content\":\"");
+        strbuf_append_json(output, content, content_length);
+        strbuf_puts(output, pretty ? "\"\n}\n" : "\"}\n");
+    }
+    else
+    {
+        append_text_field(output, metadata_names[META_TITLE].label, fields[META_TITLE]);
+        append_text_field(output, metadata_names[META_AUTHOR].label, fields[META_AUTHOR]);
+        append_text_field(output, metadata_names[META_DESCRIPTION].label, fields[META_DESCRIPTION]);
+        append_text_field(output, metadata_names[META_SITE_NAME].label, fields[META_SITE_NAME]);
+        append_text_field(output, "URL Source", url);
+        for (int i = META_PUBLISHED_TIME; i < META_FIELD_COUNT; i++)
+            append_text_field(output, metadata_names[i].label, fields[i]);
+        append_limits_hit(output, limits, 0, 0);
+        strbuf_puts(output, "Markdown Content:\n");
+        strbuf_append(output, content, content_length);
+    }
+}
+
+// Every binary record is a CBOR map wrapped in tag 24 (encoded CBOR data
+// item) and a byte string with a four-byte length, so readers can step from
+// one record to the next without decoding them
+#define CBOR_RECORD_PREFIX 7
+#define CBOR_LINK_DEPTH 32
+
+// Function to start a binary record; its length is filled in by
+// finish_cbor_record
+static void start_cbor_record(strbuf_t *output)
+{
+    strbuf_append(output, "\xd8\x18\x5a\0\0\0\0", CBOR_RECORD_PREFIX);
+}
+
+// Function to set the length of the binary record that starts at offset
+// start of output and runs on for extra bytes beyond its end
+static void finish_cbor_record(strbuf_t *output, size_t start, size_t extra)
+{
+    if (output->length < start + CBOR_RECORD_PREFIX)
+        return;
+    uint32_t size = (uint32_t)(output->length - start - CBOR_RECORD_PREFIX + extra);
+    unsigned char *length = (unsigned char *)output->data + start + 3;
+    length[0] = (unsigned char)(size >> 24);
+    length[1] = (unsigned char)(size >> 16);
+    length[2] = (unsigned char)(size >> 8);
+    length[3] = (unsigned char)size;
+}
+
+// Function to append the links of Markdown content as a CBOR array of
+// [textOffset, textLength, hrefOffset, hrefLength] byte ranges of the
+// content. Brackets and parentheses are matched the way a Markdown parser
+// would, so link text may itself hold brackets and hrefs parentheses.
+static void append_cbor_links(strbuf_t *output, strbuf_t *scratch, const char *content, size_t length)
+{
+    size_t opens[CBOR_LINK_DEPTH];
+    size_t depth = 0;
+    uint64_t count = 0;
+    scratch->length = 0;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        if (content[i] == '[')
+        {
+            if (depth < CBOR_LINK_DEPTH)
+                opens[depth] = i;
+            depth++;
+            continue;
+        }
+        if (content[i] != ']' || depth == 0)
+            continue;
+        depth--;
+        if (depth >= CBOR_LINK_DEPTH || i + 1 >= length || content[i + 1] != '(')
+            continue;
+
+        size_t end = i + 2;
+        int parens = 0;
+        while (end < length && content[end] != '\n' && (content[end] != ')' || parens > 0))
+        {
+            if (content[end] == '(')
+                parens++;
+            else if (content[end] == ')')
+                parens--;
+            end++;
+        }
+        if (end >= length || content[end] != ')')
+            continue;
+
+        size_t text = opens[depth] + 1;
+        strbuf_append_cbor_head(scratch, CBOR_ARRAY, 4);
+        strbuf_append_cbor_head(scratch, CBOR_UNSIGNED, text);
+        strbuf_append_cbor_head(scratch, CBOR_UNSIGNED, i - text);
+        strbuf_append_cbor_head(scratch, CBOR_UNSIGNED, i + 2);
+        strbuf_append_cbor_head(scratch, CBOR_UNSIGNED, end - i - 2);
+        count++;
+        i = end;
+    }
+
+    strbuf_append_cbor_head(output, CBOR_ARRAY, count);
+    strbuf_append(output, scratch->data, scratch->length);
+}
+
+// Function to append the blocks of Markdown content, its non-blank lines
+// without surrounding spaces, as a CBOR array of [offset, length] byte
+// ranges of the content
+static void append_cbor_blocks(strbuf_t *output, strbuf_t *scratch, const char *content, size_t length)
+{
+    uint64_t count = 0;
+    scratch->length = 0;
+
+    size_t start = 0;
+    while (start < length)
+    {
+        const char *newline = memchr(content + start, '\n', length - start);
+        size_t end = newline ? (size_t)(newline - content) : length;
+        size_t first = start;
+        size_t last = end;
+        while (first < last && content[first] == ' ')
+            first++;
+        while (last > first && content[last - 1] == ' ')
+            last--;
+        if (last > first)
+        {
+            strbuf_append_cbor_head(scratch, CBOR_ARRAY, 2);
+            strbuf_append_cbor_head(scratch, CBOR_UNSIGNED, first);
+            strbuf_append_cbor_head(scratch, CBOR_UNSIGNED, last - first);
+            count++;
+        }
+        start = end + 1;
+    }
+
+    strbuf_append_cbor_head(output, CBOR_ARRAY, count);
+    strbuf_append(output, scratch->data, scratch->length);
+}
+
+// Function to render a document as a binary record in three parts: head,
+// which ends with the head of the content string, the Markdown content
+// itself, left where it is so it can be written without a copy, and tail,
+// which holds the link and block arrays. head is appended to; tail and
+// scratch are replaced.
+static void format_record(const char *url, const char *const *fields, const char *content, size_t content_length,
+                          unsigned int limits, strbuf_t *head, strbuf_t *tail, strbuf_t *scratch)
+{
+    size_t start = head->length;
+    start_cbor_record(head);
+    strbuf_append_cbor_head(head, CBOR_MAP, META_FIELD_COUNT + 4 + (limits ? 1 : 0));
+    strbuf_append_cbor_string(head, metadata_names[META_TITLE].key);
+    strbuf_append_cbor_string(head, fields[META_TITLE]);
+    strbuf_append_cbor_string(head, "url");
+    strbuf_append_cbor_string(head, url);
+    for (int i = META_TITLE + 1; i < META_FIELD_COUNT; i++)
+    {
+        strbuf_append_cbor_string(head, metadata_names[i].key);
+        strbuf_append_cbor_string(head, fields[i]);
+    }
+    strbuf_append_cbor_string(head, "content");
+    strbuf_append_cbor_head(head, CBOR_TEXT, content_length);
+
+    tail->length = 0;
+    strbuf_append_cbor_string(tail, "links");
+    append_cbor_links(tail, scratch, content, content_length);
+    strbuf_append_cbor_string(tail, "blocks");
+    append_cbor_blocks(tail, scratch, content, content_length);
+    if (limits)
+    {
+        strbuf_append_cbor_string(tail, "limitsHit");
+        strbuf_append_cbor_head(tail, CBOR_ARRAY, (uint64_t)__builtin_popcount(limits));
+        for (size_t i = 0; i < sizeof(limit_names) / sizeof(limit_names[0]); i++)
+        {
+            if (limits & (1u << i))
+                strbuf_append_cbor_string(tail, limit_names[i]);
+        }
+    }
+    finish_cbor_record(head, start, content_length + tail->length);
+}
+
+// Function to render a document into ctx->output in any format, replacing
+// what it held. Binary records keep their content in ctx->content, copied
+// there when it comes from elsewhere, and their tail in ctx->output_tail.
+static void format_output(readability_context_t *ctx, const char *url, const char *const *fields,
+                          const char *content, size_t content_length, unsigned int limits,
+                          readability_format_t format)
+{
+    ctx->output.length = 0;
+    ctx->output_split = 0;
+    if (format != READABILITY_CBOR)
+    {
+        format_article(url, fields, content, content_length, limits, format, &ctx->output);
+        return;
+    }
+
+    if (content != ctx->content.data)
+    {
+        ctx->content.length = 0;
+        strbuf_append(&ctx->content, content, content_length);
+    }
+    format_record(url, fields, ctx->content.data, ctx->content.length, limits, &ctx->output, &ctx->output_tail,
+                  &ctx->output_scratch);
+    ctx->output_split = 1;
+}
+
+// Function to return the size of the rendering of the current document
+static size_t output_length(const readability_context_t *ctx)
+{
+    return ctx->output.length + (ctx->output_split ? ctx->content.length + ctx->output_tail.length : 0);
+}
+
+// Function to render the verdict of the readerable check on a document into
+// ctx->output, replacing what it held
+static void format_verdict(readability_context_t *ctx, const char *url, int readerable, readability_format_t format)
+{
+    strbuf_t *output = &ctx->output;
+    output->length = 0;
+    ctx->output_split = 0;
+    if (format == READABILITY_CBOR)
+    {
+        start_cbor_record(output);
+        strbuf_append_cbor_head(output, CBOR_MAP, 2);
+        strbuf_append_cbor_string(output, "url");
+        strbuf_append_cbor_string(output, url);
+        strbuf_append_cbor_string(output, "readerable");
+        strbuf_append(output, readerable ? "\xf5" : "\xf4", 1);
+        finish_cbor_record(output, 0, 0);
+    }
+    else if (format == READABILITY_JSON || format == READABILITY_NDJSON)
+    {
+        int pretty = format == READABILITY_JSON;
+        strbuf_puts(output, pretty ? "{\n  \"url\": " : "{\"url\":");
+        strbuf_append_json_string(output, url);
+        strbuf_puts(output, pretty ? ",\n  \"readerable\": " : ",\"readerable\":");
+        strbuf_puts(output, readerable ? "true" : "false");
+        strbuf_puts(output, pretty ? "\n}\n" : "}\n");
+    }
+    else
+    {
+        append_text_field(output, "URL Source", url);
+        append_text_field(output, "Readerable", readerable ? "yes" : "no");
+    }
+}
+
+// Function to run the readerable check the context asks for on a document.
+// Returns 1 when the check is all it asks for, with the verdict rendered
+// into ctx->output, 0 to go on and extract the document, or -1 with
+// ctx->error set to skip it.
+static int check_document(readability_context_t *ctx, xmlDocPtr doc, const char *url, readability_format_t format)
+{
+    if (ctx->check == READABILITY_CHECK_NONE)
+        return 0;
+
+    double started = now_seconds();
+    int readerable = is_probably_readerable(xmlDocGetRootElement(doc), ctx->matcher);
+    started = trace_stage(&ctx->trace, METRIC_CHECK, started);
+    ctx->trace.readerable = readerable;
+    ctx->trace.not_readerable = !readerable;
+    if (ctx->check == READABILITY_CHECK_ONLY)
+    {
+        format_verdict(ctx, url, readerable, format);
+        trace_stage(&ctx->trace, METRIC_RENDER, started);
+        return 1;
+    }
+    if (!readerable)
+    {
+        set_failure(ctx, FAILURE_NOT_READERABLE, "not readerable");
+        return -1;
+    }
+    return 0;
+}
+
+// Function to extract metadata and article content and render them in the
+// requested format into ctx->output, replacing what it held, or only the
+// verdict of the readerable check when that is all the context asks for.
+// Returns 0, or -1 with ctx->error set when the check skips the document.
+static int render_document(readability_context_t *ctx, xmlDocPtr doc, const char *url, readability_format_t format)
+{
+    int checked = check_document(ctx, doc, url, format);
+    if (checked != 0)
+        return checked < 0 ? -1 : 0;
+
+    article_metadata_t metadata;
+    extract_article_parts(ctx, doc, &metadata);
+    double started = now_seconds();
+    format_output(ctx, url, (const char *const *)metadata.fields, ctx->content.data, ctx->content.length,
+                  ctx->budget.hit, format);
+    trace_stage(&ctx->trace, METRIC_RENDER, started);
+    free_metadata(&metadata);
+    return 0;
+}
+
+// Streaming engine: Markdown of the open elements kept in memory, in bytes.
+// Once the window fills its older half is dropped, and an article reaching
+// back into it comes out cut short with the "memory" limit hit.
+#define STREAM_WINDOW (8 * 1024 * 1024)
+#define STREAM_CHUNK (64 * 1024)
+
+// An open element of a streamed document, with what the tree engine would
+// have gathered about it by the time it closes
+typedef struct
+{
+    xmlNodePtr node;   // its node in the skeleton tree, while open
+    tag_t tag;
+    int skip;          // unwanted, or inside an unwanted element
+    int annotated;     // within the node budget, so its statistics count
+    int deepest;       // depth of its deepest element
+    node_stats_t stats;
+    int paragraph;     // index among the scored paragraphs, or -1
+    int scored;        // a paragraph made it a candidate
+    double score;
+    long order;        // where the tree engine's candidate table puts it
+    size_t start;      // stream offset of its rendering
+    xmlChar *href;     // resolved target of a link, written after its text
+    int records;       // first entry of stream->records among its children
+} stream_frame_t;
+
+// A closed element that may still be part of the article: a candidate that
+// can reach a fifth of the top score, or a <p> good enough on its own. The
+// records of siblings whose text has left the window are merged into one
+// that keeps the best score among them and renders nothing.
+typedef struct
+{
+    size_t start;
+    size_t end;
+    double score;
+    long order;
+    int scored;
+    int paragraph_ok;
+    int deepest;
+} stream_record_t;
+
+// Markdown that depends on an element's depth below the article container,
+// which is only known once the article is chosen: a list item bullet, whose
+// indentation is filled in, or markup that disappears when the element is
+// nested beyond the depth limit and rendered as plain text
+typedef struct
+{
+    size_t offset;
+    size_t length;
+    int depth;
+    int item;
+} stream_mark_t;
+
+// State of one streaming extraction, hung off the parser's _private field.
+// The parser still builds a tree, because its implied-tag and whitespace
+// rules look at it, but only a skeleton of the open elements and their last
+// children survives.
+typedef struct
+{
+    readability_context_t *ctx;
+    const xmlChar *url;
+    article_metadata_t metadata;
+    int in_body;
+    xmlChar *base_href;
+    xmlChar *base;         // base URL links resolve against
+    int content_kind;      // META_CONTENT_* of the element being captured
+    int content_depth;
+    strbuf_t content;
+    stream_frame_t *frames; // frames[0] stands for the document
+    int depth;
+    int frame_capacity;
+    stream_record_t *records;
+    int record_count;
+    int record_capacity;
+    stream_mark_t *marks;
+    int mark_count;
+    int mark_capacity;
+    strbuf_t link;         // scratch for the end of a link
+    strbuf_t text;         // rendered Markdown, from stream offset dropped on
+    size_t dropped;
+    int in_text;           // whether the last event was text
+    unsigned int space;    // whether that text ended in whitespace
+    int annotating;
+    long visited;
+    int body_depth;
+    long elements;
+    int paragraphs;
+    int candidates;
+    int have_max;
+    double max_score;      // best finished candidate so far
+    int have_top;
+    double top_score;      // candidate the current article is built around
+    long top_order;
+    unsigned int article_limits;
+    int failed;
+} stream_t;
+
+// Function to merge the records of each element's children whose text has
+// left the window, which lead their group, into one
+static void stream_merge_dropped(stream_t *stream)
+{
+    int write = 0;
+    for (int f = 0; f < stream->depth; f++)
+    {
+        int first = stream->frames[f].records;
+        int end = f + 1 < stream->depth ? stream->frames[f + 1].records : stream->record_count;
+        stream->frames[f].records = write;
+
+        int read = first;
+        if (read < end && stream->records[read].end <= stream->dropped)
+        {
+            stream_record_t merged = stream->records[read++];
+            while (read < end && stream->records[read].end <= stream->dropped)
+            {
+                const stream_record_t *record = &stream->records[read++];
+                if (record->scored && (!merged.scored || record->score > merged.score ||
+                                       (record->score == merged.score && record->order < merged.order)))
+                {
+                    merged.scored = 1;
+                    merged.score = record->score;
+                    merged.order = record->order;
+                }
+                merged.paragraph_ok |= record->paragraph_ok;
+                if (record->deepest > merged.deepest)
+                    merged.deepest = record->deepest;
+            }
+            merged.start = 0;
+            merged.end = 0;
+            stream->records[write++] = merged;
+        }
+        while (read < end)
+            stream->records[write++] = stream->records[read++];
+    }
+    stream->record_count = write;
+}
+
+// Function to drop the older half of the rendered Markdown once the window
+// is full
+static void stream_trim(stream_t *stream)
+{
+    if (stream->text.length <= STREAM_WINDOW)
+        return;
+
+    size_t cut = stream->text.length - STREAM_WINDOW / 2;
+    memmove(stream->text.data, stream->text.data + cut, stream->text.length - cut + 1);
+    stream->text.length -= cut;
+    stream->dropped += cut;
+
+    int gone = 0;
+    while (gone < stream->mark_count && stream->marks[gone].offset < stream->dropped)
+        gone++;
+    memmove(stream->marks, stream->marks + gone, (size_t)(stream->mark_count - gone) * sizeof(stream_mark_t));
+    stream->mark_count -= gone;
+    stream_merge_dropped(stream);
+}
+
+// Function to append rendered Markdown
+static void stream_append(stream_t *stream, const char *data, size_t length)
+{
+    strbuf_append(&stream->text, data, length);
+    stream_trim(stream);
+}
+
+// Function to append a NUL-terminated string of Markdown
+static void stream_puts(stream_t *stream, const char *str)
+{
+    if (str)
+        stream_append(stream, str, strlen(str));
+}
+
+// Function to return the stream offset of the next rendered byte
+static size_t stream_offset(const stream_t *stream)
+{
+    return stream->dropped + stream->text.length;
+}
+
+// Function to count a span of text into statistics
+static void add_text_span_stats(node_stats_t *stats, const xmlChar *text, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        if (text[i] == ',')
+            stats->comma_count++;
+        else if (text[i] == '.')
+            stats->has_period = 1;
+    }
+    stats->text_length += (int)length;
+}
+
+// Function to make an open element a candidate, scored from its tag, on
+// first use. order is the position the tree engine's candidate table would
+// give it, which breaks ties between equal scores.
+static void stream_add_candidate(stream_t *stream, stream_frame_t *frame, long order)
+{
+    if (!frame->scored)
+    {
+        frame->scored = 1;
+        frame->score = tag_table[frame->tag].content_score;
+        frame->order = order;
+        stream->candidates++;
+    }
+    else if (order < frame->order)
+    {
+        frame->order = order;
+    }
+}
+
+// Function to score a finished paragraph into its parent and grandparent,
+// with the rules of extract_article_content
+static void stream_score_paragraph(stream_t *stream, int index)
+{
+    stream_frame_t *frame = &stream->frames[index];
+    if (!paragraph_scores(&frame->stats) || index < 3)
+        return;
+    if (frame->paragraph >= BUDGET_MIN_PARAGRAPHS && budget_expired(&stream->ctx->budget))
+        return;
+
+    long order = (long)frame->paragraph * 2;
+    stream_add_candidate(stream, &stream->frames[index - 1], order);
+    stream_add_candidate(stream, &stream->frames[index - 2], order + 1);
+    add_paragraph_score(&frame->stats, frame->tag, &stream->frames[index - 1].score,
+                        &stream->frames[index - 2].score);
+}
+
+// Function to append the rendering of a record to the article, as
+// node_to_markdown renders it at depth 1 below the container at
+// container_depth: list items are indented and markup nested beyond the
+// depth limit is left out
+static void stream_copy_record(stream_t *stream, const stream_record_t *record, int container_depth)
+{
+    strbuf_t *output = &stream->ctx->content;
+    int max_depth = stream->ctx->budget.max_depth;
+    size_t start = record->start;
+    if (start < stream->dropped)
+    {
+        stream->article_limits |= LIMIT_MEMORY;
+        start = stream->dropped;
+    }
+    if (record->end <= start)
+        return;
+    if (record->deepest - container_depth > max_depth)
+        stream->article_limits |= LIMIT_DEPTH;
+
+    int low = 0, high = stream->mark_count;
+    while (low < high)
+    {
+        int middle = (low + high) / 2;
+        if (stream->marks[middle].offset < start)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    const char *text = stream->text.data;
+    for (int i = low; i < stream->mark_count && stream->marks[i].offset < record->end; i++)
+    {
+        const stream_mark_t *mark = &stream->marks[i];
+        strbuf_append(output, text + (start - stream->dropped), mark->offset - start);
+        int depth = mark->depth - container_depth;
+        if (depth <= max_depth && mark->item)
+        {
+            strbuf_puts(output, "\n");
+            strbuf_fill(output, ' ', (size_t)depth * 2);
+            strbuf_puts(output, "- ");
+        }
+        else if (depth <= max_depth)
+        {
+            strbuf_append(output, text + (mark->offset - stream->dropped), mark->length);
+        }
+        start = mark->offset + mark->length;
+    }
+    strbuf_append(output, text + (start - stream->dropped), record->end - start);
+}
+
+// Function to settle the children of a closing element: when the best
+// candidate among them beats the article so far, the article is rebuilt
+// from them in order, as extract_article_content picks the siblings of the
+// top candidate. Their records are then let go.
+static void stream_close_children(stream_t *stream, int index)
+{
+    if (stream->record_count == stream->frames[index].records)
+        return;
+    stream_record_t *first = &stream->records[stream->frames[index].records];
+    stream_record_t *end = &stream->records[stream->record_count];
+    const stream_record_t *top = NULL;
+    for (const stream_record_t *record = first; record < end; record++)
+    {
+        if (record->scored && (!top || record->score > top->score ||
+                               (record->score == top->score && record->order < top->order)))
+            top = record;
+    }
+
+    if (top && (!stream->have_top || top->score > stream->top_score ||
+                (top->score == stream->top_score && top->order < stream->top_order)))
+    {
+        stream->have_top = 1;
+        stream->top_score = top->score;
+        stream->top_order = top->order;
+        stream->article_limits = 0;
+        stream->ctx->content.length = 0;
+        for (const stream_record_t *record = first; record < end; record++)
+        {
+            if (record == top || (record->scored && record->score >= top->score * 0.2) || record->paragraph_ok)
+                stream_copy_record(stream, record, index);
+        }
+    }
+    stream->record_count = stream->frames[index].records;
+}
+
+// Function to keep a record of a closed element for its parent's children
+static void stream_keep(stream_t *stream, const stream_record_t *record)
+{
+    if (stream->record_count == stream->record_capacity)
+    {
+        int capacity = stream->record_capacity ? stream->record_capacity * 2 : 64;
+        stream_record_t *records = realloc(stream->records, (size_t)capacity * sizeof(stream_record_t));
+        if (!records)
+        {
+            stream->failed = 1;
+            return;
+        }
+        stream->records = records;
+        stream->record_capacity = capacity;
+    }
+    stream->records[stream->record_count++] = *record;
+}
+
+// Function to append markup of the element at depth. Only list item
+// bullets and markup deep enough to be flattened are marked; the rest is
+// rendered the same whatever the article container.
+static void stream_markup(stream_t *stream, const char *markup, int depth, int item)
+{
+    if (!markup)
+        return;
+    if (item || depth > stream->ctx->budget.max_depth)
+    {
+        if (stream->mark_count == stream->mark_capacity)
+        {
+            int capacity = stream->mark_capacity ? stream->mark_capacity * 2 : 64;
+            stream_mark_t *marks = realloc(stream->marks, (size_t)capacity * sizeof(stream_mark_t));
+            if (!marks)
+            {
+                stream->failed = 1;
+                return;
+            }
+            stream->marks = marks;
+            stream->mark_capacity = capacity;
+        }
+        stream->marks[stream->mark_count++] = (stream_mark_t){stream_offset(stream), strlen(markup), depth, item};
+    }
+    stream_puts(stream, markup);
+}
+
+// Function to open an element: its metadata, its annotation within the node
+// budget and the start of its Markdown, as node_to_markdown renders it
+static void stream_open(stream_t *stream, xmlNodePtr node, const xmlChar *name)
+{
+    stream->in_text = 0;
+    if (stream->failed)
+        return;
+    if (stream->depth == stream->frame_capacity)
+    {
+        int capacity = stream->frame_capacity * 2;
+        stream_frame_t *frames = realloc(stream->frames, (size_t)capacity * sizeof(stream_frame_t));
+        if (!frames)
+        {
+            stream->failed = 1;
+            return;
+        }
+        stream->frames = frames;
+        stream->frame_capacity = capacity;
+    }
+
+    int index = stream->depth++;
+    stream_frame_t *parent = &stream->frames[index - 1];
+    stream_frame_t *frame = &stream->frames[index];
+    memset(frame, 0, sizeof(*frame));
+    frame->node = node;
+    frame->tag = tag_lookup(name);
+    frame->paragraph = -1;
+    frame->records = stream->record_count;
+    stream->elements++;
+
+    // Metadata comes from every element, unwanted ones included
+    if (node)
+    {
+        xmlChar *base_href = stream->base_href;
+        int kind = metadata_visit(&stream->metadata, node, frame->tag, &stream->in_body, &stream->base_href);
+        if (stream->base_href != base_href)
+        {
+            xmlFree(stream->base);
+            stream->base = document_base_url(xmlStrdup(stream->base_href), stream->url);
+        }
+        if (kind)
+        {
+            stream->content_kind = kind;
+            stream->content_depth = index;
+            stream->content.length = 0;
+        }
+    }
+
+    const tag_info_t *info = &tag_table[frame->tag];
+    frame->skip = parent->skip || (info->flags & TAG_UNWANTED);
+    if (frame->skip)
+        return;
+
+    work_budget_t *budget = &stream->ctx->budget;
+    if (stream->annotating && (stream->visited == 0 || budget_allows(budget, stream->visited)))
+    {
+        frame->annotated = 1;
+        stream->visited++;
+        if (frame->tag == TAG_BODY)
+            stream->body_depth++;
+        else if (stream->body_depth > 0 && (info->flags & TAG_PARAGRAPH))
+            frame->paragraph = stream->paragraphs++;
+    }
+    else
+    {
+        stream->annotating = 0;
+    }
+
+    frame->start = stream_offset(stream);
+    frame->deepest = index;
+    switch (info->markdown)
+    {
+    case MD_LINK:
+    {
+        xmlChar *href = node ? xmlGetProp(node, (const xmlChar *)"href") : NULL;
+        if (href)
+        {
+            xmlChar *resolved = stream->base ? xmlBuildURI(href, stream->base) : NULL;
+            if (resolved)
+            {
+                xmlFree(href);
+                href = resolved;
+            }
+            frame->href = href;
+            stream_markup(stream, "[", index, 0);
+        }
+        break;
+    }
+    case MD_ITEM:
+        stream_markup(stream, "\n- ", index, 1);
+        break;
+    default:
+        stream_markup(stream, info->prefix, index, 0);
+        break;
+    }
+}
+
+// Function to close the innermost open element: the end of its Markdown,
+// its statistics folded into its parent, its paragraph and candidate
+// scores, and the article choice among its children
+static void stream_close(stream_t *stream)
+{
+    if (stream->failed || stream->depth <= 1)
+        return;
+    stream->in_text = 0;
+    int index = stream->depth - 1;
+    stream_frame_t *frame = &stream->frames[index];
+    stream_frame_t *parent = &stream->frames[index - 1];
+
+    if (stream->content_kind && stream->content_depth == index)
+    {
+        metadata_take_content(&stream->metadata, stream->content_kind, stream->content.data ? stream->content.data : "",
+                              stream->content.length);
+        stream->content_kind = 0;
+    }
+    if (frame->skip)
+    {
+        stream->depth--;
+        return;
+    }
+
+    const tag_info_t *info = &tag_table[frame->tag];
+    if (frame->href)
+    {
+        // One piece of markup, so that the target goes with the brackets
+        stream->link.length = 0;
+        strbuf_puts(&stream->link, "](");
+        strbuf_puts(&stream->link, (const char *)frame->href);
+        strbuf_puts(&stream->link, ")");
+        stream_markup(stream, stream->link.data, index, 0);
+        xmlFree(frame->href);
+        frame->href = NULL;
+    }
+    else
+    {
+        stream_markup(stream, info->suffix, index, 0);
+    }
+    if (frame->deepest > parent->deepest)
+        parent->deepest = frame->deepest;
+
+    stream_record_t record = {frame->start, stream_offset(stream), 0, 0, 0, 0, frame->deepest};
+    if (frame->annotated)
+    {
+        node_stats_t *stats = &frame->stats;
+        parent->stats.text_length += stats->text_length;
+        parent->stats.comma_count += stats->comma_count;
+        parent->stats.has_period |= stats->has_period;
+        parent->stats.link_length += stats->link_length;
+        if (frame->tag == TAG_A)
+            parent->stats.link_length += stats->text_length;
+
+        if (frame->tag == TAG_BODY)
+            stream->body_depth--;
+        if (frame->paragraph >= 0)
+            stream_score_paragraph(stream, index);
+
+        double link_density = stats_link_density(stats);
+        if (frame->tag == TAG_P)
+            record.paragraph_ok = paragraph_joins_article(stats, link_density);
+        if (frame->scored)
+        {
+            frame->score *= 1 - link_density;
+            frame->score += frame->node ? get_class_weight(stream->ctx->matcher, frame->node) : 0;
+            if (!stream->have_max || frame->score > stream->max_score)
+                stream->max_score = frame->score;
+            stream->have_max = 1;
+            record.scored = 1;
+            record.score = frame->score;
+            record.order = frame->order;
+        }
+    }
+
+    stream_close_children(stream, index);
+    stream->depth--;
+
+    // A candidate below a fifth of the best score so far can be neither the
+    // top candidate nor one of its siblings
+    if (record.paragraph_ok ||
+        (record.scored && (record.score >= stream->max_score * 0.2 || record.score >= stream->max_score)))
+        stream_keep(stream, &record);
+}
+
+// Function to add text to the innermost open element; whitespace runs are
+// collapsed across the pieces the parser delivers one text node in
+static void stream_text(stream_t *stream, const xmlChar *text, int length)
+{
+    if (stream->failed || length <= 0)
+        return;
+    if (stream->content_kind)
+        strbuf_append(&stream->content, (const char *)text, (size_t)length);
+
+    stream_frame_t *frame = &stream->frames[stream->depth - 1];
+    if (frame->skip)
+        return;
+    if (frame->annotated)
+        add_text_span_stats(&frame->stats, text, (size_t)length);
+
+    if (!stream->in_text)
+    {
+        stream->in_text = 1;
+        stream->space = 0;
+    }
+    size_t size = (size_t)length;
+    if (stream->space)
+    {
+        while (size > 0 && html_space_table[*text])
+        {
+            text++;
+            size--;
+        }
+        if (size == 0)
+            return;
+    }
+    if (strbuf_reserve(&stream->text, size) < 0)
+    {
+        stream->failed = 1;
+        return;
+    }
+    strbuf_t *buf = &stream->text;
+    buf->length += text_kernels->collapse_whitespace(buf->data + buf->length, text, size);
+    buf->data[buf->length] = '\0';
+    stream->space = html_space_table[text[size - 1]];
+    stream_trim(stream);
+}
+
+// SAX handler for start tags: the skeleton node, then the element
+static void stream_start_element(void *userdata, const xmlChar *name, const xmlChar **attributes)
+{
+    htmlParserCtxtPtr parser = userdata;
+    xmlNodePtr parent = parser->node;
+    xmlSAX2StartElement(parser, name, attributes);
+    stream_open(parser->_private, parser->node != parent ? parser->node : NULL, name);
+}
+
+// SAX handler for end tags. The closed element's subtree and its earlier
+// siblings are freed: the parser only ever looks at the open elements and
+// their last children.
+static void stream_end_element(void *userdata, const xmlChar *name)
+{
+    htmlParserCtxtPtr parser = userdata;
+    xmlNodePtr node = parser->node;
+    stream_close(parser->_private);
+    xmlSAX2EndElement(parser, name);
+    if (!node || node == parser->node)
+        return;
+
+    xmlFreeNodeList(node->children);
+    node->children = NULL;
+    node->last = NULL;
+    if (node->parent && node->parent->type == XML_ELEMENT_NODE)
+    {
+        while (node->prev)
+        {
+            xmlNodePtr previous = node->prev;
+            xmlUnlinkNode(previous);
+            xmlFreeNode(previous);
+        }
+    }
+}
+
+// SAX handler for text. The skeleton only needs to know that an element's
+// last child is text, so one byte of each text node is kept.
+static void stream_characters(void *userdata, const xmlChar *text, int length)
+{
+    htmlParserCtxtPtr parser = userdata;
+    xmlNodePtr node = parser->node;
+    if (node && length > 0 && !(node->last && node->last->type == XML_TEXT_NODE))
+        xmlSAX2Characters(parser, text, 1);
+    stream_text(parser->_private, text, length);
+}
+
+// SAX handler for the raw text of scripts and styles, which are unwanted
+// but may carry JSON-LD metadata
+static void stream_cdata(void *userdata, const xmlChar *text, int length)
+{
+    htmlParserCtxtPtr parser = userdata;
+    stream_t *stream = parser->_private;
+    stream_text(stream, text, length);
+    stream->in_text = 0;
+}
+
+// SAX handler for comments, which end a text node without adding to the
+// skeleton: the parser skips comments when it looks back
+static void stream_comment(void *userdata, const xmlChar *value)
+{
+    (void)value;
+    htmlParserCtxtPtr parser = userdata;
+    stream_t *stream = parser->_private;
+    stream->in_text = 0;
+}
+
+// SAX handler for processing instructions, which also end a text node
+static void stream_processing_instruction(void *userdata, const xmlChar *target, const xmlChar *data)
+{
+    htmlParserCtxtPtr parser = userdata;
+    stream_t *stream = parser->_private;
+    xmlSAX2ProcessingInstruction(parser, target, data);
+    stream->in_text = 0;
+}
+
+// Function to release the state of a streaming extraction
+static void free_stream(stream_t *stream)
+{
+    for (int i = 1; i < stream->depth; i++)
+        xmlFree(stream->frames[i].href);
+    free(stream->frames);
+    free(stream->records);
+    free(stream->marks);
+    strbuf_free(&stream->text);
+    strbuf_free(&stream->link);
+    strbuf_free(&stream->content);
+    xmlFree(stream->base_href);
+    xmlFree(stream->base);
+    free_metadata(&stream->metadata);
+}
+
+// Function to extract a document in one streaming pass and render it like
+// render_document. The document is read from fd, or from html when fd is
+// negative, a chunk at a time; base_url resolves links and source is what
+// the document is reported as. Returns 0, or -1 with ctx->error set.
+static int stream_document(readability_context_t *ctx, int fd, const char *html, size_t size, const char *base_url,
+                           const char *source, readability_format_t format)
+{
+    budget_start(ctx);
+    double started = now_seconds();
+
+    stream_t stream;
+    memset(&stream, 0, sizeof(stream));
+    stream.ctx = ctx;
+    stream.url = (const xmlChar *)base_url;
+    stream.annotating = 1;
+    stream.frame_capacity = 64;
+    stream.frames = calloc((size_t)stream.frame_capacity, sizeof(stream_frame_t));
+    stream.depth = 1;
+    char *chunk = fd >= 0 ? malloc(STREAM_CHUNK) : NULL;
+    if (!stream.frames || (fd >= 0 && !chunk))
+    {
+        free(stream.frames);
+        free(chunk);
+        set_failure(ctx, FAILURE_OTHER, "out of memory");
+        return -1;
+    }
+    stream.frames[0].paragraph = -1;
+    ctx->content.length = 0;
+
+    htmlSAXHandler sax = {0};
+    xmlSAX2InitHtmlDefaultSAXHandler(&sax);
+    sax.startElement = stream_start_element;
+    sax.endElement = stream_end_element;
+    sax.characters = stream_characters;
+    sax.cdataBlock = stream_cdata;
+    sax.comment = stream_comment;
+    sax.processingInstruction = stream_processing_instruction;
+
+    // Parse everything on the heap: arena memory is only reclaimed with the
+    // whole arena, and the skeleton is freed as the parse goes
+    arena_t *previous = arena_enter(NULL);
+    stream.base = base_url ? xmlStrdup(stream.url) : NULL;
+    htmlParserCtxtPtr parser = NULL;
+    size_t limit = ctx->limits.max_input_bytes > 0 ? ctx->limits.max_input_bytes : SIZE_MAX;
+    size_t consumed = 0;
+    int status = 0;
+    while (!stream.failed)
+    {
+        const char *data = chunk;
+        size_t length;
+        if (fd < 0)
+        {
+            data = html + consumed;
+            length = size - consumed < STREAM_CHUNK ? size - consumed : STREAM_CHUNK;
+        }
+        else
+        {
+            ssize_t n = read(fd, chunk, STREAM_CHUNK);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+            {
+                set_failure(ctx, FAILURE_READ, "unable to read file");
+                status = -1;
+                break;
+            }
+            length = (size_t)n;
+        }
+        if (length == 0)
+            break;
+        ctx->trace.bytes_in += length;
+
+        int last = 0;
+        if (length > limit - consumed)
+        {
+            ctx->budget.hit |= LIMIT_INPUT;
+            length = limit - consumed;
+            last = 1;
+        }
+        consumed += length;
+        if (!parser && length > 0)
+        {
+            parser = new_push_parser(&sax, data, length, base_url);
+            if (!parser)
+            {
+                set_failure(ctx, FAILURE_PARSE, "unable to create parser");
+                status = -1;
+                break;
+            }
+            parser->_private = &stream;
+        }
+        else if (length > 0)
+        {
+            htmlParseChunk(parser, data, (int)length, 0);
+        }
+        if (last)
+            break;
+    }
+    if (parser && status == 0)
+        htmlParseChunk(parser, NULL, 0, 1);
+    started = trace_stage(&ctx->trace, METRIC_PARSE, started);
+
+    if (status == 0 && stream.failed)
+    {
+        set_failure(ctx, FAILURE_OTHER, "out of memory");
+        status = -1;
+    }
+    else if (status == 0 && stream.elements == 0)
+    {
+        set_failure(ctx, FAILURE_PARSE, "unable to parse HTML");
+        status = -1;
+    }
+    if (status == 0)
+    {
+        while (stream.depth > 1)
+            stream_close(&stream);
+        stream_close_children(&stream, 0);
+        stream.metadata.base_url = stream.base;
+        stream.base = NULL;
+        metadata_resolve_url(&stream.metadata, META_CANONICAL_URL);
+        metadata_resolve_url(&stream.metadata, META_LEAD_IMAGE);
+
+        doc_trace_t *trace = &ctx->trace;
+        trace->nodes = stream.visited;
+        trace->paragraphs = stream.paragraphs;
+        trace->candidates = stream.candidates;
+        ctx->budget.hit |= stream.article_limits;
+        if (!stream.have_top)
+        {
+            trace->empty = 1;
+            ctx->content.length = 0;
+        }
+        started = trace_stage(trace, METRIC_ASSEMBLY, started);
+
+        format_output(ctx, source, (const char *const *)stream.metadata.fields, ctx->content.data,
+                      ctx->content.length, ctx->budget.hit, format);
+        trace_stage(trace, METRIC_RENDER, started);
+    }
+
+    if (parser)
+    {
+        if (parser->myDoc)
+            xmlFreeDoc(parser->myDoc);
+        parser->myDoc = NULL;
+        htmlFreeParserCtxt(parser);
+    }
+    free_stream(&stream);
+    arena_leave(previous);
+    free(chunk);
+    return status;
+}
+
+// Function to append the JSON or binary record of a document that failed
+static void append_error_record(strbuf_t *output, const char *source, const char *error, readability_format_t format)
+{
+    if (format == READABILITY_CBOR)
+    {
+        start_cbor_record(output);
+        strbuf_append_cbor_head(output, CBOR_MAP, 2);
+        strbuf_append_cbor_string(output, "url");
+        strbuf_append_cbor_string(output, source);
+        strbuf_append_cbor_string(output, "error");
+        strbuf_append_cbor_string(output, error);
+        finish_cbor_record(output, 0, 0);
+        return;
+    }
+    strbuf_puts(output, "{\"url\":");
+    strbuf_append_json_string(output, source);
+    strbuf_puts(output, ",\"error\":");
+    strbuf_append_json_string(output, error);
+    strbuf_puts(output, "}\n");
+}
+
+// Function to report a batch document that could not be processed as an
+// error record
+static void report_error(const char *source, const char *error, readability_format_t format,
+                         readability_sink_fn sink, void *userdata)
+{
+    strbuf_t output = {0};
+    append_error_record(&output, source, error, format);
+    sink(output.data, output.length, userdata);
+    strbuf_free(&output);
+}
+
+#define METRIC_ADD(counter, value) __atomic_fetch_add(&(counter), (uint64_t)(value), __ATOMIC_RELAXED)
+#define METRIC_GET(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+// Shards of the live contexts, and the sum of those already freed
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static metrics_shard_t *metrics_shards;
+static metrics_shard_t metrics_retired;
+
+// Function to count one latency in a histogram
+static void metrics_observe(metric_histogram_t *histogram, double seconds)
+{
+    int bucket = 0;
+    while (bucket < METRIC_BUCKET_COUNT && seconds > metric_buckets[bucket])
+        bucket++;
+    METRIC_ADD(histogram->counts[bucket], 1);
+    METRIC_ADD(histogram->sum_ns, seconds > 0 ? seconds * 1e9 : 0);
+}
+
+// Function to add the counters of one shard to another. Everything after
+// the list links is a uint64_t counter, so they are summed as one array.
+static void metrics_merge(metrics_shard_t *total, metrics_shard_t *shard)
+{
+    size_t count = (sizeof(metrics_shard_t) - offsetof(metrics_shard_t, stages)) / sizeof(uint64_t);
+    uint64_t *to = (uint64_t *)((char *)total + offsetof(metrics_shard_t, stages));
+    uint64_t *from = (uint64_t *)((char *)shard + offsetof(metrics_shard_t, stages));
+    for (size_t i = 0; i < count; i++)
+        METRIC_ADD(to[i], METRIC_GET(from[i]));
+}
+
+// Function to make a context's metrics visible to the exporters
+static void metrics_register(metrics_shard_t *shard)
+{
+    pthread_mutex_lock(&metrics_lock);
+    shard->prev = NULL;
+    shard->next = metrics_shards;
+    if (metrics_shards)
+        metrics_shards->prev = shard;
+    metrics_shards = shard;
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+// Function to fold the metrics of a context being freed into the totals
+static void metrics_unregister(metrics_shard_t *shard)
+{
+    pthread_mutex_lock(&metrics_lock);
+    metrics_merge(&metrics_retired, shard);
+    if (shard->prev)
+        shard->prev->next = shard->next;
+    else
+        metrics_shards = shard->next;
+    if (shard->next)
+        shard->next->prev = shard->prev;
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+// Function to sum the metrics of every context, live or freed
+static void metrics_snapshot(metrics_shard_t *total)
+{
+    memset(total, 0, sizeof(*total));
+    pthread_mutex_lock(&metrics_lock);
+    metrics_merge(total, &metrics_retired);
+    for (metrics_shard_t *shard = metrics_shards; shard; shard = shard->next)
+        metrics_merge(total, shard);
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+// Function to start timing a document
+static void document_start(readability_context_t *ctx)
+{
+    trace_begin(&ctx->trace);
+    ctx->budget.hit = 0;
+    ctx->failure = FAILURE_OTHER;
+}
+
+// Function to append the trace record of a finished document
+static void append_trace_record(strbuf_t *output, const char *source, const doc_trace_t *trace, double elapsed,
+                                const char *error, size_t bytes_out, unsigned int limits)
+{
+    char line[256];
+    strbuf_puts(output, "{\"trace\":");
+    strbuf_append_json_string(output, source);
+    if (error)
+    {
+        strbuf_puts(output, ",\"error\":");
+        strbuf_append_json_string(output, error);
+    }
+    snprintf(line, sizeof(line),
+             ",\"durationUs\":%.0f,\"bytesIn\":%zu,\"bytesOut\":%zu,\"nodes\":%ld,\"paragraphs\":%d,"
+             "\"candidates\":%d,\"cached\":%s,\"empty\":%s",
+             elapsed * 1e6, trace->bytes_in, bytes_out, trace->nodes, trace->paragraphs, trace->candidates,
+             trace->cached ? "true" : "false", trace->empty ? "true" : "false");
+    strbuf_puts(output, line);
+    if (trace->template_hit || trace->template_miss)
+        strbuf_puts(output, trace->template_hit ? ",\"template\":\"hit\"" : ",\"template\":\"miss\"");
+    if (trace->readerable || trace->not_readerable)
+        strbuf_puts(output, trace->readerable ? ",\"readerable\":true" : ",\"readerable\":false");
+    append_limits_hit(output, limits, 1, 0);
+
+    strbuf_puts(output, ",\"spans\":[");
+    const char *separator = "";
+    for (int stage = 0; stage < METRIC_STAGE_COUNT; stage++)
+    {
+        if (!(trace->stages_run & (1u << stage)))
+            continue;
+        snprintf(line, sizeof(line), "%s{\"stage\":\"%s\",\"startUs\":%.0f,\"durationUs\":%.0f}", separator,
+                 metric_stage_names[stage], (trace->stage_start[stage] - trace->start) * 1e6,
+                 trace->stage_seconds[stage] * 1e6);
+        strbuf_puts(output, line);
+        separator = ",";
+    }
+    strbuf_puts(output, "]}\n");
+}
+
+// Function to fold a finished document into the context's metrics and hand
+// its trace record to the trace sink, if any. Returns status, the outcome
+// of the document: 0, or -1 with ctx->error set.
+static int document_finish(readability_context_t *ctx, const char *source, int status)
+{
+    doc_trace_t *trace = &ctx->trace;
+    metrics_shard_t *metrics = &ctx->metrics;
+    double elapsed = now_seconds() - trace->start;
+    size_t bytes_out = status == 0 ? output_length(ctx) : 0;
+
+    METRIC_ADD(metrics->documents, 1);
+    metrics_observe(&metrics->documents_seconds, elapsed);
+    for (int stage = 0; stage < METRIC_STAGE_COUNT; stage++)
+    {
+        if (trace->stages_run & (1u << stage))
+            metrics_observe(&metrics->stages[stage], trace->stage_seconds[stage]);
+    }
+    if (status < 0)
+        METRIC_ADD(metrics->failures[ctx->failure], 1);
+    METRIC_ADD(metrics->bytes_in, trace->bytes_in);
+    METRIC_ADD(metrics->bytes_out, bytes_out);
+    METRIC_ADD(metrics->nodes, trace->nodes);
+    METRIC_ADD(metrics->paragraphs, trace->paragraphs);
+    METRIC_ADD(metrics->candidates, trace->candidates);
+    if (trace->cached)
+        METRIC_ADD(metrics->cache_hits, 1);
+    if (trace->template_hit)
+        METRIC_ADD(metrics->template_hits, 1);
+    if (trace->template_miss)
+        METRIC_ADD(metrics->template_misses, 1);
+    if (trace->not_readerable)
+        METRIC_ADD(metrics->not_readerable, 1);
+    if (trace->empty)
+        METRIC_ADD(metrics->empty_articles, 1);
+    for (int i = 0; i < LIMIT_COUNT; i++)
+    {
+        if (ctx->budget.hit & (1u << i))
+            METRIC_ADD(metrics->limits_hit[i], 1);
+    }
+
+    if (ctx->trace_sink)
+    {
+        ctx->trace_output.length = 0;
+        append_trace_record(&ctx->trace_output, source, trace, elapsed, status < 0 ? ctx->error : NULL, bytes_out,
+                            ctx->budget.hit);
+        if (ctx->trace_output.data)
+            ctx->trace_sink(ctx->trace_output.data, ctx->trace_output.length, ctx->trace_userdata);
+    }
+    return status;
+}
+
+// Function to append one sample line of the Prometheus text format
+static void append_prometheus_sample(strbuf_t *output, const char *name, const char *labels, double value)
+{
+    char number[32];
+    strbuf_puts(output, name);
+    if (labels)
+    {
+        strbuf_puts(output, "{");
+        strbuf_puts(output, labels);
+        strbuf_puts(output, "}");
+    }
+    snprintf(number, sizeof(number), value == (double)(uint64_t)value ? " %.0f\n" : " %.9g\n", value);
+    strbuf_puts(output, number);
+}
+
+// Function to append the HELP and TYPE lines of a Prometheus metric
+static void append_prometheus_header(strbuf_t *output, const char *name, const char *type, const char *help)
+{
+    const char *parts[] = {"# HELP ", name, " ", help, "\n# TYPE ", name, " ", type, "\n"};
+    for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++)
+        strbuf_puts(output, parts[i]);
+}
+
+// Function to append the samples of a Prometheus histogram; label, if
+// given, is added to every sample
+static void append_prometheus_histogram(strbuf_t *output, const char *name, const char *label,
+                                        const metric_histogram_t *histogram)
+{
+    char sample[128], labels[128];
+    uint64_t cumulative = 0;
+    snprintf(sample, sizeof(sample), "%s_bucket", name);
+    for (int bucket = 0; bucket <= METRIC_BUCKET_COUNT; bucket++)
+    {
+        cumulative += histogram->counts[bucket];
+        char bound[32];
+        if (bucket < METRIC_BUCKET_COUNT)
+            snprintf(bound, sizeof(bound), "%g", metric_buckets[bucket]);
+        else
+            strcpy(bound, "+Inf");
+        snprintf(labels, sizeof(labels), "%s%sle=\"%s\"", label ? label : "", label ? "," : "", bound);
+        append_prometheus_sample(output, sample, labels, (double)cumulative);
+    }
+    snprintf(sample, sizeof(sample), "%s_sum", name);
+    append_prometheus_sample(output, sample, label, histogram->sum_ns / 1e9);
+    snprintf(sample, sizeof(sample), "%s_count", name);
+    append_prometheus_sample(output, sample, label, (double)cumulative);
+}
+
+// Function to append a histogram as a JSON object with its bucket counts,
+// not cumulated, in the order of metric_buckets plus the overflow bucket
+static void append_json_histogram(strbuf_t *output, const metric_histogram_t *histogram)
+{
+    char line[64];
+    uint64_t count = 0;
+    strbuf_puts(output, "{\"buckets\":[");
+    for (int bucket = 0; bucket <= METRIC_BUCKET_COUNT; bucket++)
+    {
+        count += histogram->counts[bucket];
+        snprintf(line, sizeof(line), "%s%llu", bucket ? "," : "", (unsigned long long)histogram->counts[bucket]);
+        strbuf_puts(output, line);
+    }
+    snprintf(line, sizeof(line), "],\"count\":%llu,\"sum\":%.9f}", (unsigned long long)count,
+             histogram->sum_ns / 1e9);
+    strbuf_puts(output, line);
+}
+
+// Function to render the metrics of the process as Prometheus text or as
+// one JSON line
+static void append_metrics(strbuf_t *output, readability_metrics_format_t format)
+{
+    metrics_shard_t total;
+    metrics_snapshot(&total);
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double peak_rss = (double)usage.ru_maxrss * 1024;
+
+    static const struct
+    {
+        const char *name;
+        const char *key;
+        const char *help;
+        size_t offset;
+    } counters[] = {
+        {"readability_documents_total", "documents", "Documents processed, including failures",
+         offsetof(metrics_shard_t, documents)},
+        {"readability_cache_hits_total", "cacheHits", "Documents answered from the cache",
+         offsetof(metrics_shard_t, cache_hits)},
+        {"readability_template_hits_total", "templateHits", "Documents scored around the template of their site",
+         offsetof(metrics_shard_t, template_hits)},
+        {"readability_template_misses_total", "templateMisses",
+         "Documents of sites with templates enabled that were scored whole", offsetof(metrics_shard_t, template_misses)},
+        {"readability_not_readerable_total", "notReaderable", "Documents the readerable check found not to be articles",
+         offsetof(metrics_shard_t, not_readerable)},
+        {"readability_empty_articles_total", "emptyArticles", "Documents in which no article content was found",
+         offsetof(metrics_shard_t, empty_articles)},
+        {"readability_input_bytes_total", "inputBytes", "Bytes of HTML read or downloaded",
+         offsetof(metrics_shard_t, bytes_in)},
+        {"readability_output_bytes_total", "outputBytes", "Bytes of output produced",
+         offsetof(metrics_shard_t, bytes_out)},
+        {"readability_nodes_total", "nodes", "Elements annotated for scoring", offsetof(metrics_shard_t, nodes)},
+        {"readability_paragraphs_total", "paragraphs", "Paragraphs scored", offsetof(metrics_shard_t, paragraphs)},
+        {"readability_candidates_total", "candidates", "Candidate containers scored",
+         offsetof(metrics_shard_t, candidates)},
+    };
+    size_t counter_count = sizeof(counters) / sizeof(counters[0]);
+    char line[256];
+
+    if (format == READABILITY_METRICS_JSON)
+    {
+        snprintf(line, sizeof(line), "{\"timestamp\":%lld", (long long)time(NULL));
+        strbuf_puts(output, line);
+        for (size_t i = 0; i < counter_count; i++)
+        {
+            uint64_t value = *(uint64_t *)((char *)&total + counters[i].offset);
+            snprintf(line, sizeof(line), ",\"%s\":%llu", counters[i].key, (unsigned long long)value);
+            strbuf_puts(output, line);
+        }
+        strbuf_puts(output, ",\"failures\":{");
+        for (int i = 0; i < FAILURE_COUNT; i++)
+        {
+            snprintf(line, sizeof(line), "%s\"%s\":%llu", i ? "," : "", failure_names[i],
+                     (unsigned long long)total.failures[i]);
+            strbuf_puts(output, line);
+        }
+        strbuf_puts(output, "},\"limitsHit\":{");
+        for (int i = 0; i < LIMIT_COUNT; i++)
+        {
+            snprintf(line, sizeof(line), "%s\"%s\":%llu", i ? "," : "", limit_names[i],
+                     (unsigned long long)total.limits_hit[i]);
+            strbuf_puts(output, line);
+        }
+        strbuf_puts(output, "},\"bucketBounds\":[");
+        for (int bucket = 0; bucket < METRIC_BUCKET_COUNT; bucket++)
+        {
+            snprintf(line, sizeof(line), "%s%g", bucket ? "," : "", metric_buckets[bucket]);
+            strbuf_puts(output, line);
+        }
+        strbuf_puts(output, "],\"documentSeconds\":");
+        append_json_histogram(output, &total.documents_seconds);
+        strbuf_puts(output, ",\"stageSeconds\":{");
+        for (int stage = 0; stage < METRIC_STAGE_COUNT; stage++)
+        {
+            snprintf(line, sizeof(line), "%s\"%s\":", stage ? "," : "", metric_stage_names[stage]);
+            strbuf_puts(output, line);
+            append_json_histogram(output, &total.stages[stage]);
+        }
+        snprintf(line, sizeof(line), "},\"peakRssBytes\":%.0f}\n", peak_rss);
+        strbuf_puts(output, line);
+        return;
+    }
+
+    for (size_t i = 0; i < counter_count; i++)
+    {
+        append_prometheus_header(output, counters[i].name, "counter", counters[i].help);
+        append_prometheus_sample(output, counters[i].name, NULL,
+                                 (double)*(uint64_t *)((char *)&total + counters[i].offset));
+    }
+
+    append_prometheus_header(output, "readability_failures_total", "counter", "Documents that failed, by reason");
+    for (int i = 0; i < FAILURE_COUNT; i++)
+    {
+        snprintf(line, sizeof(line), "reason=\"%s\"", failure_names[i]);
+        append_prometheus_sample(output, "readability_failures_total", line, (double)total.failures[i]);
+    }
+    append_prometheus_header(output, "readability_limits_hit_total", "counter",
+                             "Documents cut short by a work limit, by limit");
+    for (int i = 0; i < LIMIT_COUNT; i++)
+    {
+        snprintf(line, sizeof(line), "limit=\"%s\"", limit_names[i]);
+        append_prometheus_sample(output, "readability_limits_hit_total", line, (double)total.limits_hit[i]);
+    }
+
+    append_prometheus_header(output, "readability_document_seconds", "histogram",
+                             "Wall time of whole documents, from fetch or parse to output");
+    append_prometheus_histogram(output, "readability_document_seconds", NULL, &total.documents_seconds);
+    append_prometheus_header(output, "readability_stage_seconds", "histogram", "Wall time of each pipeline stage");
+    for (int stage = 0; stage < METRIC_STAGE_COUNT; stage++)
+    {
+        snprintf(line, sizeof(line), "stage=\"%s\"", metric_stage_names[stage]);
+        append_prometheus_histogram(output, "readability_stage_seconds", line, &total.stages[stage]);
+    }
+
+    append_prometheus_header(output, "readability_peak_rss_bytes", "gauge", "Peak resident set size of the process");
+    append_prometheus_sample(output, "readability_peak_rss_bytes", NULL, peak_rss);
+}
+
+// Function to write the metrics of the process to a sink
+int readability_metrics_write(readability_metrics_format_t format, readability_sink_fn sink, void *userdata)
+{
+    strbuf_t output = {0};
+    append_metrics(&output, format);
+    int status = output.data ? sink(output.data, output.length, userdata) : -1;
+    strbuf_free(&output);
+    return status;
+}
+
+// Function to build the path of the cache file of a key
+static void cache_path(const page_cache_t *cache, uint64_t key, char *path, size_t size)
+{
+    snprintf(path, size, "%s/%016llx.entry", cache->dir, (unsigned long long)key);
+}
+
+// Function to find the hash slot that holds, or would hold, a key
+static cache_entry_t **cache_slot(page_cache_t *cache, uint64_t key)
+{
+    cache_entry_t **slot = &cache->buckets[key & (uint64_t)(cache->bucket_count - 1)];
+    while (*slot && (*slot)->key != key)
+        slot = &(*slot)->hash_next;
+    return slot;
+}
+
+// Function to double the hash table of the index
+static int cache_grow(page_cache_t *cache)
+{
+    int bucket_count = cache->bucket_count * 2;
+    cache_entry_t **buckets = calloc((size_t)bucket_count, sizeof(cache_entry_t *));
+    if (!buckets)
+        return -1;
+
+    for (int i = 0; i < cache->bucket_count; i++)
+    {
+        cache_entry_t *entry = cache->buckets[i];
+        while (entry)
+        {
+            cache_entry_t *next = entry->hash_next;
+            cache_entry_t **slot = &buckets[entry->key & (uint64_t)(bucket_count - 1)];
+            entry->hash_next = *slot;
+            *slot = entry;
+            entry = next;
+        }
+    }
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->bucket_count = bucket_count;
+    return 0;
+}
+
+// Function to take an entry off the recency list
+static void cache_lru_unlink(page_cache_t *cache, cache_entry_t *entry)
+{
+    if (entry->lru_prev)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        cache->lru_head = entry->lru_next;
+    if (entry->lru_next)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        cache->lru_tail = entry->lru_prev;
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+// Function to make an entry the most recently used one
+static void cache_lru_push(page_cache_t *cache, cache_entry_t *entry)
+{
+    entry->lru_next = cache->lru_head;
+    if (cache->lru_head)
+        cache->lru_head->lru_prev = entry;
+    else
+        cache->lru_tail = entry;
+    cache->lru_head = entry;
+}
+
+// Function to add an entry to the index, or update the one with the same
+// key, and make it the most recently used one. The caller holds the lock.
+static cache_entry_t *cache_index(page_cache_t *cache, uint64_t key, size_t size, time_t fetched)
+{
+    cache_entry_t **slot = cache_slot(cache, key);
+    cache_entry_t *entry = *slot;
+    if (entry)
+    {
+        cache->total_bytes -= entry->size;
+        cache_lru_unlink(cache, entry);
+    }
+    else
+    {
+        if (cache->count >= cache->bucket_count && cache_grow(cache) == 0)
+            slot = cache_slot(cache, key);
+        entry = calloc(1, sizeof(cache_entry_t));
+        if (!entry)
+            return NULL;
+        entry->key = key;
+        *slot = entry;
+        cache->count++;
+    }
+
+    entry->size = size;
+    entry->fetched = fetched;
+    cache->total_bytes += size;
+    cache_lru_push(cache, entry);
+    return entry;
+}
+
+// Function to drop an entry from the index and delete its file. The caller
+// holds the lock; readers that still map the file keep their copy.
+static void cache_remove(page_cache_t *cache, cache_entry_t *entry)
+{
+    char path[PATH_MAX];
+    cache_path(cache, entry->key, path, sizeof(path));
+    unlink(path);
+
+    *cache_slot(cache, entry->key) = entry->hash_next;
+    cache_lru_unlink(cache, entry);
+    cache->total_bytes -= entry->size;
+    cache->count--;
+    free(entry);
+}
+
+// Function to delete least recently used entries until the cache fits its
+// size bound, sparing keep. The caller holds the lock.
+static void cache_evict(page_cache_t *cache, const cache_entry_t *keep)
+{
+    while (cache->total_bytes > cache->max_bytes && cache->lru_tail && cache->lru_tail != keep)
+        cache_remove(cache, cache->lru_tail);
+}
+
+// Function to order index entries from oldest to newest
+static int compare_cache_entries(const void *a, const void *b)
+{
+    time_t x = ((const cache_entry_t *)a)->fetched;
+    time_t y = ((const cache_entry_t *)b)->fetched;
+    return (x > y) - (x < y);
+}
+
+// Function to release the index; the files stay for the next run
+static void page_cache_cleanup(page_cache_t *cache)
+{
+    cache_entry_t *entry = cache->lru_head;
+    while (entry)
+    {
+        cache_entry_t *next = entry->lru_next;
+        free(entry);
+        entry = next;
+    }
+    free(cache->buckets);
+    free(cache->dir);
+    pthread_mutex_destroy(&cache->lock);
+    memset(cache, 0, sizeof(*cache));
+}
+
+// Function to open the cache in dir, creating the directory if needed, and
+// index the entries already in it. Entries count as used when they were
+// last fetched or revalidated, which is what their modification time holds.
+// Returns 0, or -1 with errno set.
+static int page_cache_init(page_cache_t *cache, const char *dir, size_t max_bytes, long ttl)
+{
+    memset(cache, 0, sizeof(*cache));
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+        return -1;
+
+    DIR *directory = opendir(dir);
+    if (!directory)
+        return -1;
+
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->dir = strdup(dir);
+    cache->max_bytes = max_bytes;
+    cache->ttl = ttl;
+    cache->bucket_count = 256;
+    cache->buckets = calloc((size_t)cache->bucket_count, sizeof(cache_entry_t *));
+
+    cache_entry_t *found = NULL;
+    int found_count = 0;
+    int found_capacity = 0;
+    struct dirent *item;
+    while (cache->dir && cache->buckets && (item = readdir(directory)))
+    {
+        char *end;
+        unsigned long long key = strtoull(item->d_name, &end, 16);
+        struct stat st;
+        if (end != item->d_name + 16 || strcmp(end, ".entry") != 0 ||
+            fstatat(dirfd(directory), item->d_name, &st, 0) < 0 || !S_ISREG(st.st_mode))
+            continue;
+
+        if (found_count == found_capacity)
+        {
+            int capacity = found_capacity ? found_capacity * 2 : 256;
+            cache_entry_t *grown = realloc(found, (size_t)capacity * sizeof(cache_entry_t));
+            if (!grown)
+                break;
+            found = grown;
+            found_capacity = capacity;
+        }
+        found[found_count].key = key;
+        found[found_count].size = (size_t)st.st_size;
+        found[found_count].fetched = st.st_mtime;
+        found_count++;
+    }
+    closedir(directory);
+
+    // Index from oldest to newest so the newest ends up most recently used
+    if (found_count > 0)
+        qsort(found, (size_t)found_count, sizeof(cache_entry_t), compare_cache_entries);
+    for (int i = 0; i < found_count && cache->dir && cache->buckets; i++)
+        cache_index(cache, found[i].key, found[i].size, found[i].fetched);
+    free(found);
+
+    if (!cache->dir || !cache->buckets)
+    {
+        page_cache_cleanup(cache);
+        errno = ENOMEM;
+        return -1;
+    }
+    cache_evict(cache, NULL);
+    return 0;
+}
+
+// Function to take one string of a mapped cache file, checking that it lies
+// within the file and ends with its NUL
+static int cache_take_string(const char **cursor, const char *end, uint64_t length, const char **value)
+{
+    if (length == CACHE_ABSENT)
+    {
+        *value = NULL;
+        return 0;
+    }
+    if ((uint64_t)(end - *cursor) <= length || (*cursor)[length] != '\0')
+        return -1;
+    *value = *cursor;
+    *cursor += length + 1;
+    return 0;
+}
+
+// Function to map the cached copy of url. Returns 0 with hit filled in, to
+// be released with cache_release, or -1 when there is no valid copy.
+static int cache_lookup(page_cache_t *cache, const char *url, cache_hit_t *hit)
+{
+    uint64_t key = hash_string(url);
+    pthread_mutex_lock(&cache->lock);
+    cache_entry_t *entry = *cache_slot(cache, key);
+    if (entry)
+    {
+        cache_lru_unlink(cache, entry);
+        cache_lru_push(cache, entry);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    if (!entry)
+        return -1;
+
+    char path[PATH_MAX];
+    cache_path(cache, key, path, sizeof(path));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(cache_header_t))
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    cache_header_t header;
+    memcpy(&header, map, sizeof(header));
+    const char *cursor = (const char *)map + sizeof(header);
+    const char *end = (const char *)map + st.st_size;
+    const char *stored_url;
+    int valid = memcmp(header.magic, CACHE_MAGIC, 4) == 0 &&
+                header.url_length != CACHE_ABSENT &&
+                cache_take_string(&cursor, end, header.url_length, &stored_url) == 0 &&
+                strcmp(stored_url, url) == 0 &&
+                cache_take_string(&cursor, end, header.etag_length, &hit->etag) == 0 &&
+                cache_take_string(&cursor, end, header.last_modified_length, &hit->last_modified) == 0;
+    for (int i = 0; valid && i < META_FIELD_COUNT; i++)
+        valid = cache_take_string(&cursor, end, header.field_lengths[i], &hit->fields[i]) == 0;
+    valid = valid && (uint64_t)(end - cursor) > header.content_length && cursor[header.content_length] == '\0';
+    if (!valid)
+    {
+        munmap(map, (size_t)st.st_size);
+        return -1;
+    }
+
+    hit->map = map;
+    hit->size = (size_t)st.st_size;
+    hit->fetched = st.st_mtime;
+    hit->content = cursor;
+    hit->content_length = (size_t)header.content_length;
+    return 0;
+}
+
+// Function to unmap a cached copy
+static void cache_release(cache_hit_t *hit)
+{
+    munmap(hit->map, hit->size);
+    hit->map = NULL;
+}
+
+// Function to tell whether a cached copy may be served without asking the
+// origin server
+static int cache_is_fresh(const page_cache_t *cache, const cache_hit_t *hit)
+{
+    return cache->ttl > 0 && time(NULL) - hit->fetched < cache->ttl;
+}
+
+// Function to add one string, with its NUL, to a cache file being written
+static uint32_t cache_put_string(struct iovec *iov, int *count, const char *value)
+{
+    if (!value)
+        return CACHE_ABSENT;
+    size_t length = strlen(value);
+    iov[*count].iov_base = (void *)value;
+    iov[*count].iov_len = length + 1;
+    (*count)++;
+    return (uint32_t)length;
+}
+
+// Function to store the extraction result of url with the validators of the
+// response it came from. The file is written under a temporary name and
+// renamed into place, so a reader maps either the old or the new copy.
+static int cache_store(page_cache_t *cache, const char *url, const char *etag, const char *last_modified,
+                       const char *const *fields, const char *content, size_t content_length)
+{
+    static const char nul = '\0';
+    cache_header_t header;
+    struct iovec iov[5 + META_FIELD_COUNT];
+    int count = 1;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC, 4);
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    header.url_length = cache_put_string(iov, &count, url);
+    header.etag_length = cache_put_string(iov, &count, etag);
+    header.last_modified_length = cache_put_string(iov, &count, last_modified);
+    for (int i = 0; i < META_FIELD_COUNT; i++)
+        header.field_lengths[i] = cache_put_string(iov, &count, fields[i]);
+    header.content_length = content_length;
+    iov[count].iov_base = (void *)content;
+    iov[count++].iov_len = content_length;
+    iov[count].iov_base = (void *)&nul;
+    iov[count++].iov_len = 1;
+
+    uint64_t key = hash_string(url);
+    char path[PATH_MAX];
+    char temp_path[PATH_MAX];
+    cache_path(cache, key, path, sizeof(path));
+    snprintf(temp_path, sizeof(temp_path), "%s/.%016llx.XXXXXX", cache->dir, (unsigned long long)key);
+    int fd = mkstemp(temp_path);
+    if (fd < 0)
+        return -1;
+
+    // writev may stop short; carry on from wherever it did
+    size_t size = 0;
+    struct iovec *next = iov;
+    int remaining = count;
+    while (remaining > 0)
+    {
+        ssize_t written = writev(fd, next, remaining);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            break;
+        size += (size_t)written;
+        while (remaining > 0 && (size_t)written >= next->iov_len)
+        {
+            written -= (ssize_t)next->iov_len;
+            next++;
+            remaining--;
+        }
+        if (remaining > 0)
+        {
+            next->iov_base = (char *)next->iov_base + written;
+            next->iov_len -= (size_t)written;
+        }
+    }
+
+    struct stat st;
+    if (remaining > 0 || fstat(fd, &st) < 0 || close(fd) < 0 || rename(temp_path, path) < 0)
+    {
+        if (remaining > 0)
+            close(fd);
+        unlink(temp_path);
+        return -1;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    cache_entry_t *entry = cache_index(cache, key, size, st.st_mtime);
+    cache_evict(cache, entry);
+    pthread_mutex_unlock(&cache->lock);
+    return 0;
+}
+
+// Function to record that the origin server confirmed the cached copy of
+// url with a 304, which makes it fresh again
+static void cache_refresh(page_cache_t *cache, const char *url)
+{
+    uint64_t key = hash_string(url);
+    char path[PATH_MAX];
+    cache_path(cache, key, path, sizeof(path));
+    utimensat(AT_FDCWD, path, NULL, 0);
+
+    pthread_mutex_lock(&cache->lock);
+    cache_entry_t *entry = *cache_slot(cache, key);
+    if (entry)
+        entry->fetched = time(NULL);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Function to render a cached copy into ctx->output
+static void format_cached(readability_context_t *ctx, const char *url, const cache_hit_t *hit,
+                          readability_format_t format)
+{
+    double started = now_seconds();
+    format_output(ctx, url, hit->fields, hit->content, hit->content_length, 0, format);
+    ctx->trace.cached = 1;
+    trace_stage(&ctx->trace, METRIC_RENDER, started);
+}
+
+// Function to render a fetched document, or the cached copy that a 304
+// answer confirmed, into ctx->output and bring the cache up to date. hit is
+// the copy the request was made conditional on, if the caller still has it
+// mapped; error is what the fetch failed with, if it did. Returns 0, or -1
+// with ctx->error set.
+static int deliver_fetch(readability_context_t *ctx, const char *url, const cache_hit_t *hit, htmlDocPtr doc,
+                         const fetch_response_t *response, const char *error, readability_format_t format)
+{
+    page_cache_t *cache = ctx->cache;
+    trace_stage(&ctx->trace, METRIC_FETCH, now_seconds() - response->elapsed);
+    ctx->trace.bytes_in = response->size;
+    if (doc)
+    {
+        budget_start(ctx);
+        if (response->truncated)
+            ctx->budget.hit |= LIMIT_INPUT;
+        arena_t *previous = arena_enter(doc->_private);
+        int checked = check_document(ctx, doc, url, format);
+        if (checked == 0)
+        {
+            article_metadata_t metadata;
+            extract_article_parts(ctx, doc, &metadata);
+            const char *const *fields = (const char *const *)metadata.fields;
+
+            // Only full answers are stored, and only when they can be
+            // reused: within the TTL, or through a conditional request.
+            // Extractions cut short by a limit are not stored.
+            if (cache && response->status == 200 && !ctx->budget.hit &&
+                (cache->ttl > 0 || response->etag || response->last_modified))
+                cache_store(cache, url, response->etag, response->last_modified, fields, ctx->content.data,
+                            ctx->content.length);
+            double started = now_seconds();
+            format_output(ctx, url, fields, ctx->content.data, ctx->content.length, ctx->budget.hit, format);
+            trace_stage(&ctx->trace, METRIC_RENDER, started);
+            free_metadata(&metadata);
+        }
+        arena_leave(previous);
+        free_document(doc);
+        return checked < 0 ? -1 : 0;
+    }
+    if (error)
+    {
+        set_failure(ctx, response->failure, error);
+        return -1;
+    }
+
+    cache_hit_t mapped;
+    if (!hit && cache && cache_lookup(cache, url, &mapped) == 0)
+        hit = &mapped;
+    if (!hit)
+    {
+        set_failure(ctx, FAILURE_NOT_MODIFIED, "not modified, but no cached copy");
+        return -1;
+    }
+
+    cache_refresh(cache, url);
+    format_cached(ctx, url, hit, format);
+    if (hit == &mapped)
+        cache_release(&mapped);
+    return 0;
+}
+
+// Function to extract a URL into ctx->output through the context's cache: a
+// fresh copy is served as it is, a stale one is revalidated with a
+// conditional request, and a new document is extracted and stored. Returns
+// 0, or -1 with ctx->error set.
+static int extract_url(readability_context_t *ctx, const char *url, readability_format_t format)
+{
+    page_cache_t *cache = ctx->cache;
+    cache_hit_t hit;
+    int cached = cache && ctx->check != READABILITY_CHECK_ONLY && cache_lookup(cache, url, &hit) == 0;
+    if (cached && cache_is_fresh(cache, &hit))
+    {
+        format_cached(ctx, url, &hit, format);
+        cache_release(&hit);
+        return 0;
+    }
+
+    fetch_response_t response;
+    const char *error = NULL;
+    htmlDocPtr doc = fetch_document(&ctx->fetch_handle, &ctx->fetch_options, url, cached ? hit.etag : NULL,
+                                    cached ? hit.last_modified : NULL, ctx->limits.max_input_bytes, &response, &error);
+    int status = deliver_fetch(ctx, url, cached ? &hit : NULL, doc, &response, error, format);
+    free_fetch_response(&response);
+    if (cached)
+        cache_release(&hit);
+    return status;
+}
+
+// Function to open a cache for readability_context_set_cache
+readability_cache_t *readability_cache_open(const char *dir, size_t max_bytes, long ttl)
+{
+    page_cache_t *cache = malloc(sizeof(page_cache_t));
+    if (!cache || page_cache_init(cache, dir, max_bytes, ttl) < 0)
+    {
+        int saved_errno = cache ? errno : ENOMEM;
+        free(cache);
+        errno = saved_errno;
+        return NULL;
+    }
+    return cache;
+}
+
+// Function to close a cache opened with readability_cache_open
+void readability_cache_close(readability_cache_t *cache)
+{
+    if (!cache)
+        return;
+    page_cache_cleanup(cache);
+    free(cache);
+}
+
+// Function to order templates from least to most recently used
+static int compare_templates(const void *a, const void *b)
+{
+    uint64_t x = (*(const site_template_t *const *)a)->used;
+    uint64_t y = (*(const site_template_t *const *)b)->used;
+    return (x > y) - (x < y);
+}
+
+// Function to release the templates of a store; the file is left as it is
+static void template_store_cleanup(template_store_t *store)
+{
+    for (int i = 0; i < store->count; i++)
+    {
+        free(store->items[i].host);
+        free(store->items[i].path);
+    }
+    free(store->items);
+    free(store->slots);
+    free(store->path);
+    pthread_mutex_destroy(&store->lock);
+    memset(store, 0, sizeof(*store));
+}
+
+// Function to set up a store for max_hosts templates and load those already
+// saved in path, if it exists. The file holds TEMPLATE_MAGIC, then one
+// "host<TAB>path" line per template from least to most recently used, so
+// loading them in order restores their recency. Returns 0, or -1 with errno
+// set, to EINVAL when the file is not a template file.
+static int template_store_init(template_store_t *store, const char *path, int max_hosts)
+{
+    memset(store, 0, sizeof(*store));
+    pthread_mutex_init(&store->lock, NULL);
+    store->path = strdup(path);
+    store->max_hosts = max_hosts;
+    store->slot_count = 16;
+    while (store->slot_count < max_hosts * 2)
+        store->slot_count *= 2;
+    store->items = calloc((size_t)max_hosts, sizeof(site_template_t));
+    store->slots = calloc((size_t)store->slot_count, sizeof(int));
+    if (!store->path || !store->items || !store->slots)
+    {
+        template_store_cleanup(store);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    FILE *file = fopen(path, "r");
+    if (!file)
+    {
+        if (errno == ENOENT)
+            return 0;
+        int saved_errno = errno;
+        template_store_cleanup(store);
+        errno = saved_errno;
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length = getline(&line, &capacity, file);
+    int valid = length > 0 && strcmp(line, TEMPLATE_MAGIC "\n") == 0;
+    while (valid && (length = getline(&line, &capacity, file)) > 0)
+    {
+        if (line[length - 1] == '\n')
+            line[--length] = '\0';
+        char *tab = strchr(line, '\t');
+        if (!tab || tab == line || tab[1] == '\0')
+            continue;
+        *tab = '\0';
+        template_remember(store, line, tab + 1);
+    }
+    free(line);
+    fclose(file);
+
+    if (!valid)
+    {
+        template_store_cleanup(store);
+        errno = EINVAL;
+        return -1;
+    }
+    store->dirty = 0;
+    return 0;
+}
+
+// Function to write the templates of a store to its file, whole, through a
+// temporary file renamed into place. Returns 0, or -1 with errno set.
+static int template_store_save(template_store_t *store)
+{
+    site_template_t **order = malloc((size_t)(store->count ? store->count : 1) * sizeof(site_template_t *));
+    if (!order)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    for (int i = 0; i < store->count; i++)
+        order[i] = &store->items[i];
+    qsort(order, (size_t)store->count, sizeof(site_template_t *), compare_templates);
+
+    char temp_path[PATH_MAX];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", store->path);
+    FILE *file = fopen(temp_path, "w");
+    int status = file ? 0 : -1;
+    if (file)
+    {
+        fputs(TEMPLATE_MAGIC "\n", file);
+        for (int i = 0; i < store->count; i++)
+            fprintf(file, "%s\t%s\n", order[i]->host, order[i]->path);
+        if (fclose(file) != 0 || rename(temp_path, store->path) != 0)
+        {
+            int saved_errno = errno;
+            unlink(temp_path);
+            errno = saved_errno;
+            status = -1;
+        }
+    }
+    free(order);
+    return status;
+}
+
+// Function to open a template store for readability_context_set_templates
+readability_templates_t *readability_templates_open(const char *path, int max_hosts)
+{
+    if (max_hosts < 1)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    template_store_t *store = malloc(sizeof(template_store_t));
+    if (!store || template_store_init(store, path, max_hosts) < 0)
+    {
+        int saved_errno = store ? errno : ENOMEM;
+        free(store);
+        errno = saved_errno;
+        return NULL;
+    }
+    return store;
+}
+
+// Function to save and close a template store opened with
+// readability_templates_open
+int readability_templates_close(readability_templates_t *templates)
+{
+    if (!templates)
+        return 0;
+    int status = templates->dirty ? template_store_save(templates) : 0;
+    int saved_errno = errno;
+    template_store_cleanup(templates);
+    free(templates);
+    errno = saved_errno;
+    return status;
+}
+
+static pthread_once_t global_init_once = PTHREAD_ONCE_INIT;
+static int global_init_status;
+
+// Function to initialize the libraries the extractor builds on, once
+static void global_init(void)
+{
+    // Every libxml2 allocation goes through the arena hooks, so they must be
+    // installed before the library allocates anything
+    xmlMemSetup(arena_free, arena_malloc, arena_realloc, arena_strdup);
+    xmlInitParser();
+    select_text_kernels();
+    global_init_status = curl_global_init(CURL_GLOBAL_ALL) == CURLE_OK ? 0 : -1;
+    if (global_init_status == 0)
+        fetch_share_init();
+}
+
+// Function to set up libxml2 and libcurl
+int readability_global_init(void)
+{
+    pthread_once(&global_init_once, global_init);
+    return global_init_status;
+}
+
+// Function to tear down libxml2 and libcurl and free the pooled arenas
+void readability_global_cleanup(void)
+{
+    fetch_share_cleanup();
+    curl_global_cleanup();
+    xmlCleanupParser();
+    arena_pool_cleanup();
+}
+
+// Function to create a context around a matcher, which it frees with itself
+// only when owns_matcher is set. Rendering depth is limited by default, since
+// it recurses once per level.
+static readability_context_t *new_context(pattern_matcher_t *matcher, int owns_matcher, page_cache_t *cache)
+{
+    readability_context_t *ctx = calloc(1, sizeof(readability_context_t));
+    if (!ctx)
+        return NULL;
+    ctx->matcher = matcher;
+    ctx->owns_matcher = owns_matcher;
+    ctx->cache = cache;
+    ctx->limits.max_depth = 512;
+    ctx->threads = 1;
+    ctx->fetch_options.connect_timeout_ms = 10000;
+    ctx->fetch_options.timeout_ms = 30000;
+    ctx->fetch_options.max_redirects = 5;
+    ctx->fetch_options.max_body_bytes = (size_t)64 * 1024 * 1024;
+    metrics_register(&ctx->metrics);
+    return ctx;
+}
+
+// Function to create a context with its own compiled patterns
+readability_context_t *readability_context_new(const char *patterns_path)
+{
+    pattern_matcher_t *matcher = patterns_path ? load_class_patterns(patterns_path) : new_default_class_matcher();
+    if (!matcher)
+        return NULL;
+
+    readability_context_t *ctx = new_context(matcher, 1, NULL);
+    if (!ctx)
+    {
+        free_pattern_matcher(matcher);
+        errno = ENOMEM;
+    }
+    return ctx;
+}
+
+// Function to set the work limits of a context
+void readability_context_set_limits(readability_context_t *ctx, const readability_limits_t *limits)
+{
+    ctx->limits = *limits;
+}
+
+// Function to set how a context downloads pages
+void readability_context_set_fetch_options(readability_context_t *ctx, const readability_fetch_options_t *options)
+{
+    ctx->fetch_options = *options;
+}
+
+// Function to trace every document of a context to a sink
+void readability_context_set_trace(readability_context_t *ctx, readability_sink_fn sink, void *userdata)
+{
+    ctx->trace_sink = sink;
+    ctx->trace_userdata = userdata;
+}
+
+// Function to set the vectored sink of a context
+void readability_context_set_sinkv(readability_context_t *ctx, readability_sinkv_fn sinkv)
 {
-    char *memory;
-    size_t size;
-};
+    ctx->sinkv = sinkv;
+}
 
-// A struct to hold candidate information
-typedef struct
+// Function to choose the extraction engine of a context
+void readability_context_set_engine(readability_context_t *ctx, readability_engine_t engine)
 {
-    xmlNodePtr node;
-    double content_score;
-} candidate_t;
+    ctx->engine = engine;
+}
 
-// Callback function for libcurl to write data
-static size_t WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp)
+// Function to free a context and its scratch buffers
+void readability_context_free(readability_context_t *ctx)
 {
-    size_t realsize = size * nmemb;
-    struct MemoryStruct *mem = (struct MemoryStruct *)userp;
+    if (!ctx)
+        return;
+    if (ctx->owns_matcher)
+        free_pattern_matcher(ctx->matcher);
+    metrics_unregister(&ctx->metrics);
+    free_article_nodes(&ctx->nodes);
+    strbuf_free(&ctx->content);
+    strbuf_free(&ctx->output);
+    strbuf_free(&ctx->output_tail);
+    strbuf_free(&ctx->output_scratch);
+    strbuf_free(&ctx->trace_output);
+    strbuf_free(&ctx->template_path);
+    if (ctx->fetch_handle)
+        curl_easy_cleanup(ctx->fetch_handle);
+    scoring_pool_free(ctx->pool);
+    free(ctx);
+}
+
+// Function to attach a cache to a context
+void readability_context_set_cache(readability_context_t *ctx, readability_cache_t *cache)
+{
+    ctx->cache = cache;
+}
+
+// Function to set the number of threads that score large documents
+void readability_context_set_threads(readability_context_t *ctx, int threads)
+{
+    ctx->threads = threads < 1 ? 1 : threads > PARALLEL_MAX_THREADS ? PARALLEL_MAX_THREADS : threads;
+}
+
+// Function to set the readerable check of a context
+void readability_context_set_check(readability_context_t *ctx, readability_check_t check)
+{
+    ctx->check = check;
+}
+
+// Function to check a document the caller parsed; like
+// readability_extract_doc, it allocates from the heap
+int readability_is_probably_readerable(readability_context_t *ctx, htmlDocPtr doc)
+{
+    arena_t *previous = arena_enter(NULL);
+    int readerable = is_probably_readerable(xmlDocGetRootElement(doc), ctx->matcher);
+    arena_leave(previous);
+    return readerable;
+}
+
+// Function to make a context learn and use the templates of a store
+void readability_context_set_templates(readability_context_t *ctx, readability_templates_t *templates)
+{
+    ctx->templates = templates;
+}
+
+// Function to return the error of the last failed call
+const char *readability_error(const readability_context_t *ctx)
+{
+    return ctx->error ? ctx->error : "no error";
+}
+
+// Function to tell whether the last document of a context had an article
+int readability_found_article(const readability_context_t *ctx)
+{
+    return !ctx->trace.empty;
+}
 
-    char *ptr = realloc(mem->memory, mem->size + realsize + 1);
-    if (ptr == NULL)
+// Function to hand the rendering of the current document to the context's
+// vectored sink, in its parts, or else to sink, joined together
+static int emit_output(readability_context_t *ctx, readability_sink_fn sink, void *userdata)
+{
+    struct iovec pieces[3] = {{ctx->output.data, ctx->output.length}};
+    int count = 1;
+    if (ctx->output_split)
     {
-        printf("Not enough memory (realloc returned NULL)\n");
-        return 0;
+        pieces[1] = (struct iovec){ctx->content.data, ctx->content.length};
+        pieces[2] = (struct iovec){ctx->output_tail.data, ctx->output_tail.length};
+        count = 3;
+    }
+    if (!ctx->sinkv && ctx->output_split)
+    {
+        strbuf_append(&ctx->output, ctx->content.data, ctx->content.length);
+        strbuf_append(&ctx->output, ctx->output_tail.data, ctx->output_tail.length);
+        ctx->output_split = 0;
     }
 
-    mem->memory = ptr;
-    memcpy(&(mem->memory[mem->size]), contents, realsize);
-    mem->size += realsize;
-    mem->memory[mem->size] = 0;
+    int status = ctx->sinkv ? ctx->sinkv(pieces, count, userdata)
+                            : sink(ctx->output.data, ctx->output.length, userdata);
+    if (status < 0)
+    {
+        set_failure(ctx, FAILURE_OUTPUT, "unable to write output");
+        return -1;
+    }
+    return 0;
+}
 
-    return realsize;
+// Function to extract one document parsed into its own arena and free it.
+// Everything the extraction allocates comes from the document's arena.
+static int extract_own_document(readability_context_t *ctx, htmlDocPtr doc, const char *url,
+                                readability_format_t format, readability_sink_fn sink, void *userdata)
+{
+    arena_t *previous = arena_enter(doc->_private);
+    int status = render_document(ctx, doc, url, format);
+    arena_leave(previous);
+    free_document(doc);
+    return status < 0 ? -1 : emit_output(ctx, sink, userdata);
 }
 
-// Function to fetch HTML content from a URL
-char *fetch_url(const char *url)
+// Function to parse and extract one document from memory. base_url is the
+// document's URL for resolving links; source is the URL it is reported as.
+static int extract_buffer(readability_context_t *ctx, const char *html, size_t size, const char *base_url,
+                          const char *source, readability_format_t format, readability_sink_fn sink, void *userdata)
 {
-    CURL *curl_handle;
-    CURLcode res;
+    if (ctx->engine == READABILITY_ENGINE_STREAM && ctx->check == READABILITY_CHECK_NONE)
+    {
+        if (stream_document(ctx, -1, html, size, base_url, source, format) < 0)
+            return -1;
+        return emit_output(ctx, sink, userdata);
+    }
+    if (size > INT_MAX)
+    {
+        set_failure(ctx, FAILURE_TOO_LARGE, "document too large");
+        return -1;
+    }
 
-    struct MemoryStruct chunk;
-    chunk.memory = malloc(1);
-    chunk.size = 0;
+    budget_start(ctx);
+    ctx->trace.bytes_in = size;
+    double started = now_seconds();
+    htmlDocPtr doc = read_document(html, (int)budget_input(ctx, size), base_url);
+    trace_stage(&ctx->trace, METRIC_PARSE, started);
+    if (!doc)
+    {
+        set_failure(ctx, FAILURE_PARSE, "unable to parse HTML");
+        return -1;
+    }
+    return extract_own_document(ctx, doc, source, format, sink, userdata);
+}
 
-    curl_global_init(CURL_GLOBAL_ALL);
-    curl_handle = curl_easy_init();
+// Function to parse and extract an HTML buffer
+int readability_extract_html(readability_context_t *ctx, const char *html, size_t size, const char *url,
+                             readability_format_t format, readability_sink_fn sink, void *userdata)
+{
+    document_start(ctx);
+    return document_finish(ctx, url ? url : "", extract_buffer(ctx, html, size, url, url, format, sink, userdata));
+}
 
-    curl_easy_setopt(curl_handle, CURLOPT_URL, url);
-    curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
-    curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)&chunk);
-    curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "libcurl-agent/1.0");
+// Function to extract a document the caller parsed. It is not in an arena,
+// so the extraction allocates from the heap.
+int readability_extract_doc(readability_context_t *ctx, htmlDocPtr doc, const char *url,
+                            readability_format_t format, readability_sink_fn sink, void *userdata)
+{
+    document_start(ctx);
+    budget_start(ctx);
+    arena_t *previous = arena_enter(NULL);
+    int status = render_document(ctx, doc, url, format);
+    arena_leave(previous);
+    return document_finish(ctx, url ? url : "", status < 0 ? -1 : emit_output(ctx, sink, userdata));
+}
 
-    res = curl_easy_perform(curl_handle);
+// Function to read, parse and extract a local file ("-" for stdin). Without
+// a base URL the document is reported under its path.
+int readability_extract_file(readability_context_t *ctx, const char *path, const char *base_url,
+                             readability_format_t format, readability_sink_fn sink, void *userdata)
+{
+    document_start(ctx);
+    const char *source = base_url ? base_url : path;
+    if (ctx->engine == READABILITY_ENGINE_STREAM && ctx->check == READABILITY_CHECK_NONE)
+    {
+        // Read a chunk at a time rather than mapping the whole file
+        int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+        if (fd < 0)
+        {
+            set_failure(ctx, FAILURE_READ, "unable to read file");
+            return document_finish(ctx, source, -1);
+        }
+        int status = stream_document(ctx, fd, NULL, 0, base_url, source, format);
+        if (fd != STDIN_FILENO)
+            close(fd);
+        if (status == 0)
+            status = emit_output(ctx, sink, userdata);
+        return document_finish(ctx, source, status);
+    }
 
-    if (res != CURLE_OK)
+    input_buffer_t input;
+    if (load_input(path, &input) < 0)
     {
-        fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
-        free(chunk.memory);
-        chunk.memory = NULL;
+        set_failure(ctx, FAILURE_READ, "unable to read file");
+        return document_finish(ctx, source, -1);
     }
 
-    curl_easy_cleanup(curl_handle);
-    curl_global_cleanup();
+    int status = extract_buffer(ctx, input.data, input.size, base_url, source, format, sink, userdata);
+    free_input(&input);
+    return document_finish(ctx, source, status);
+}
+
+// Function to fetch and extract a URL
+int readability_extract_url(readability_context_t *ctx, const char *url, readability_format_t format,
+                            readability_sink_fn sink, void *userdata)
+{
+    document_start(ctx);
+    int status = extract_url(ctx, url, format);
+    if (status == 0)
+        status = emit_output(ctx, sink, userdata);
+    return document_finish(ctx, url, status);
+}
+
+// Callback that extracts each batch download as soon as it completes
+static void batch_fetch_done(const char *url, htmlDocPtr doc, fetch_response_t *response, const char *error,
+                             void *userdata)
+{
+    batch_t *batch = userdata;
+    readability_context_t *ctx = batch->ctx;
+    document_start(ctx);
+    int status = deliver_fetch(ctx, url, NULL, doc, response, error, batch->format);
+    if (status == 0)
+        status = emit_output(ctx, batch->sink, batch->userdata);
+    if (document_finish(ctx, url, status) < 0)
+    {
+        report_error(url, ctx->error, batch->format, batch->sink, batch->userdata);
+        batch->failures++;
+    }
+}
+
+// Function to answer a batch URL from the cache when its copy there is
+// fresh, or else queue its download, conditional on any stale copy
+static int batch_queue_url(fetch_engine_t *engine, batch_t *batch, const char *url)
+{
+    readability_context_t *ctx = batch->ctx;
+    cache_hit_t hit;
+    if (!ctx->cache || ctx->check == READABILITY_CHECK_ONLY || cache_lookup(ctx->cache, url, &hit) < 0)
+        return fetch_engine_add(engine, url, NULL, NULL, batch);
 
-    return chunk.memory;
+    int status = 0;
+    if (cache_is_fresh(ctx->cache, &hit))
+    {
+        document_start(ctx);
+        format_cached(ctx, url, &hit, batch->format);
+        if (document_finish(ctx, url, emit_output(ctx, batch->sink, batch->userdata)) < 0)
+        {
+            report_error(url, ctx->error, batch->format, batch->sink, batch->userdata);
+            batch->failures++;
+        }
+    }
+    else
+    {
+        status = fetch_engine_add(engine, url, hit.etag, hit.last_modified, batch);
+    }
+    cache_release(&hit);
+    return status;
 }
 
-// Function to remove scripts, styles, and other unwanted tags
-void remove_unwanted_tags(xmlNode *node)
+// Function to process every URL or file path listed one per line in a file
+// ("-" for stdin), writing one record per document. URLs are fetched
+// concurrently and their records are written in completion order; fresh
+// cached copies are written straight away.
+int readability_run_batch(readability_context_t *ctx, const char *list_path, int concurrency, int per_host,
+                          readability_format_t format, readability_sink_fn sink, void *userdata)
 {
-    xmlNode *cur_node = NULL;
-    for (cur_node = node; cur_node; cur_node = cur_node->next)
+    FILE *list = strcmp(list_path, "-") == 0 ? stdin : fopen(list_path, "r");
+    if (!list)
+    {
+        set_error(ctx, "unable to open batch list %s: %s", list_path, strerror(errno));
+        return -1;
+    }
+
+    fetch_engine_t engine;
+    if (fetch_engine_init(&engine, concurrency, per_host, batch_fetch_done) < 0)
+    {
+        set_error(ctx, "unable to initialize fetch engine");
+        if (list != stdin)
+            fclose(list);
+        return -1;
+    }
+    engine.max_bytes = ctx->limits.max_input_bytes;
+    engine.options = &ctx->fetch_options;
+
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t length;
+    batch_t batch = {ctx, format, sink, userdata, 0};
+    int eof = 0;
+
+    // Keep a bounded window of queued URLs so huge lists are not read up front
+    int window = concurrency * 4;
+    while (!eof || engine.active + engine.pending > 0)
     {
-        if (cur_node->type == XML_ELEMENT_NODE)
+        while (!eof && engine.pending < window)
         {
-            if (xmlStrcasecmp(cur_node->name, (const xmlChar *)"script") == 0 ||
-                xmlStrcasecmp(cur_node->name, (const xmlChar *)"style") == 0 ||
-                xmlStrcasecmp(cur_node->name, (const xmlChar *)"noscript") == 0 ||
-                xmlStrcasecmp(cur_node->name, (const xmlChar *)"iframe") == 0 ||
-                xmlStrcasecmp(cur_node->name, (const xmlChar *)"ad") == 0 ||
-                xmlStrcasecmp(cur_node->name, (const xmlChar *)"ins") == 0 ||
-                xmlStrcasecmp(cur_node->name, (const xmlChar *)"aside") == 0 ||
-                xmlStrcasecmp(cur_node->name, (const xmlChar *)"figure") == 0)
+            if ((length = getline(&line, &line_capacity, list)) < 0)
             {
-                xmlUnlinkNode(cur_node);
-                xmlFreeNode(cur_node);
+                eof = 1;
+                break;
             }
-            else
+
+            while (length > 0 && isspace((unsigned char)line[length - 1]))
+                line[--length] = '\0';
+            char *source = line;
+            while (isspace((unsigned char)*source))
+                source++;
+            if (*source == '\0' || *source == '#')
+                continue;
+
+            if (!readability_is_url(source))
+            {
+                if (readability_extract_file(ctx, source, NULL, format, sink, userdata) < 0)
+                {
+                    report_error(source, ctx->error, format, sink, userdata);
+                    batch.failures++;
+                }
+            }
+            else if (batch_queue_url(&engine, &batch, source) < 0)
             {
-                remove_unwanted_tags(cur_node->children);
+                report_error(source, "unable to queue URL", format, sink, userdata);
+                batch.failures++;
             }
         }
+
+        if (engine.active + engine.pending > 0)
+            fetch_engine_poll(&engine, 100, -1);
     }
+
+    fetch_engine_cleanup(&engine);
+    free(line);
+    if (list != stdin)
+        fclose(list);
+    return batch.failures;
+}
+
+// Set by SIGINT and SIGTERM to stop the server loop
+static volatile sig_atomic_t serve_stop_requested;
+
+// Signal handler that asks the server loop to stop
+static void serve_request_stop(int signal_number)
+{
+    (void)signal_number;
+    serve_stop_requested = 1;
+}
+
+// Function to return the reason phrase of an HTTP status code
+static const char *http_reason(int status)
+{
+    switch (status)
+    {
+    case 100: return "Continue";
+    case 200: return "OK";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 411: return "Length Required";
+    case 413: return "Payload Too Large";
+    case 414: return "URI Too Long";
+    case 422: return "Unprocessable Entity";
+    case 431: return "Request Header Fields Too Large";
+    case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
+    default: return "Internal Server Error";
+    }
+}
+
+// Function to append a complete HTTP response
+static void serve_append_response(strbuf_t *out, int status, const char *content_type, const char *body,
+                                  size_t length, int keep_alive)
+{
+    char head[256];
+    int n = snprintf(head, sizeof(head),
+                     "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n%sConnection: %s\r\n\r\n",
+                     status, http_reason(status), content_type, length, status == 503 ? "Retry-After: 1\r\n" : "",
+                     keep_alive ? "keep-alive" : "close");
+    strbuf_append(out, head, (size_t)n);
+    strbuf_append(out, body, length);
+}
+
+// Function to append an error response whose body is an error record
+static void serve_append_error(strbuf_t *out, int status, const char *source, const char *error, int keep_alive)
+{
+    strbuf_t body = {0};
+    append_error_record(&body, source ? source : "", error, READABILITY_JSON);
+    serve_append_response(out, status, SERVE_JSON, body.data, body.length, keep_alive);
+    strbuf_free(&body);
 }
 
-// Function to clean whitespace
-void clean_whitespace(xmlChar *content)
+// Function to decode a percent-encoded query value in place
+static void url_decode(char *value)
 {
-    xmlChar *write = content, *read = content;
-    int space = 0;
-    while (*read)
+    char *write = value;
+    for (char *read = value; *read; read++)
     {
-        if (*read == ' ' || *read == '\n' || *read == '\t')
+        if (*read == '%' && isxdigit((unsigned char)read[1]) && isxdigit((unsigned char)read[2]))
         {
-            if (!space)
-            {
-                *write++ = ' ';
-                space = 1;
-            }
+            char hex[3] = {read[1], read[2], '\0'};
+            *write++ = (char)strtol(hex, NULL, 16);
+            read += 2;
         }
         else
         {
-            *write++ = *read;
-            space = 0;
+            *write++ = *read == '+' ? ' ' : *read;
         }
-        read++;
     }
     *write = '\0';
 }
 
-// Function to get link density of a node
-double get_link_density(xmlNode *node)
+// Function to extract one job on a worker thread with the worker's
+// context; fetched URLs go through its cache (if any)
+static void serve_run_job(serve_job_t *job, readability_context_t *ctx)
+{
+    const char *source = job->url ? job->url : "";
+    int status = 200;
+    document_start(ctx);
+    if (job->body)
+    {
+        budget_start(ctx);
+        ctx->trace.bytes_in = job->body_size;
+        double started = now_seconds();
+        htmlDocPtr doc = read_document(job->body, (int)budget_input(ctx, job->body_size), job->url);
+        trace_stage(&ctx->trace, METRIC_PARSE, started);
+        if (doc)
+        {
+            arena_t *previous = arena_enter(doc->_private);
+            if (render_document(ctx, doc, source, READABILITY_JSON) < 0)
+                status = 422;
+            arena_leave(previous);
+            free_document(doc);
+        }
+        else
+        {
+            set_failure(ctx, FAILURE_PARSE, "unable to parse HTML");
+            status = 422;
+        }
+    }
+    else if (job->fetched)
+    {
+        // The document is the worker's to free from here on
+        htmlDocPtr doc = job->doc;
+        job->doc = NULL;
+        if (deliver_fetch(ctx, job->url, job->cached ? &job->hit : NULL, doc, &job->fetch, job->error,
+                          READABILITY_JSON) < 0)
+        {
+            // A page the readerable check skips was fetched fine
+            status = ctx->failure == FAILURE_NOT_READERABLE ? 422 : 502;
+        }
+    }
+    else
+    {
+        format_cached(ctx, job->url, &job->hit, READABILITY_JSON);
+    }
+
+    if (status == 200)
+    {
+        serve_append_response(&job->response, status, SERVE_JSON, ctx->output.data, ctx->output.length,
+                              job->keep_alive);
+    }
+    else
+    {
+        strbuf_t body = {0};
+        append_error_record(&body, source, ctx->error, READABILITY_JSON);
+        serve_append_response(&job->response, status, SERVE_JSON, body.data, body.length, job->keep_alive);
+        strbuf_free(&body);
+    }
+    document_finish(ctx, source, status == 200 ? 0 : -1);
+}
+
+// Worker thread: takes queued jobs until the pool stops
+static void *serve_worker(void *arg)
 {
-    xmlXPathContextPtr xpathCtx = xmlXPathNewContext(node->doc);
-    xmlXPathObjectPtr xpathObj = xmlXPathNodeEval(node, (xmlChar *)".//a", xpathCtx);
+    serve_worker_t *worker = arg;
+    serve_pool_t *pool = worker->pool;
 
-    if (xpathObj == NULL)
+    // Create this thread's libxml2 state now, outside any document arena
+    xmlResetLastError();
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;)
     {
-        xmlXPathFreeContext(xpathCtx);
-        return 0.0;
+        while (!pool->head && !pool->stopping)
+            pthread_cond_wait(&pool->wakeup, &pool->lock);
+        if (!pool->head)
+            break;
+
+        serve_job_t *job = pool->head;
+        pool->head = job->next;
+        if (!pool->head)
+            pool->tail = NULL;
+        pthread_mutex_unlock(&pool->lock);
+
+        serve_run_job(job, worker->ctx);
+
+        pthread_mutex_lock(&pool->lock);
+        job->next = pool->done;
+        pool->done = job;
+        // An eventfd only refuses a write when its counter is full, and then
+        // the loop has a wakeup pending already
+        uint64_t one = 1;
+        ssize_t signalled = write(pool->event_fd, &one, sizeof(one));
+        (void)signalled;
     }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
 
-    xmlNodeSetPtr nodes = xpathObj->nodesetval;
-    int link_length = 0, text_length = 0;
+// Function to start the worker threads, each with a context that shares
+// the patterns and the cache of ctx
+static int serve_pool_init(serve_pool_t *pool, int thread_count, int capacity, readability_context_t *ctx)
+{
+    memset(pool, 0, sizeof(*pool));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wakeup, NULL);
+    pool->capacity = capacity;
+    pool->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pool->workers = calloc((size_t)thread_count, sizeof(serve_worker_t));
+    if (pool->event_fd < 0 || !pool->workers)
+        return -1;
 
-    for (int i = 0; i < nodes->nodeNr; i++)
+    for (; pool->thread_count < thread_count; pool->thread_count++)
     {
-        xmlChar *link_text = xmlNodeGetContent(nodes->nodeTab[i]);
-        link_length += strlen((char *)link_text);
-        xmlFree(link_text);
+        serve_worker_t *worker = &pool->workers[pool->thread_count];
+        worker->pool = pool;
+        worker->ctx = new_context(ctx->matcher, 0, ctx->cache);
+        if (worker->ctx)
+        {
+            worker->ctx->limits = ctx->limits;
+            worker->ctx->fetch_options = ctx->fetch_options;
+            worker->ctx->templates = ctx->templates;
+            worker->ctx->check = ctx->check;
+            readability_context_set_trace(worker->ctx, ctx->trace_sink, ctx->trace_userdata);
+        }
+        if (!worker->ctx || pthread_create(&worker->thread, NULL, serve_worker, worker) != 0)
+        {
+            readability_context_free(worker->ctx);
+            return -1;
+        }
     }
+    return 0;
+}
 
-    xmlChar *node_text = xmlNodeGetContent(node);
-    text_length = strlen((char *)node_text);
-    xmlFree(node_text);
+// Function to count a new request against the pool's capacity before it is
+// queued or fetched; fails when the pool is at capacity
+static int serve_pool_reserve(serve_pool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    int reserved = pool->outstanding < pool->capacity;
+    if (reserved)
+        pool->outstanding++;
+    pthread_mutex_unlock(&pool->lock);
+    return reserved ? 0 : -1;
+}
 
-    double link_density = (text_length == 0) ? 0.0 : (double)link_length / text_length;
+// Function to give back a reservation that no job came of
+static void serve_pool_unreserve(serve_pool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->outstanding--;
+    pthread_mutex_unlock(&pool->lock);
+}
 
-    xmlXPathFreeObject(xpathObj);
-    xmlXPathFreeContext(xpathCtx);
-    return link_density;
+// Function to queue a job that holds a reservation
+static void serve_pool_enqueue(serve_pool_t *pool, serve_job_t *job)
+{
+    pthread_mutex_lock(&pool->lock);
+    job->next = NULL;
+    if (pool->tail)
+        pool->tail->next = job;
+    else
+        pool->head = job;
+    pool->tail = job;
+    pthread_cond_signal(&pool->wakeup);
+    pthread_mutex_unlock(&pool->lock);
 }
 
-// Function to get class weight of a node
-int get_class_weight(xmlNode *node)
+// Function to take every finished job off the pool
+static serve_job_t *serve_pool_take_done(serve_pool_t *pool)
 {
-    int weight = 0;
-    xmlChar *class = xmlGetProp(node, (xmlChar *)"class");
-    xmlChar *id = xmlGetProp(node, (xmlChar *)"id");
+    // The count only resets the eventfd; the done list says what finished
+    uint64_t count;
+    ssize_t drained = read(pool->event_fd, &count, sizeof(count));
+    (void)drained;
+
+    pthread_mutex_lock(&pool->lock);
+    serve_job_t *done = pool->done;
+    pool->done = NULL;
+    for (serve_job_t *job = done; job; job = job->next)
+        pool->outstanding--;
+    pthread_mutex_unlock(&pool->lock);
+    return done;
+}
+
+// Function to release a job
+static void free_serve_job(serve_job_t *job)
+{
+    if (job->doc)
+        free_document(job->doc);
+    if (job->cached)
+        cache_release(&job->hit);
+    free_fetch_response(&job->fetch);
+    free(job->url);
+    free(job->body);
+    strbuf_free(&job->response);
+    free(job);
+}
+
+// Callback that hands a page the event loop downloaded to the workers
+static void serve_fetch_done(const char *url, htmlDocPtr doc, fetch_response_t *response, const char *error,
+                             void *userdata)
+{
+    (void)url;
+    serve_job_t *job = userdata;
+    job->doc = doc;
+    job->error = error;
+    job->fetched = 1;
+    // The engine frees the response once this returns; the job keeps the
+    // validators
+    job->fetch = *response;
+    response->etag = NULL;
+    response->last_modified = NULL;
+    serve_pool_enqueue(job->pool, job);
+}
+
+// Function to queue a GET whose page the cache holds a fresh copy of, or
+// else start its download, conditional on any stale copy. Returns -1 when
+// the download cannot be queued.
+static int serve_queue_url(server_t *server, serve_job_t *job)
+{
+    readability_context_t *ctx = server->ctx;
+    job->cached = ctx->cache && ctx->check != READABILITY_CHECK_ONLY && cache_lookup(ctx->cache, job->url, &job->hit) == 0;
+    if (job->cached && cache_is_fresh(ctx->cache, &job->hit))
+    {
+        serve_pool_enqueue(&server->pool, job);
+        return 0;
+    }
+
+    if (fetch_engine_add(&server->fetches, job->url, job->cached ? job->hit.etag : NULL,
+                         job->cached ? job->hit.last_modified : NULL, job) == 0)
+        return 0;
+    if (job->cached)
+        cache_release(&job->hit);
+    job->cached = 0;
+    return -1;
+}
 
-    regex_t positive_regex, negative_regex;
-    regcomp(&positive_regex, "article|body|content|entry|hentry|h-entry|main|page|pagination|post|text|blog|story", REG_ICASE | REG_EXTENDED);
-    regcomp(&negative_regex, "hidden|^hid$| hid$| hid |^hid |banner|combx|comment|com-|contact|foot|footer|footnote|masthead|media|meta|outbrain|promo|related|scroll|share|shoutbox|sidebar|skyscraper|sponsor|shopping|tags|tool|widget|ad|advert|sponsor|promoted|recommended|paid|partnership", REG_ICASE | REG_EXTENDED);
+// Function to stop the workers, dropping jobs that have not started
+static void serve_pool_cleanup(serve_pool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    serve_job_t *queued = pool->head;
+    pool->head = pool->tail = NULL;
+    pthread_cond_broadcast(&pool->wakeup);
+    pthread_mutex_unlock(&pool->lock);
 
-    if (class)
+    for (int i = 0; i < pool->thread_count; i++)
     {
-        if (regexec(&negative_regex, (char *)class, 0, NULL, 0) == 0)
-            weight -= 25;
-        if (regexec(&positive_regex, (char *)class, 0, NULL, 0) == 0)
-            weight += 25;
+        pthread_join(pool->workers[i].thread, NULL);
+        readability_context_free(pool->workers[i].ctx);
     }
 
-    if (id)
+    serve_job_t *lists[2] = {queued, pool->done};
+    for (int i = 0; i < 2; i++)
     {
-        if (regexec(&negative_regex, (char *)id, 0, NULL, 0) == 0)
-            weight -= 25;
-        if (regexec(&positive_regex, (char *)id, 0, NULL, 0) == 0)
-            weight += 25;
+        serve_job_t *job = lists[i];
+        while (job)
+        {
+            serve_job_t *next = job->next;
+            free_serve_job(job);
+            job = next;
+        }
     }
+    if (pool->event_fd >= 0)
+        close(pool->event_fd);
+    free(pool->workers);
+    pthread_cond_destroy(&pool->wakeup);
+    pthread_mutex_destroy(&pool->lock);
+}
 
-    regfree(&positive_regex);
-    regfree(&negative_regex);
+// Function to open the listening socket: "unix:<path>" for a Unix socket,
+// otherwise "[host:]port" for TCP. Returns the socket, or -1 with the
+// error of ctx set.
+static int serve_listen(readability_context_t *ctx, const char *address)
+{
+    int fd;
+    if (strncmp(address, "unix:", 5) == 0)
+    {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(address + 5) >= sizeof(addr.sun_path))
+        {
+            set_error(ctx, "socket path too long: %s", address + 5);
+            return -1;
+        }
+        strcpy(addr.sun_path, address + 5);
+        unlink(addr.sun_path);
 
-    xmlFree(class);
-    xmlFree(id);
-    return weight;
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        {
+            set_error(ctx, "unable to bind %s: %s", address, strerror(errno));
+            if (fd >= 0)
+                close(fd);
+            return -1;
+        }
+    }
+    else
+    {
+        char host[256] = "";
+        const char *port = strrchr(address, ':');
+        if (port)
+        {
+            size_t length = (size_t)(port - address);
+            if (length >= sizeof(host))
+                length = sizeof(host) - 1;
+            memcpy(host, address, length);
+            host[length] = '\0';
+            port++;
+        }
+        else
+        {
+            port = address;
+        }
+
+        struct addrinfo hints, *result;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        int rc = getaddrinfo(host[0] ? host : NULL, port, &hints, &result);
+        if (rc != 0)
+        {
+            set_error(ctx, "unable to resolve %s: %s", address, gai_strerror(rc));
+            return -1;
+        }
+
+        fd = -1;
+        for (struct addrinfo *ai = result; ai; ai = ai->ai_next)
+        {
+            fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+            if (fd < 0)
+                continue;
+            int on = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+                break;
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(result);
+        if (fd < 0)
+        {
+            set_error(ctx, "unable to bind %s: %s", address, strerror(errno));
+            return -1;
+        }
+    }
+
+    if (listen(fd, SOMAXCONN) < 0)
+    {
+        set_error(ctx, "unable to listen on %s: %s", address, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
 }
 
-// Function to initialize a node with content score
-candidate_t *initialize_node(xmlNode *node)
+// Function to watch a connection for the events its state calls for: input
+// only while no request is in progress, output while a response is pending
+static void serve_watch(server_t *server, serve_conn_t *conn, int op)
 {
-    candidate_t *candidate = malloc(sizeof(candidate_t));
-    candidate->node = node;
-    candidate->content_score = 0;
+    struct epoll_event event;
+    event.events = (conn->busy || conn->eof ? 0 : EPOLLIN) | (conn->output_sent < conn->output.length ? EPOLLOUT : 0);
+    event.data.ptr = conn;
+    epoll_ctl(server->epoll_fd, op, conn->fd, &event);
+}
+
+// Function to move a connection that nothing refers to any more from the
+// live list to the graveyard
+static void serve_retire(server_t *server, serve_conn_t *conn)
+{
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        server->connections = conn->next;
+    if (conn->next)
+        conn->next->prev = conn->prev;
+    conn->prev = NULL;
+    conn->next = server->graveyard;
+    server->graveyard = conn;
+}
+
+// Function to free a list of connections
+static void free_serve_conns(serve_conn_t *conn)
+{
+    while (conn)
+    {
+        serve_conn_t *next = conn->next;
+        if (conn->fd >= 0)
+            close(conn->fd);
+        strbuf_free(&conn->input);
+        strbuf_free(&conn->output);
+        free(conn);
+        conn = next;
+    }
+}
+
+// Function to close a connection; one whose request is still with the pool
+// is retired when the job comes back
+static void serve_close(server_t *server, serve_conn_t *conn)
+{
+    if (conn->closed)
+        return;
+    close(conn->fd);
+    conn->fd = -1;
+    conn->closed = 1;
+    if (!conn->busy)
+        serve_retire(server, conn);
+}
+
+// Function to find a header value in a request head; returns its length
+static size_t http_header(const char *head, size_t head_length, const char *name, const char **value)
+{
+    size_t name_length = strlen(name);
+    const char *end = head + head_length;
+    const char *line = memchr(head, '\n', head_length);
+    while (line && ++line < end)
+    {
+        const char *eol = memchr(line, '\n', (size_t)(end - line));
+        if (!eol)
+            break;
+        if ((size_t)(eol - line) > name_length && strncasecmp(line, name, name_length) == 0 && line[name_length] == ':')
+        {
+            const char *start = line + name_length + 1;
+            while (start < eol && (*start == ' ' || *start == '\t'))
+                start++;
+            const char *stop = eol;
+            while (stop > start && isspace((unsigned char)stop[-1]))
+                stop--;
+            *value = start;
+            return (size_t)(stop - start);
+        }
+        line = eol;
+    }
+    *value = NULL;
+    return 0;
+}
+
+// Function to answer a request that cannot be served with Connection:
+// close and stop reading from the connection, whose remaining input cannot
+// be trusted; it is closed once the answer is written
+static int serve_reject(serve_conn_t *conn, int status, const char *error)
+{
+    serve_append_error(&conn->output, status, NULL, error, 0);
+    conn->keep_alive = 0;
+    conn->input.length = 0;
+    return 0;
+}
+
+// Function to parse one buffered request and either answer it directly,
+// hand it to the pool, or start the download the pool will extract.
+// Returns 0 when the request was dealt with and 1 when more input is needed.
+static int serve_take_request(server_t *server, serve_conn_t *conn)
+{
+    char *data = conn->input.data;
+    size_t length = conn->input.length;
+    char *head_end = memmem(data, length, "\r\n\r\n", 4);
+    if (!head_end)
+        return length > SERVE_MAX_HEADER ? serve_reject(conn, 431, "request header too large") : 1;
+    size_t head_length = (size_t)(head_end - data) + 2;
+    if (head_length > SERVE_MAX_HEADER)
+        return serve_reject(conn, 431, "request header too large");
+
+    // Request line: METHOD SP target SP HTTP/1.x
+    char method[8], target[4096], version[16];
+    const char *target_start = memchr(data, ' ', head_length);
+    size_t target_length = target_start ? strcspn(target_start + 1, " \r\n") : 0;
+    if (target_length >= sizeof(target))
+        return serve_reject(conn, 414, "request target too long");
+    if (sscanf(data, "%7s %4095s %15s", method, target, version) != 3 || strncmp(version, "HTTP/1.", 7) != 0)
+        return serve_reject(conn, 400, "malformed request");
+
+    const char *value;
+    size_t value_length = http_header(data, head_length, "Connection", &value);
+    int keep_alive = strcmp(version, "HTTP/1.0") != 0;
+    if (value_length == 5 && strncasecmp(value, "close", 5) == 0)
+        keep_alive = 0;
+    else if (value_length == 10 && strncasecmp(value, "keep-alive", 10) == 0)
+        keep_alive = 1;
+
+    if (http_header(data, head_length, "Transfer-Encoding", &value) > 0)
+        return serve_reject(conn, 411, "chunked request bodies are not supported");
+
+    size_t body_size = 0;
+    value_length = http_header(data, head_length, "Content-Length", &value);
+    if (value_length > 0)
+    {
+        char *end;
+        unsigned long long declared = strtoull(value, &end, 10);
+        if (end != value + value_length || !isdigit((unsigned char)*value))
+            return serve_reject(conn, 400, "invalid Content-Length");
+        if (declared > SERVE_MAX_BODY)
+            return serve_reject(conn, 413, "request body too large");
+        body_size = (size_t)declared;
+    }
+
+    size_t total = head_length + 2 + body_size;
+    if (length < total)
+    {
+        // Clients that wait for permission before sending a body get it once
+        if (!conn->continued && http_header(data, head_length, "Expect", &value) == 12 &&
+            strncasecmp(value, "100-continue", 12) == 0)
+        {
+            strbuf_puts(&conn->output, "HTTP/1.1 100 Continue\r\n\r\n");
+            conn->continued = 1;
+        }
+        return 1;
+    }
+
+    // Only /extract, with an optional url query parameter, and /metrics are
+    // served
+    char *query = strchr(target, '?');
+    if (query)
+        *query++ = '\0';
+    char *url = NULL;
+    for (char *param = query; param && *param;)
+    {
+        char *next = strchr(param, '&');
+        if (next)
+            *next++ = '\0';
+        if (strncmp(param, "url=", 4) == 0)
+        {
+            url = param + 4;
+            url_decode(url);
+        }
+        param = next;
+    }
 
-    if (xmlStrcasecmp(node->name, (const xmlChar *)"div") == 0)
+    int is_get = strcmp(method, "GET") == 0;
+    int is_post = strcmp(method, "POST") == 0;
+    int is_metrics = is_get && strcmp(target, "/metrics") == 0;
+    int status = 0;
+    const char *error = NULL;
+    if (is_metrics)
     {
-        candidate->content_score += 5;
+        // Answered from the event loop: summing the metrics takes no longer
+        // than queueing the request would
+        strbuf_t body = {0};
+        append_metrics(&body, READABILITY_METRICS_PROMETHEUS);
+        serve_append_response(&conn->output, 200, SERVE_PROMETHEUS, body.data ? body.data : "", body.length,
+                              keep_alive);
+        strbuf_free(&body);
     }
-    else if (xmlStrcasecmp(node->name, (const xmlChar *)"pre") == 0 ||
-             xmlStrcasecmp(node->name, (const xmlChar *)"td") == 0 ||
-             xmlStrcasecmp(node->name, (const xmlChar *)"blockquote") == 0)
+    else if (strcmp(target, "/extract") != 0)
     {
-        candidate->content_score += 3;
+        status = 404;
+        error = "unknown path";
     }
-    else if (xmlStrcasecmp(node->name, (const xmlChar *)"address") == 0 ||
-             xmlStrcasecmp(node->name, (const xmlChar *)"ol") == 0 ||
-             xmlStrcasecmp(node->name, (const xmlChar *)"ul") == 0 ||
-             xmlStrcasecmp(node->name, (const xmlChar *)"dl") == 0 ||
-             xmlStrcasecmp(node->name, (const xmlChar *)"dd") == 0 ||
-             xmlStrcasecmp(node->name, (const xmlChar *)"dt") == 0 ||
-             xmlStrcasecmp(node->name, (const xmlChar *)"li") == 0 ||
-             xmlStrcasecmp(node->name, (const xmlChar *)"form") == 0)
+    else if (!is_get && !is_post)
     {
-        candidate->content_score -= 3;
+        status = 405;
+        error = "method not allowed";
     }
-    else if (xmlStrcasecmp(node->name, (const xmlChar *)"h1") == 0 ||
-             xmlStrcasecmp(node->name, (const xmlChar *)"h2") == 0 ||
-             xmlStrcasecmp(node->name, (const xmlChar *)"h3") == 0 ||
-             xmlStrcasecmp(node->name, (const xmlChar *)"h4") == 0 ||
-             xmlStrcasecmp(node->name, (const xmlChar *)"h5") == 0 ||
-             xmlStrcasecmp(node->name, (const xmlChar *)"h6") == 0 ||
-             xmlStrcasecmp(node->name, (const xmlChar *)"th") == 0)
+    else if (is_post ? body_size == 0 : (!url || !readability_is_url(url)))
     {
-        candidate->content_score -= 5;
+        status = 400;
+        error = is_post ? "empty request body" : "missing or invalid url parameter";
     }
 
-    return candidate;
-}
-
-// Function to extract the title
-char *get_article_title(xmlDocPtr doc)
-{
-    xmlChar *title = NULL;
-    xmlNode *root = xmlDocGetRootElement(doc);
-    if (root)
+    if (!status && !is_metrics)
     {
-        xmlNode *head = root->children;
-        while (head)
+        serve_job_t *job = calloc(1, sizeof(serve_job_t));
+        if (job && url)
+            job->url = strdup(url);
+        if (job && is_post)
         {
-            if (xmlStrcasecmp(head->name, (const xmlChar *)"head") == 0)
+            job->body = malloc(body_size);
+            if (job->body)
             {
-                xmlNode *child = head->children;
-                while (child)
-                {
-                    if (xmlStrcasecmp(child->name, (const xmlChar *)"title") == 0)
-                    {
-                        title = xmlNodeGetContent(child);
-                        break;
-                    }
-                    child = child->next;
-                }
+                memcpy(job->body, data + head_length + 2, body_size);
+                job->body_size = body_size;
             }
-            if (title)
-                break;
-            head = head->next;
         }
-    }
-    return (char *)title;
-}
 
-// Function to extract metadata
-char *get_metadata(xmlDocPtr doc, const char *property)
-{
-    xmlXPathContextPtr xpathCtx = xmlXPathNewContext(doc);
-    char xpath[MAX_BUFFER];
-    snprintf(xpath, sizeof(xpath), "//meta[@property='%s']/@content", property);
-    xmlXPathObjectPtr xpathObj = xmlXPathEvalExpression((xmlChar *)xpath, xpathCtx);
-
-    char *result = NULL;
-    if (xpathObj && xpathObj->nodesetval && xpathObj->nodesetval->nodeNr > 0)
-    {
-        xmlNodePtr node = xpathObj->nodesetval->nodeTab[0];
-        result = (char *)xmlNodeGetContent(node);
+        if (!job || (url && !job->url) || (is_post && !job->body))
+        {
+            status = 500;
+            error = "out of memory";
+        }
+        else if (serve_pool_reserve(&server->pool) < 0)
+        {
+            status = 503;
+            error = "server busy";
+        }
+        else
+        {
+            job->pool = &server->pool;
+            job->conn = conn;
+            job->keep_alive = keep_alive;
+            if (is_post)
+            {
+                serve_pool_enqueue(&server->pool, job);
+            }
+            else if (serve_queue_url(server, job) < 0)
+            {
+                serve_pool_unreserve(&server->pool);
+                status = 500;
+                error = "unable to queue URL";
+            }
+            if (!status)
+            {
+                conn->busy = 1;
+                job = NULL;
+            }
+        }
+        if (job)
+            free_serve_job(job);
     }
 
-    xmlXPathFreeObject(xpathObj);
-    xmlXPathFreeContext(xpathCtx);
-    return result;
+    if (status)
+        serve_append_error(&conn->output, status, url, error, keep_alive);
+    conn->keep_alive = keep_alive;
+    conn->continued = 0;
+
+    memmove(data, data + total, length - total);
+    conn->input.length = length - total;
+    data[conn->input.length] = '\0';
+    return 0;
 }
 
-// Helper function to count occurrences of a substring
-int xmlStrCount(const xmlChar *str, const xmlChar *substr) {
-    int count = 0;
-    const xmlChar *tmp = str;
-    while((tmp = xmlStrstr(tmp, substr))) {
-        count++;
-        tmp++;
+// Function to send pending output. Returns -1 on a write error.
+static int serve_flush(serve_conn_t *conn)
+{
+    while (conn->output_sent < conn->output.length)
+    {
+        ssize_t sent = send(conn->fd, conn->output.data + conn->output_sent, conn->output.length - conn->output_sent, MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        conn->output_sent += (size_t)sent;
     }
-    return count;
+    conn->output.length = 0;
+    conn->output_sent = 0;
+    return 0;
 }
 
-// extract_article_content function
-void extract_article_content(xmlNode *body, xmlNode **article_content)
+// Function to answer buffered requests until one needs the pool, send what
+// is ready, and then either close the connection or update its event mask
+static void serve_progress(server_t *server, serve_conn_t *conn)
 {
-    xmlXPathContextPtr xpathCtx = xmlXPathNewContext(body->doc);
-    xmlXPathObjectPtr xpathObj = xmlXPathNodeEval(body, (xmlChar *)"//body//p|//body//td|//body//pre", xpathCtx);
+    while (!conn->busy && conn->keep_alive && conn->input.length > 0)
+    {
+        if (serve_take_request(server, conn) != 0)
+            break;
+    }
 
-    if (xpathObj == NULL)
+    if (serve_flush(conn) < 0)
     {
-        xmlXPathFreeContext(xpathCtx);
+        serve_close(server, conn);
         return;
     }
 
-    xmlNodeSetPtr nodes = xpathObj->nodesetval;
-    int size = (nodes) ? nodes->nodeNr : 0;
-    candidate_t *top_candidate = NULL;
-    candidate_t *candidates[MAX_CANDIDATES];
-    int candidate_count = 0;
+    // Once everything is answered, a connection that asked to close or
+    // that can send nothing more is done
+    int idle = !conn->busy && conn->output.length == 0;
+    if (idle && (!conn->keep_alive || conn->eof))
+    {
+        serve_close(server, conn);
+        return;
+    }
+    serve_watch(server, conn, EPOLL_CTL_MOD);
+}
 
-    for (int i = 0; i < size; i++)
+// Function to read what a connection has sent, up to the end of the stream
+// or until it would block
+static void serve_read(serve_conn_t *conn)
+{
+    for (;;)
     {
-        xmlNode *elem = nodes->nodeTab[i];
-        xmlChar *content = xmlNodeGetContent(elem);
-        if (xmlStrlen(content) < 25)
+        if (conn->input.length > SERVE_MAX_HEADER + SERVE_MAX_BODY || strbuf_reserve(&conn->input, 16384) < 0)
         {
-            xmlFree(content);
-            continue;
+            conn->eof = 1;
+            return;
         }
 
-        xmlNode *parent_node = elem->parent;
-        xmlNode *grand_parent_node = parent_node ? parent_node->parent : NULL;
-
-        if (!parent_node || !grand_parent_node)
+        ssize_t received = recv(conn->fd, conn->input.data + conn->input.length, conn->input.capacity - conn->input.length - 1, 0);
+        if (received > 0)
         {
-            xmlFree(content);
+            conn->input.length += (size_t)received;
+            conn->input.data[conn->input.length] = '\0';
             continue;
         }
+        if (received < 0 && errno == EINTR)
+            continue;
+        if (received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            conn->eof = 1;
+        return;
+    }
+}
 
-        candidate_t *parent_candidate = NULL;
-        candidate_t *grand_parent_candidate = NULL;
+// Function to accept every pending connection
+static void serve_accept(server_t *server)
+{
+    for (;;)
+    {
+        int fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        // Failures other than running out of pending connections, such as
+        // a connection reset before it was accepted, only lose that client
+        if (fd < 0)
+            return;
 
-        for (int j = 0; j < candidate_count; j++)
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        serve_conn_t *conn = calloc(1, sizeof(serve_conn_t));
+        if (!conn)
         {
-            if (candidates[j]->node == parent_node)
-            {
-                parent_candidate = candidates[j];
-            }
-            if (candidates[j]->node == grand_parent_node)
-            {
-                grand_parent_candidate = candidates[j];
-            }
+            close(fd);
+            continue;
         }
+        conn->fd = fd;
+        conn->keep_alive = 1;
+        conn->next = server->connections;
+        if (conn->next)
+            conn->next->prev = conn;
+        server->connections = conn;
+        serve_watch(server, conn, EPOLL_CTL_ADD);
+    }
+}
 
-        if (!parent_candidate && candidate_count < MAX_CANDIDATES)
+// Function to hand finished jobs back to their connections
+static void serve_deliver(server_t *server)
+{
+    serve_job_t *job = serve_pool_take_done(&server->pool);
+    while (job)
+    {
+        serve_job_t *next = job->next;
+        serve_conn_t *conn = job->conn;
+        conn->busy = 0;
+        if (conn->closed)
         {
-            parent_candidate = initialize_node(parent_node);
-            candidates[candidate_count++] = parent_candidate;
+            serve_retire(server, conn);
         }
-        if (!grand_parent_candidate && candidate_count < MAX_CANDIDATES)
+        else
         {
-            grand_parent_candidate = initialize_node(grand_parent_node);
-            candidates[candidate_count++] = grand_parent_candidate;
+            strbuf_append(&conn->output, job->response.data, job->response.length);
+            serve_progress(server, conn);
         }
+        free_serve_job(job);
+        job = next;
+    }
+}
 
-        if (parent_candidate && grand_parent_candidate)
-        {
-            int content_score = 1;
-            content_score += xmlStrlen(content) / 100;
-            content_score += xmlStrCount(content, (xmlChar *)",") * 3;
+// Function to run the extraction server until SIGINT or SIGTERM. Requests:
+//   GET  /extract?url=<url>   fetch and extract a page, through cache if any
+//   POST /extract[?url=<url>] extract the HTML in the body, resolving links
+//                             against url
+// Each answer is the JSON document of -json mode. Once queue_size requests
+// are outstanding, new ones are answered 503 straight away. Pages are
+// downloaded by the event loop, so a slow origin server holds no worker.
+int readability_serve(readability_context_t *ctx, const char *address, int worker_count, int queue_size)
+{
+    server_t server;
+    memset(&server, 0, sizeof(server));
+    server.ctx = ctx;
+    server.listen_fd = serve_listen(ctx, address);
+    if (server.listen_fd < 0)
+        return 1;
 
-            parent_candidate->content_score += content_score;
-            grand_parent_candidate->content_score += content_score / 2.0;
+    server.epoll_fd = -1;
+    if (serve_pool_init(&server.pool, worker_count, queue_size, ctx) < 0 ||
+        (server.epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+        fetch_engine_init(&server.fetches, queue_size, SERVE_MAX_FETCHES_PER_HOST, serve_fetch_done) < 0)
+    {
+        set_error(ctx, "unable to start server: %s", strerror(errno));
+        fetch_engine_cleanup(&server.fetches);
+        serve_pool_cleanup(&server.pool);
+        if (server.epoll_fd >= 0)
+            close(server.epoll_fd);
+        close(server.listen_fd);
+        return 1;
+    }
 
-            if (xmlStrcasecmp(elem->name, (xmlChar *)"p") == 0)
-            {
-                parent_candidate->content_score += 5;
-                grand_parent_candidate->content_score += 3;
-            }
-        }
+    // The listener and the completion eventfd are told apart by their
+    // pointers; every other event belongs to a connection
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = &server.listen_fd;
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.listen_fd, &event);
+    event.data.ptr = &server.pool;
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.pool.event_fd, &event);
+    server.fetches.max_bytes = ctx->limits.max_input_bytes;
+    server.fetches.options = &ctx->fetch_options;
 
-        xmlFree(content);
-    }
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = serve_request_stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
 
-    for (int i = 0; i < candidate_count; i++)
+    int status = 0;
+    struct epoll_event events[SERVE_MAX_EVENTS];
+    while (!serve_stop_requested)
     {
-        candidates[i]->content_score *= (1 - get_link_density(candidates[i]->node));
-        candidates[i]->content_score += get_class_weight(candidates[i]->node);
-        if (!top_candidate || candidates[i]->content_score > top_candidate->content_score)
+        // While downloads are in flight, their sockets and the epoll
+        // descriptor are waited on together, so whichever is ready first
+        // ends the wait; the events are then collected without blocking
+        int timeout = -1;
+        if (server.fetches.active + server.fetches.pending > 0)
         {
-            top_candidate = candidates[i];
+            fetch_engine_poll(&server.fetches, SERVE_FETCH_POLL_MS, server.epoll_fd);
+            timeout = 0;
         }
-    }
 
-    if (!top_candidate)
-    {
-        xmlXPathFreeObject(xpathObj);
-        xmlXPathFreeContext(xpathCtx);
-        for (int i = 0; i < candidate_count; i++)
+        int count = epoll_wait(server.epoll_fd, events, SERVE_MAX_EVENTS, timeout);
+        if (count < 0)
         {
-            free(candidates[i]);
+            if (errno == EINTR)
+                continue;
+            set_error(ctx, "epoll_wait failed: %s", strerror(errno));
+            status = 1;
+            break;
         }
-        return;
-    }
 
-    *article_content = xmlNewNode(NULL, (xmlChar *)"div");
-    xmlNode *sibling = top_candidate->node->parent->children;
-    while (sibling)
-    {
-        if (sibling->type == XML_ELEMENT_NODE)
+        for (int i = 0; i < count; i++)
         {
-            int append = 0;
-            candidate_t *sibling_candidate = NULL;
-
-            for (int i = 0; i < candidate_count; i++)
-            {
-                if (candidates[i]->node == sibling)
-                {
-                    sibling_candidate = candidates[i];
-                    break;
-                }
-            }
-
-            if (sibling == top_candidate->node)
-            {
-                append = 1;
-            }
-            else if (sibling_candidate && sibling_candidate->content_score >= top_candidate->content_score * 0.2)
+            if (events[i].data.ptr == &server.listen_fd)
             {
-                append = 1;
+                serve_accept(&server);
+                continue;
             }
-            else if (xmlStrcasecmp(sibling->name, (const xmlChar *)"p") == 0)
+            if (events[i].data.ptr == &server.pool)
             {
-                double link_density = get_link_density(sibling);
-                xmlChar *node_text = xmlNodeGetContent(sibling);
-                int text_length = xmlStrlen(node_text);
-                xmlFree(node_text);
-
-                if (text_length > 80 && link_density < 0.25)
-                {
-                    append = 1;
-                }
-                else if (text_length < 80 && link_density == 0 && xmlStrstr(node_text, (xmlChar *)"."))
-                {
-                    append = 1;
-                }
+                serve_deliver(&server);
+                continue;
             }
 
-            if (append)
+            serve_conn_t *conn = events[i].data.ptr;
+            if (conn->closed)
+                continue;
+            if (events[i].events & (EPOLLERR | EPOLLHUP))
             {
-                xmlNode *node_to_append = xmlCopyNode(sibling, 1);
-                xmlAddChild(*article_content, node_to_append);
+                serve_close(&server, conn);
+                continue;
             }
+            if (events[i].events & EPOLLIN)
+                serve_read(conn);
+            serve_progress(&server, conn);
         }
-        sibling = sibling->next;
-    }
 
-    xmlXPathFreeObject(xpathObj);
-    xmlXPathFreeContext(xpathCtx);
-    for (int i = 0; i < candidate_count; i++)
-    {
-        free(candidates[i]);
+        free_serve_conns(server.graveyard);
+        server.graveyard = NULL;
     }
+
+    // Cancelled downloads go to the pool, which drops them with its queue
+    fetch_engine_cleanup(&server.fetches);
+    serve_pool_cleanup(&server.pool);
+    free_serve_conns(server.connections);
+    free_serve_conns(server.graveyard);
+    close(server.epoll_fd);
+    close(server.listen_fd);
+    if (strncmp(address, "unix:", 5) == 0)
+        unlink(address + 5);
+    return status;
+}
+
+// Stages timed by the benchmark harness
+enum
+{
+    STAGE_PARSE,
+    STAGE_CLEANUP,
+    STAGE_EXTRACT,
+    STAGE_RENDER,
+    STAGE_TOTAL,
+    STAGE_COUNT
+};
+
+static const char *stage_names[STAGE_COUNT] = {"parse", "cleanup", "extract", "render", "total"};
+
+// Comparison function for sorting timings
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Comparison function for sorting file names
+static int compare_strings(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Function to pick a nearest-rank percentile from sorted samples
+static double percentile(const double *sorted, int count, double p)
+{
+    if (count == 0)
+        return 0.0;
+    int rank = (int)(p / 100.0 * count + 0.999999);
+    if (rank < 1)
+        rank = 1;
+    if (rank > count)
+        rank = count;
+    return sorted[rank - 1];
 }
 
-// Function to convert HTML to Markdown-like text
-void html_to_markdown(xmlNode *node, FILE *output_file, int depth)
+// Function to list the regular files of a directory, sorted by name
+static char **list_corpus(const char *dir_path, int *count)
 {
-    xmlNode *current_node = NULL;
-    for (current_node = node; current_node; current_node = current_node->next)
+    DIR *dir = opendir(dir_path);
+    if (!dir)
+        return NULL;
+
+    char **paths = NULL;
+    int capacity = 0;
+    *count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)))
     {
-        if (current_node->type == XML_ELEMENT_NODE)
-        {
-            if (xmlStrcasecmp(current_node->name, (const xmlChar *)"p") == 0)
-            {
-                fprintf(output_file, "\n");
-            }
-            else if (xmlStrcasecmp(current_node->name, (const xmlChar *)"br") == 0)
-            {
-                fprintf(output_file, "\n");
-            }
-            else if (xmlStrcasecmp(current_node->name, (const xmlChar *)"h1") == 0)
-            {
-                fprintf(output_file, "\n# ");
-            }
-            else if (xmlStrcasecmp(current_node->name, (const xmlChar *)"h2") == 0)
-            {
-                fprintf(output_file, "\n## ");
-            }
-            else if (xmlStrcasecmp(current_node->name, (const xmlChar *)"h3") == 0)
-            {
-                fprintf(output_file, "\n### ");
-            }
-            else if (xmlStrcasecmp(current_node->name, (const xmlChar *)"h4") == 0)
-            {
-                fprintf(output_file, "\n#### ");
-            }
-            else if (xmlStrcasecmp(current_node->name, (const xmlChar *)"h5") == 0)
-            {
-                fprintf(output_file, "\n##### ");
-            }
-            else if (xmlStrcasecmp(current_node->name, (const xmlChar *)"h6") == 0)
-            {
-                fprintf(output_file, "\n###### ");
-            }
-            else if (xmlStrcasecmp(current_node->name, (const xmlChar *)"a") == 0)
-            {
-                xmlChar *href = xmlGetProp(current_node, (const xmlChar *)"href");
-                if (href)
-                {
-                    fprintf(output_file, "[");
-                    html_to_markdown(current_node->children, output_file, depth + 1);
-                    fprintf(output_file, "](%s)", href);
-                    xmlFree(href);
-                    continue;
-                }
-            }
-            else if (xmlStrcasecmp(current_node->name, (const xmlChar *)"ul") == 0 ||
-                     xmlStrcasecmp(current_node->name, (const xmlChar *)"ol") == 0)
-            {
-                html_to_markdown(current_node->children, output_file, depth + 1);
-                fprintf(output_file, "\n");
-                continue;
-            }
-            else if (xmlStrcasecmp(current_node->name, (const xmlChar *)"li") == 0)
-            {
-                fprintf(output_file, "\n%*s- ", depth * 2, "");
-            }
-            else if (xmlStrcasecmp(current_node->name, (const xmlChar *)"strong") == 0 ||
-                     xmlStrcasecmp(current_node->name, (const xmlChar *)"b") == 0)
-            {
-                fprintf(output_file, "**");
-                html_to_markdown(current_node->children, output_file, depth + 1);
-                fprintf(output_file, "**");
-                continue;
-            }
-            else if (xmlStrcasecmp(current_node->name, (const xmlChar *)"em") == 0 ||
-                     xmlStrcasecmp(current_node->name, (const xmlChar *)"i") == 0)
-            {
-                fprintf(output_file, "*");
-                html_to_markdown(current_node->children, output_file, depth + 1);
-                fprintf(output_file, "*");
-                continue;
-            }
+        if (entry->d_name[0] == '.')
+            continue;
 
-            html_to_markdown(current_node->children, output_file, depth + 1);
+        size_t length = strlen(dir_path) + strlen(entry->d_name) + 2;
+        char *path = malloc(length);
+        if (!path)
+            break;
+        snprintf(path, length, "%s/%s", dir_path, entry->d_name);
 
-            if (xmlStrcasecmp(current_node->name, (const xmlChar *)"p") == 0)
-            {
-                fprintf(output_file, "\n");
-            }
+        struct stat st;
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+        {
+            free(path);
+            continue;
         }
-        else if (current_node->type == XML_TEXT_NODE)
+
+        if (*count == capacity)
         {
-            xmlChar *content = xmlNodeGetContent(current_node);
-            if (content)
+            capacity = capacity ? capacity * 2 : 64;
+            char **grown = realloc(paths, (size_t)capacity * sizeof(char *));
+            if (!grown)
             {
-                clean_whitespace(content);
-                fprintf(output_file, "%s", content);
-                xmlFree(content);
+                free(path);
+                break;
             }
+            paths = grown;
         }
+        paths[(*count)++] = path;
     }
+    closedir(dir);
+
+    if (paths)
+        qsort(paths, (size_t)*count, sizeof(char *), compare_strings);
+    return paths;
 }
 
-// Function to extract metadata and article content, and print to console or JSON
-void extract_article(xmlDocPtr doc, const char *url, int json_output)
+// Function to time a text kernel set over the corpus, iterations times, and
+// check what it produces against the scalar reference. Returns the number
+// of documents for which they differ.
+static int bench_text_kernels(const text_kernels_t *kernels, const input_buffer_t *inputs, int count, int iterations,
+                              double *whitespace_mbps, double *escape_mbps)
 {
-    char *title = get_article_title(doc);
-    char *author = get_metadata(doc, "og:author");
-    char *description = get_metadata(doc, "og:description");
-    char *site_name = get_metadata(doc, "og:site_name");
-    char *published_time = get_metadata(doc, "article:published_time");
+    const text_kernels_t *reference = &text_kernel_table[0];
+    strbuf_t expected = {0}, actual = {0};
+    double whitespace_seconds = 0.0, escape_seconds = 0.0;
+    size_t bytes = 0;
+    int mismatches = 0;
 
-    if (json_output)
-    {
-        printf("{\n");
-        printf("  \"title\": \"%s\",\n", title ? title : "");
-        printf("  \"url\": \"%s\",\n", url);
-        printf("  \"publishedTime\": \"%s\",\n", published_time ? published_time : "");
-        printf("  \"content\": \"");
-    }
-    else
+    for (int i = 0; i < count; i++)
     {
-        if (title) printf("Title: %s\n\n", title);
-        if (author) printf("Author: %s\n\n", author);
-        if (description) printf("Description: %s\n\n", description);
-        if (site_name) printf("Site Name: %s\n\n", site_name);
-        printf("URL Source: %s\n\n", url);
-        if (published_time) printf("Published Time: %s\n\n", published_time);
-        printf("Markdown Content:\n");
+        const unsigned char *data = (const unsigned char *)inputs[i].data;
+        size_t size = inputs[i].size;
+        expected.length = actual.length = 0;
+        if (strbuf_reserve(&expected, size) < 0 || strbuf_reserve(&actual, size) < 0)
+            break;
+
+        size_t expected_length = reference->collapse_whitespace(expected.data, data, size);
+        size_t actual_length = 0;
+        double started = now_seconds();
+        for (int n = 0; n < iterations; n++)
+            actual_length = kernels->collapse_whitespace(actual.data, data, size);
+        whitespace_seconds += now_seconds() - started;
+        int differs = actual_length != expected_length || memcmp(actual.data, expected.data, actual_length) != 0;
+
+        strbuf_append_json_using(&expected, inputs[i].data, size, reference);
+        started = now_seconds();
+        for (int n = 0; n < iterations; n++)
+        {
+            actual.length = 0;
+            strbuf_append_json_using(&actual, inputs[i].data, size, kernels);
+        }
+        escape_seconds += now_seconds() - started;
+        differs |= actual.length != expected.length || memcmp(actual.data, expected.data, actual.length) != 0;
+
+        mismatches += differs;
+        bytes += size;
     }
 
-    xmlNode *body = xmlDocGetRootElement(doc);
-    if (body)
+    double processed_mb = (double)bytes * iterations / (1024.0 * 1024.0);
+    *whitespace_mbps = whitespace_seconds > 0 ? processed_mb / whitespace_seconds : 0.0;
+    *escape_mbps = escape_seconds > 0 ? processed_mb / escape_seconds : 0.0;
+    strbuf_free(&expected);
+    strbuf_free(&actual);
+    return mismatches;
+}
+
+// Inputs of the kernel tests are one or two vector blocks long, give or take
+// a byte, and hold letters with whitespace or a byte to escape placed in them
+static const size_t kernel_test_lengths[] = {15, 16, 17, 31, 32, 33};
+static const unsigned char kernel_test_spaces[] = {' ', '\t', '\n', '\r', '\f', '\v'};
+static const unsigned char kernel_test_bytes[] = {'"', '\\', 0x00, 0x01, '\n', 0x1f, ' ', 0x7f, 0x80, 0xff};
+
+#define KERNEL_TEST_MAX_RUN 4
+
+// Function to compare a kernel set with the scalar reference on one input,
+// collapsed and escaped. Returns 1 when they differ.
+static int kernel_case_differs(const text_kernels_t *kernels, const unsigned char *input, size_t length,
+                               strbuf_t *expected, strbuf_t *actual)
+{
+    const text_kernels_t *reference = &text_kernel_table[0];
+    expected->length = actual->length = 0;
+    if (strbuf_reserve(expected, length) < 0 || strbuf_reserve(actual, length) < 0)
+        return 1;
+    size_t expected_length = reference->collapse_whitespace(expected->data, input, length);
+    size_t actual_length = kernels->collapse_whitespace(actual->data, input, length);
+    if (actual_length != expected_length || memcmp(actual->data, expected->data, actual_length) != 0)
+        return 1;
+
+    expected->length = actual->length = 0;
+    strbuf_append_json_using(expected, (const char *)input, length, reference);
+    strbuf_append_json_using(actual, (const char *)input, length, kernels);
+    return actual->length != expected->length || memcmp(actual->data, expected->data, actual->length) != 0;
+}
+
+// Function to test a kernel set against the scalar reference. Every length
+// gets runs of one to KERNEL_TEST_MAX_RUN whitespace bytes starting at every
+// position, so that some end in the last lane of a block and some cross
+// into the next, and each byte of kernel_test_bytes at every position.
+// Returns the number of inputs on which they differ, with the inputs tried.
+static int test_text_kernels(const text_kernels_t *kernels, int *cases)
+{
+    size_t space_count = sizeof(kernel_test_spaces);
+    strbuf_t expected = {0}, actual = {0};
+    unsigned char input[64];
+    int failures = 0;
+    *cases = 0;
+
+    for (size_t l = 0; l < sizeof(kernel_test_lengths) / sizeof(kernel_test_lengths[0]); l++)
     {
-        remove_unwanted_tags(body);
-        xmlNode *article_content = NULL;
-        extract_article_content(body, &article_content);
-        if (article_content)
+        size_t length = kernel_test_lengths[l];
+        for (size_t start = 0; start < length; start++)
         {
-            FILE *temp_file = tmpfile();
-            if (temp_file)
+            for (size_t run = 1; run <= KERNEL_TEST_MAX_RUN; run++)
             {
-                html_to_markdown(article_content, temp_file, 0);
-                fseek(temp_file, 0, SEEK_SET);
-                int c;
-                while ((c = fgetc(temp_file)) != EOF)
+                // A run repeats one whitespace byte, or steps through them
+                // all from the one given by its number modulo space_count
+                for (size_t mix = 0; mix < space_count * 2; mix++)
                 {
-                    if (json_output && c == '"') putchar('\\');
-                    if (json_output && c == '\n') printf("\\n");
-                    else putchar(c);
+                    for (size_t i = 0; i < length; i++)
+                        input[i] = (unsigned char)('a' + i % 26);
+                    for (size_t i = start; i < start + run && i < length; i++)
+                        input[i] = kernel_test_spaces[(mix + (mix < space_count ? 0 : i)) % space_count];
+                    failures += kernel_case_differs(kernels, input, length, &expected, &actual);
+                    (*cases)++;
                 }
-                fclose(temp_file);
             }
-            xmlFreeNode(article_content);
+
+            for (size_t b = 0; b < sizeof(kernel_test_bytes); b++)
+            {
+                for (size_t i = 0; i < length; i++)
+                    input[i] = (unsigned char)('a' + i % 26);
+                input[start] = kernel_test_bytes[b];
+                failures += kernel_case_differs(kernels, input, length, &expected, &actual);
+                (*cases)++;
+            }
         }
-        else
+    }
+
+    strbuf_free(&expected);
+    strbuf_free(&actual);
+    return failures;
+}
+
+// Function to time the scoring of the corpus pages of PARALLEL_MIN_BYTES or
+// more on threads threads, iterations times each, and check that it picks
+// the same article nodes as one thread does. Returns the number of pages
+// for which it does not, with the pages timed and the seconds they took.
+static int bench_scoring_threads(readability_context_t *ctx, const input_buffer_t *inputs, int count, int iterations,
+                                 int threads, int *pages, double *seconds)
+{
+    int mismatches = 0;
+    *pages = 0;
+    *seconds = 0.0;
+    article_nodes_t reference = {0};
+    for (int i = 0; i < count; i++)
+    {
+        if (inputs[i].size < PARALLEL_MIN_BYTES)
+            continue;
+        budget_start(ctx);
+        htmlDocPtr doc = read_document(inputs[i].data, (int)budget_input(ctx, inputs[i].size), NULL);
+        xmlNode *root = doc ? xmlDocGetRootElement(doc) : NULL;
+        if (!root)
+        {
+            if (doc)
+                free_document(doc);
+            continue;
+        }
+
+        arena_t *previous = arena_enter(doc->_private);
+        remove_unwanted_tags(root, &ctx->budget);
+        extract_article_content(root, 0, &reference, ctx->matcher, &ctx->budget, NULL, 1, NULL);
+        int differs = 0;
+        for (int iteration = 0; iteration < iterations; iteration++)
         {
-            fprintf(stderr, "Error: Failed to extract article content\n");
+            double started = now_seconds();
+            extract_article_content(root, 0, &ctx->nodes, ctx->matcher, &ctx->budget, context_pool(ctx, threads), threads,
+                                    NULL);
+            *seconds += now_seconds() - started;
+            differs |= ctx->nodes.count != reference.count || ctx->nodes.top != reference.top ||
+                       (reference.count && memcmp(ctx->nodes.nodes, reference.nodes,
+                                                  (size_t)reference.count * sizeof(xmlNodePtr)) != 0);
         }
+        arena_leave(previous);
+        free_document(doc);
+        mismatches += differs;
+        (*pages)++;
     }
+    free_article_nodes(&reference);
+    return mismatches;
+}
 
-    if (json_output)
+// Function to test every vector kernel set the processor supports against
+// the scalar reference, one report line per set
+int readability_self_test(readability_sink_fn sink, void *userdata)
+{
+    strbuf_t report = {0};
+    char line[MAX_BUFFER];
+    int failures = 0;
+    for (size_t k = 1; k < TEXT_KERNEL_COUNT; k++)
     {
-        printf("\"\n}\n");
+        const text_kernels_t *kernels = &text_kernel_table[k];
+        if (!kernels->supported())
+            continue;
+        int cases;
+        int failed = test_text_kernels(kernels, &cases);
+        failures += failed;
+        snprintf(line, sizeof(line), "%-8s %d of %d inputs differ from scalar\n", kernels->name, failed, cases);
+        strbuf_puts(&report, line);
     }
+    if (report.length == 0)
+        strbuf_puts(&report, "no vector kernels on this processor\n");
 
-    if (title) xmlFree(title);
-    if (author) free(author);
-    if (description) free(description);
-    if (site_name) free(site_name);
-    if (published_time) free(published_time);
+    int status = sink(report.data, report.length, userdata) < 0 || failures ? 1 : 0;
+    strbuf_free(&report);
+    return status;
 }
 
-int main(int argc, char **argv)
+// Function to run every saved page in a directory through the pipeline stage
+// by stage and report wall-time percentiles, throughput and peak RSS, then
+// time the text kernels on the raw pages and the scoring of the largest
+// pages on more and more threads
+int readability_benchmark(readability_context_t *ctx, const char *dir_path, int iterations, int json_output,
+                          readability_sink_fn sink, void *userdata)
 {
-    clock_t start_time = clock();
-    if (argc < 2 || argc > 3)
+    int file_count = 0;
+    char **paths = list_corpus(dir_path, &file_count);
+    if (!paths || file_count == 0)
     {
-        fprintf(stderr, "Usage: %s <url> [-json]\n", argv[0]);
+        set_error(ctx, "no documents found in %s", dir_path);
+        free(paths);
         return 1;
     }
 
-    const char *url = argv[1];
-    int json_output = (argc == 3 && strcmp(argv[2], "-json") == 0);
-
-    char *html_content = fetch_url(url);
-
-    if (html_content)
+    input_buffer_t *inputs = calloc((size_t)file_count, sizeof(input_buffer_t));
+    int loaded = 0, skipped = 0;
+    size_t corpus_bytes = 0;
+    for (int i = 0; inputs && i < file_count; i++)
     {
-        htmlDocPtr doc = htmlReadMemory(html_content, strlen(html_content), NULL, NULL, HTML_PARSE_RECOVER | HTML_PARSE_NOERROR | HTML_PARSE_NOWARNING);
-
-        if (doc == NULL)
+        if (load_input(paths[i], &inputs[loaded]) < 0 || inputs[loaded].size == 0 || inputs[loaded].size > INT_MAX)
         {
-            fprintf(stderr, "Error: unable to parse HTML\n");
-            free(html_content);
-            return 1;
+            free_input(&inputs[loaded]);
+            skipped++;
+            continue;
         }
+        corpus_bytes += inputs[loaded].size;
+        loaded++;
+    }
 
-        extract_article(doc, url, json_output);
+    if (iterations < 1)
+        iterations = 1;
+    int sample_count = loaded * iterations;
+    double *samples[STAGE_COUNT];
+    for (int s = 0; s < STAGE_COUNT; s++)
+        samples[s] = calloc((size_t)(sample_count > 0 ? sample_count : 1), sizeof(double));
 
-        xmlFreeDoc(doc);
-        free(html_content);
+    strbuf_t *markdown = &ctx->content;
+    int samples_taken = 0, failures = 0;
+    double total_wall = 0.0;
+    size_t output_bytes = 0;
 
-        if (!json_output)
+    for (int iteration = 0; iteration < iterations; iteration++)
+    {
+        for (int i = 0; i < loaded; i++)
         {
-            printf("\n\nArticle extracted\n");
+            double t0 = now_seconds();
+            budget_start(ctx);
+            htmlDocPtr doc = read_document(inputs[i].data, (int)budget_input(ctx, inputs[i].size), NULL);
+            double t1 = now_seconds();
+            xmlNode *root = doc ? xmlDocGetRootElement(doc) : NULL;
+            if (!root)
+            {
+                failures++;
+                if (doc)
+                    free_document(doc);
+                continue;
+            }
+
+            arena_t *previous = arena_enter(doc->_private);
+            remove_unwanted_tags(root, &ctx->budget);
+            double t2 = now_seconds();
+
+            int threads = inputs[i].size >= PARALLEL_MIN_BYTES ? ctx->threads : 1;
+            extract_article_content(root, 0, &ctx->nodes, ctx->matcher, &ctx->budget, context_pool(ctx, threads), threads,
+                                    NULL);
+            double t3 = now_seconds();
+
+            markdown->length = 0;
+            render_article(&ctx->nodes, markdown, NULL, &ctx->budget);
+            double t4 = now_seconds();
+            arena_leave(previous);
+            free_document(doc);
+
+            samples[STAGE_PARSE][samples_taken] = t1 - t0;
+            samples[STAGE_CLEANUP][samples_taken] = t2 - t1;
+            samples[STAGE_EXTRACT][samples_taken] = t3 - t2;
+            samples[STAGE_RENDER][samples_taken] = t4 - t3;
+            samples[STAGE_TOTAL][samples_taken] = t4 - t0;
+            samples_taken++;
+            total_wall += t4 - t0;
+            output_bytes += markdown->length;
         }
     }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double processed_mb = (double)corpus_bytes * iterations / (1024.0 * 1024.0);
+    double mb_per_second = total_wall > 0 ? processed_mb / total_wall : 0.0;
+    double docs_per_second = total_wall > 0 ? samples_taken / total_wall : 0.0;
+
+    strbuf_t report = {0};
+    char line[MAX_BUFFER];
+    if (json_output)
+    {
+        snprintf(line, sizeof(line),
+                 "{\n  \"documents\": %d,\n  \"skipped\": %d,\n  \"iterations\": %d,\n  \"failures\": %d,\n"
+                 "  \"inputBytes\": %zu,\n  \"outputBytes\": %zu,\n  \"wallSeconds\": %.6f,\n"
+                 "  \"throughputMBps\": %.3f,\n  \"docsPerSecond\": %.3f,\n  \"peakRssKB\": %ld,\n  \"stages\": {",
+                 loaded, skipped, iterations, failures, corpus_bytes, output_bytes, total_wall, mb_per_second,
+                 docs_per_second, usage.ru_maxrss);
+        strbuf_puts(&report, line);
+    }
     else
     {
-        fprintf(stderr, "Error: unable to fetch URL\n");
-        return 1;
+        snprintf(line, sizeof(line),
+                 "Documents: %d x %d iterations (%d failed, %d skipped)\nInput: %.2f MB\nWall time: %.3f seconds\n"
+                 "Throughput: %.2f MB/s, %.1f docs/s\nPeak RSS: %ld MB\n\n"
+                 "%-8s %10s %10s %10s %10s %10s\n",
+                 loaded, iterations, failures, skipped, (double)corpus_bytes / (1024.0 * 1024.0), total_wall,
+                 mb_per_second, docs_per_second, usage.ru_maxrss / 1024,
+                 "stage", "mean ms", "p50 ms", "p90 ms", "p99 ms", "max ms");
+        strbuf_puts(&report, line);
     }
 
-    if (!json_output)
+    for (int s = 0; s < STAGE_COUNT; s++)
     {
-        clock_t end_time = clock();
-        double execution_time = (double)(end_time - start_time) / CLOCKS_PER_SEC;
-        printf("Execution time: %f seconds\n", execution_time);
+        double sum = 0.0;
+        for (int i = 0; i < samples_taken; i++)
+            sum += samples[s][i];
+        qsort(samples[s], (size_t)samples_taken, sizeof(double), compare_doubles);
+
+        double mean = samples_taken ? sum / samples_taken * 1000.0 : 0.0;
+        double p50 = percentile(samples[s], samples_taken, 50) * 1000.0;
+        double p90 = percentile(samples[s], samples_taken, 90) * 1000.0;
+        double p99 = percentile(samples[s], samples_taken, 99) * 1000.0;
+        double max = samples_taken ? samples[s][samples_taken - 1] * 1000.0 : 0.0;
 
-        struct rusage usage;
-        getrusage(RUSAGE_SELF, &usage);
-        printf("Memory usage: %ld MB\n", usage.ru_maxrss / 1024);
+        if (json_output)
+            snprintf(line, sizeof(line),
+                     "%s\n    \"%s\": {\"meanMs\": %.4f, \"p50Ms\": %.4f, \"p90Ms\": %.4f, \"p99Ms\": %.4f, \"maxMs\": %.4f}",
+                     s ? "," : "", stage_names[s], mean, p50, p90, p99, max);
+        else
+            snprintf(line, sizeof(line), "%-8s %10.3f %10.3f %10.3f %10.3f %10.3f\n",
+                     stage_names[s], mean, p50, p90, p99, max);
+        strbuf_puts(&report, line);
+        free(samples[s]);
     }
+    // Every kernel set the processor supports is checked against the
+    // scalar reference; a difference fails the benchmark
+    int kernel_mismatches = 0;
+    strbuf_puts(&report, json_output ? "\n  },\n  \"kernels\": {"
+                                     : "\nkernels  whitespace MB/s   escape MB/s   mismatches\n");
+    for (size_t k = 0; k < TEXT_KERNEL_COUNT; k++)
+    {
+        const text_kernels_t *kernels = &text_kernel_table[k];
+        if (!kernels->supported())
+            continue;
+        double whitespace_mbps, escape_mbps;
+        int mismatches = bench_text_kernels(kernels, inputs, loaded, iterations, &whitespace_mbps, &escape_mbps);
+        kernel_mismatches += mismatches;
 
-    return 0;
-}
\ No newline at end of file
+        if (json_output)
+            snprintf(line, sizeof(line),
+                     "%s\n    \"%s\": {\"whitespaceMBps\": %.1f, \"escapeMBps\": %.1f, \"mismatches\": %d}",
+                     k ? "," : "", kernels->name, whitespace_mbps, escape_mbps, mismatches);
+        else
+            snprintf(line, sizeof(line), "%-8s %15.1f %13.1f %12d%s\n", kernels->name, whitespace_mbps, escape_mbps,
+                     mismatches, kernels == text_kernels ? " (in use)" : "");
+        strbuf_puts(&report, line);
+    }
+
+    // Scoring runs on 1, 2, 4... threads up to the context's count, or one
+    // per CPU, and every count must find the article one thread finds
+    long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = ctx->threads > 1 ? ctx->threads : cpu_count > 1 ? (int)cpu_count : 1;
+    if (max_threads > PARALLEL_MAX_THREADS)
+        max_threads = PARALLEL_MAX_THREADS;
+    int scoring_mismatches = 0;
+    double single_seconds = 0.0;
+    strbuf_puts(&report, json_output ? "\n  },\n  \"scoringThreads\": {"
+                                     : "\nthreads  scoring ms   speedup   mismatches\n");
+    for (int threads = 1, last = 0; !last; threads *= 2)
+    {
+        if (threads >= max_threads)
+        {
+            threads = max_threads;
+            last = 1;
+        }
+        int pages;
+        double seconds;
+        int mismatches = bench_scoring_threads(ctx, inputs, loaded, iterations, threads, &pages, &seconds);
+        scoring_mismatches += mismatches;
+        if (pages == 0)
+        {
+            if (!json_output)
+                strbuf_puts(&report, "(no pages of 1 MB or more)\n");
+            break;
+        }
+        if (threads == 1)
+            single_seconds = seconds;
+
+        double mean = seconds / (pages * iterations) * 1000.0;
+        double speedup = seconds > 0 ? single_seconds / seconds : 0.0;
+        if (json_output)
+            snprintf(line, sizeof(line),
+                     "%s\n    \"%d\": {\"pages\": %d, \"meanMs\": %.4f, \"speedup\": %.2f, \"mismatches\": %d}",
+                     threads > 1 ? "," : "", threads, pages, mean, speedup, mismatches);
+        else
+            snprintf(line, sizeof(line), "%-8d %10.3f %9.2fx %12d\n", threads, mean, speedup, mismatches);
+        strbuf_puts(&report, line);
+    }
+    if (json_output)
+        strbuf_puts(&report, "\n  }\n}\n");
+
+    int status = 1;
+    if (sink(report.data, report.length, userdata) < 0)
+        set_error(ctx, "unable to write output");
+    else if (kernel_mismatches)
+        set_error(ctx, "text kernels differ from the scalar reference on %d documents", kernel_mismatches);
+    else if (scoring_mismatches)
+        set_error(ctx, "parallel scoring differs from one thread on %d documents", scoring_mismatches);
+    else
+        status = 0;
+    strbuf_free(&report);
+
+    for (int i = 0; i < loaded; i++)
+        free_input(&inputs[i]);
+    free(inputs);
+    for (int i = 0; i < file_count; i++)
+        free(paths[i]);
+    free(paths);
+    return status;
+}
@@ -0,0 +1,260 @@
+#ifndef READABILITY_H
+#define READABILITY_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include <libxml/HTMLparser.h>
+
+// Output formats: the text header plus Markdown, one pretty-printed JSON
+// document, one JSON object per line, or length-prefixed CBOR records that
+// also carry the byte ranges of the links and blocks of the Markdown (see
+// README.md for their layout)
+typedef enum
+{
+    READABILITY_TEXT,
+    READABILITY_JSON,
+    READABILITY_NDJSON,
+    READABILITY_CBOR
+} readability_format_t;
+
+// Formats of readability_metrics_write: the Prometheus text exposition
+// format, or a single line of JSON
+typedef enum
+{
+    READABILITY_METRICS_PROMETHEUS,
+    READABILITY_METRICS_JSON
+} readability_metrics_format_t;
+
+// Extraction engines: the default parses each document into a tree and
+// scores it; the streaming engine scores and renders during a single SAX
+// pass in bounded memory, for huge pages, and applies to buffers, files and
+// stdin (fetched URLs and readability_extract_doc always use the tree)
+typedef enum
+{
+    READABILITY_ENGINE_DOM,
+    READABILITY_ENGINE_STREAM
+} readability_engine_t;
+
+// Readerable checks: none; skipping the documents that are probably not
+// articles, such as index, tag or login pages, before any cleanup, scoring
+// or rendering, so that the call fails with "not readerable"; or only
+// telling whether each document probably is one. The check needs the tree,
+// so it makes documents use READABILITY_ENGINE_DOM.
+typedef enum
+{
+    READABILITY_CHECK_NONE,
+    READABILITY_CHECK_SKIP,
+    READABILITY_CHECK_ONLY
+} readability_check_t;
+
+// Receives rendered output, one whole document (or report) per call.
+// Returns 0 to carry on, or -1 to make the call that produced it fail.
+typedef int (*readability_sink_fn)(const char *data, size_t length, void *userdata);
+
+// Receives rendered output as pieces to be written one after the other, for
+// instance with writev, so that the Markdown of a CBOR record reaches it
+// without being copied into the record. Returns like readability_sink_fn.
+typedef int (*readability_sinkv_fn)(const struct iovec *pieces, int count, void *userdata);
+
+// Work limits of a context; zero leaves a dimension unlimited. A document
+// that hits a limit is still extracted, along a cheaper path, and its output
+// names the limits that were hit.
+typedef struct
+{
+    size_t max_input_bytes; // longer inputs are cut short
+    long max_nodes;         // elements examined by cleanup and by scoring
+    int max_depth;          // deeper subtrees are rendered as plain text
+    long max_milliseconds;  // past this, scoring and rendering stop early
+} readability_limits_t;
+
+// How pages are downloaded; zero leaves a setting unlimited. Redirects are
+// followed up to max_redirects, and a download whose body would exceed
+// max_body_bytes fails.
+typedef struct
+{
+    long connect_timeout_ms;
+    long timeout_ms;      // whole transfer, including redirects
+    int max_redirects;    // negative to not follow redirects at all
+    size_t max_body_bytes;
+} readability_fetch_options_t;
+
+// Extraction state of one thread: the compiled class/id patterns, the cache
+// to fetch through and scratch buffers reused from one document to the next.
+// A context must not be used by two threads at once; give each thread its
+// own.
+typedef struct readability_context readability_context_t;
+
+// On-disk cache of extraction results keyed by URL, revalidated with
+// conditional requests. One cache may be shared by any number of contexts
+// and threads.
+typedef struct readability_cache readability_cache_t;
+
+// Where the articles of each site sit in its pages, learned from full
+// scoring and tried first on later pages of the same host, kept in a file
+// and bounded in the number of sites. One store may be shared by any number
+// of contexts and threads.
+typedef struct readability_templates readability_templates_t;
+
+// Function to set up libxml2 and libcurl for the library. Must be called
+// once before any other libxml2 use in the process, because it installs the
+// allocator hooks that parse each document into its own arena. Safe to call
+// more than once. DNS results, connections and TLS sessions are shared by
+// every fetch in the process until readability_global_cleanup.
+int readability_global_init(void);
+
+// Function to release what readability_global_init set up, once every
+// context and cache is gone
+void readability_global_cleanup(void);
+
+// Function to create a context with the class/id patterns of patterns_path,
+// or the built-in lists when it is NULL. Returns NULL with errno set on
+// failure, to EINVAL when the patterns file is malformed.
+readability_context_t *readability_context_new(const char *patterns_path);
+
+// Function to free a context; its cache, if any, stays open
+void readability_context_free(readability_context_t *ctx);
+
+// Function to make a context fetch URLs through cache (NULL for none)
+void readability_context_set_cache(readability_context_t *ctx, readability_cache_t *cache);
+
+// Function to let a context score documents of 1 MB of HTML or more on up
+// to threads threads (at most 64), which find the same article as one
+// thread does. New contexts use one; documents extracted under a node or
+// time limit always do. The extra threads are started for the first such
+// document and kept until readability_context_free.
+void readability_context_set_threads(readability_context_t *ctx, int threads);
+
+// Function to make a context learn the templates of the sites it extracts
+// into templates, and score their later pages around the container the
+// template names (NULL for none). A page on which that container is
+// missing, or no longer wins the scoring of its surroundings, is scored
+// whole and its template learned again.
+void readability_context_set_templates(readability_context_t *ctx, readability_templates_t *templates);
+
+// Function to set the readerable check of a context; new contexts use
+// READABILITY_CHECK_NONE. With READABILITY_CHECK_ONLY, each document is
+// rendered as its URL and whether it is readerable, and the cache is
+// neither read nor written.
+void readability_context_set_check(readability_context_t *ctx, readability_check_t check);
+
+// Function to set the work limits of a context. New contexts only limit
+// the rendering depth, to 512.
+void readability_context_set_limits(readability_context_t *ctx, const readability_limits_t *limits);
+
+// Function to set how a context downloads pages. New contexts time out
+// after 10 s connecting or 30 s overall, follow up to 5 redirects and
+// refuse bodies over 64 MB.
+void readability_context_set_fetch_options(readability_context_t *ctx, const readability_fetch_options_t *options);
+
+// Function to send a trace record of every document the context extracts
+// to sink: one JSON line with the time spent in each stage and the sizes
+// and counts of the document. NULL stops tracing. Server workers inherit
+// the sink, so it may be called from several threads at once.
+void readability_context_set_trace(readability_context_t *ctx, readability_sink_fn sink, void *userdata);
+
+// Function to make a context hand documents to sinkv rather than to the sink
+// passed with each call, which still gets error records; userdata is still
+// the one passed with each call. NULL goes back to the plain sink.
+void readability_context_set_sinkv(readability_context_t *ctx, readability_sinkv_fn sinkv);
+
+// Function to choose the engine that extracts documents; new contexts use
+// READABILITY_ENGINE_DOM
+void readability_context_set_engine(readability_context_t *ctx, readability_engine_t engine);
+
+// Function to return why the last call on a context failed
+const char *readability_error(const readability_context_t *ctx);
+
+// Function to tell whether the last document a context extracted yielded
+// article content: 1, or 0 when nothing in it scored as one and the
+// rendering holds only its metadata
+int readability_found_article(const readability_context_t *ctx);
+
+// Function to parse and extract an HTML buffer. url, when given, is reported
+// as the document URL and used to resolve links. Returns 0, or -1 with
+// readability_error set.
+int readability_extract_html(readability_context_t *ctx, const char *html, size_t size, const char *url,
+                             readability_format_t format, readability_sink_fn sink, void *userdata);
+
+// Function to extract an already parsed document, which stays the caller's.
+// Unwanted elements are removed from it, and the _private field of its
+// nodes is used as scratch space during the call.
+int readability_extract_doc(readability_context_t *ctx, htmlDocPtr doc, const char *url,
+                            readability_format_t format, readability_sink_fn sink, void *userdata);
+
+// Function to tell, in one cheap pass over an already parsed document that
+// stays the caller's, whether it is probably an article, the way
+// Readability.js's isProbablyReaderable does: its visible <p>, <pre> and
+// <article> elements, and <div>s holding a <br>, need enough text between
+// them, not counting those whose class or id only match the context's
+// negative patterns, nor paragraphs within list items. Returns 1 or 0.
+int readability_is_probably_readerable(readability_context_t *ctx, htmlDocPtr doc);
+
+// Function to read and extract a file ("-" for stdin); see
+// readability_extract_html for base_url
+int readability_extract_file(readability_context_t *ctx, const char *path, const char *base_url,
+                             readability_format_t format, readability_sink_fn sink, void *userdata);
+
+// Function to fetch and extract a URL, through the context's cache if it
+// has one
+int readability_extract_url(readability_context_t *ctx, const char *url, readability_format_t format,
+                            readability_sink_fn sink, void *userdata);
+
+// Function to tell whether a source names a URL rather than a file
+int readability_is_url(const char *source);
+
+// Function to open the cache in dir, creating the directory if needed.
+// max_bytes bounds its size; entries younger than ttl seconds are served
+// without revalidation. Returns NULL with errno set on failure.
+readability_cache_t *readability_cache_open(const char *dir, size_t max_bytes, long ttl);
+
+// Function to close a cache; the entries stay on disk for the next run
+void readability_cache_close(readability_cache_t *cache);
+
+// Function to open the template store in path, loading the templates saved
+// in it if it exists. It keeps the templates of up to max_hosts sites,
+// forgetting the least recently used ones beyond. Returns NULL with errno
+// set on failure, to EINVAL when path is not a template file.
+readability_templates_t *readability_templates_open(const char *path, int max_hosts);
+
+// Function to close a template store, writing its templates back to its
+// file if any changed; call it once no context uses the store. Returns 0, or
+// -1 with errno set when they could not be written.
+int readability_templates_close(readability_templates_t *templates);
+
+// Function to extract every URL or file path listed one per line in
+// list_path ("-" for stdin), writing one record per document to the sink,
+// normally as READABILITY_NDJSON or READABILITY_CBOR. URLs are fetched
+// concurrently. Returns the number of documents that failed, or -1 with
+// readability_error set when the batch could not run.
+int readability_run_batch(readability_context_t *ctx, const char *list_path, int concurrency, int per_host,
+                          readability_format_t format, readability_sink_fn sink, void *userdata);
+
+// Function to run the extraction server on a TCP "[host:]port" or a
+// "unix:path" address until SIGINT or SIGTERM. Pages requested by URL are
+// downloaded on the calling thread with the fetch options of ctx, and every
+// worker thread gets its own context with the patterns, the cache, the
+// templates, the limits and the readerable check of ctx. Returns 0 on a
+// clean shutdown, or 1 with readability_error set.
+int readability_serve(readability_context_t *ctx, const char *address, int worker_count, int queue_size);
+
+// Function to write the metrics of every context of the process, live or
+// freed: latency histograms per stage, documents, failures by reason, bytes
+// in and out, and element, paragraph and candidate counts. Returns what the
+// sink returns.
+int readability_metrics_write(readability_metrics_format_t format, readability_sink_fn sink, void *userdata);
+
+// Function to run every saved page in a directory through the pipeline stage
+// by stage, writing wall-time percentiles, throughput and peak RSS to the
+// sink as text or JSON. Returns 0, or 1 with readability_error set when there
+// was nothing to run or a kernel set or thread count changed the results.
+int readability_benchmark(readability_context_t *ctx, const char *dir_path, int iterations, int json_output,
+                          readability_sink_fn sink, void *userdata);
+
+// Function to test the SSE2 and AVX2 text kernels the processor supports
+// against the scalar ones on inputs around one and two vector blocks long,
+// with whitespace runs and bytes to escape at every position, writing one
+// line per kernel set to the sink. Returns 0, or 1 when any input comes out
+// differently or the sink fails.
+int readability_self_test(readability_sink_fn sink, void *userdata);
+
+#endif